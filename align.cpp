@@ -5,6 +5,8 @@
 #include<utility>
 #include<algorithm>
 #include<list>
+#include<memory>
+#include<future>
 #include<stdexcept>
 #include"params.h"
 #include"text.h"
@@ -16,42 +18,85 @@ using std::list;
 using std::vector;
 using std::pair;
 using std::runtime_error;
+using std::string;
 
 namespace Align {
-//////////////////////////// Candidates ///////////////////////////////////////
 
-Candidates::Candidates(const Dictionary& dict) {
-    _dict = &dict;
+//////////////////////////// SkipIndex ////////////////////////////////////////
+
+void SkipIndex::reset(size_t n) {
+    _next.resize(n + 1);
+    for (size_t index = 0; index <= n; ++index)
+        _next[index] = index;
 }
 
+//////////////////////////// Candidates ///////////////////////////////////////
+
+Candidates::Candidates(AlignContext* context, const Dictionary& dict)
+    : _context(context), _dict(&dict), _offsets(1, 0), _first_position(0) {}
+
 void Candidates::collect() {
-    for (const WordToken& word : *_dict->get_e()) {
+    collect(0, _dict->get_e()->length(), 0, _dict->get_f()->length());
+}
+
+void Candidates::collect(int e_begin, int e_end, int f_begin, int f_end) {
+    const Text &e_text = *_dict->get_e(),
+               &f_text = *_dict->get_f();
+
+    _sources.clear();
+    _offsets.assign(1, 0);
+    _targets.clear();
+    _remaining.clear();
+    _first_position = e_begin;
+    _slot_after.assign(e_end - e_begin, 0);
+
+    for (int e_pos = e_begin; e_pos < e_end; ++e_pos) {
+        const WordToken word = e_text[e_pos];
+        _slot_after[e_pos - e_begin] = _sources.size();
         if (!_dict->has(word))
             continue;
 
-        list<WordType> f_types = _dict->lookup(word);
-        list<WordToken>* f_tokens = new list<WordToken>();
-        for (const WordType& f_type : f_types)
-            for (const WordToken& f_token : f_type.get_tokens())
-                f_tokens->push_back(f_token);
+        for (type_id f_type : _dict->lookup(word)) {
+            PositionRange positions = f_text.type(f_type).positions();
+            // positions are ascending, so the ones in range are too
+            _targets.insert(_targets.end(),
+                            std::lower_bound(positions.begin(),
+                                             positions.end(), f_begin),
+                            std::lower_bound(positions.begin(),
+                                             positions.end(), f_end));
+        }
 
-        _translations[word] = f_tokens;
+        _sources.push_back(e_pos);
+        _offsets.push_back(_targets.size());
+        _remaining.push_back(_offsets.back() - _offsets[slots() - 1]);
     }
+    // so far, this has the first slot at or after each position,
+    // the first slot after pos is the one at or after pos+1
+    for (size_t pos = 0; pos + 1 < _slot_after.size(); ++pos)
+        _slot_after[pos] = _slot_after[pos + 1];
+    if (!_slot_after.empty())
+        _slot_after.back() = slots();
+
+    _unused.reset(_targets.size());
+    _nonempty.reset(slots());
+    for (size_t slot = 0; slot < slots(); ++slot)
+        if (_remaining[slot] == 0)
+            _nonempty.remove(slot);
 }
 
-Candidates::~Candidates() {
-    for (auto tr = _translations.begin();
-         tr != _translations.end();
-         ++tr)
-        delete tr->second;
+void Candidates::use(size_t slot, size_t index) {
+    _unused.remove(index);
+    if (--_remaining[slot] == 0)
+        _nonempty.remove(slot);
 }
 
 ///////////////////////// AlignMake ///////////////////////////////////
 
-AlignMake::AlignMake(Candidates* c) {
+AlignMake::AlignMake(Candidates* c)
+    : _join_kernel(WINDOW_JOIN), _dict(c->_dict), scoring_methods(_dict) {
     this->_candidates = c;
-    this->_dict = c->_dict;
-    this->hypothesis = new Hypothesis(*_dict);
+    this->_context = c->_context;
+    this->hypothesis = new Hypothesis(_context, *_dict);
 }
 
 AlignMake::~AlignMake() {
@@ -59,56 +104,266 @@ AlignMake::~AlignMake() {
 }
 
 AlignMake& AlignMake::initial_sequences() {
-    for (auto cand1 = _candidates->begin();
-         cand1 != _candidates->end(); ++cand1) {
-        if (cand1->second->empty())
+    Candidates& cand = *_candidates;
+    const size_t max_skip = _context->params().max_skip();
+    const bool monotony = _context->params().monotony();
+
+    for (size_t slot1 = 0; slot1 < cand.slots(); ++slot1) {
+        if (cand.remaining(slot1) == 0)
             continue;
 
-        auto cand2 = cand1;
-        ++cand2;
-        int skipped = 0;
-        while (skipped <= Params::get().max_skip()
-            && cand2 != _candidates->end()
-            && cand2->second->empty()) {
-            ++skipped;
-            ++cand2;
+        // slots without candidates in between count as skipped
+        size_t slot2 = cand.next_nonempty(slot1 + 1);
+        if (slot2 == cand.slots()
+         || slot2 - slot1 - 1 > max_skip)
+            continue;
+
+        if (_join_kernel == WINDOW_JOIN)
+            join_window(slot1, slot2);
+        else if (monotony)
+            join_nested<true>(slot1, slot2);
+        else
+            join_nested<false>(slot1, slot2);
+    }
+
+    return *this;
+}
+
+template<bool Monotone>
+void AlignMake::join_nested(size_t slot1, size_t slot2) {
+    Candidates& cand = *_candidates;
+    const Text& f_text = *_dict->get_f();
+    const int closeness = _context->params().closeness();
+
+    const WordToken e1 = cand.source(slot1),
+                    e2 = cand.source(slot2);
+    size_t end1 = cand.slot_end(slot1),
+           end2 = cand.slot_end(slot2),
+           f1 = cand.next_unused(cand.slot_begin(slot1));
+
+    while (f1 < end1) {
+        bool f1_used = false;
+        size_t f2 = cand.next_unused(cand.slot_begin(slot2));
+        // f1 may run out while we're still looking at f2
+        while (f2 < end2 && f1 < end1) {
+            WordToken t1 = f_text[cand.target(f1)],
+                      t2 = f_text[cand.target(f2)];
+            if (t1.position() < t2.position()
+             && t1.close_to<Monotone>(t2, closeness)) {
+                hypothesis->new_sequence(Pair(e1, t1))
+                                        ->add(Pair(e2, t2));
+                f1_used = true;
+                cand.use(slot1, f1);
+                cand.use(slot2, f2);
+                f1 = cand.next_unused(f1);
+                f2 = cand.next_unused(f2);
+            } else {
+                f2 = cand.next_unused(f2 + 1);
+            }
         }
+        if (!f1_used)
+            f1 = cand.next_unused(f1 + 1);
+    }
+}
 
-        if (skipped > Params::get().max_skip()
-         || cand2 == _candidates->end())
+/*
+ * join_nested() matches each f1 with the first f2 that follows it
+ * closely enough. It looks for that f2 starting after the f2 of the
+ * previous match, if the previous f1 had one, and wraps around at the
+ * end of the slot. So f1 gets the first match in that cyclic order,
+ * and that's what this does as well.
+ *
+ * The candidates of a slot are ascending runs of positions, one for
+ * each translation. In each run, the matches for f1 are a window
+ * between f1 and f1 + closeness, and as long as f1 ascends as well,
+ * the windows only move forward.
+ */
+void AlignMake::join_window(size_t slot1, size_t slot2) {
+    Candidates& cand = *_candidates;
+    const Text& f_text = *_dict->get_f();
+    const int closeness = _context->params().closeness();
+
+    const WordToken e1 = cand.source(slot1),
+                    e2 = cand.source(slot2);
+    size_t begin2 = cand.slot_begin(slot2),
+           end1 = cand.slot_end(slot1),
+           end2 = cand.slot_end(slot2);
+
+    _windows.clear();
+    for (size_t run = begin2; run < end2;) {
+        size_t run_end = run + 1;
+        while (run_end < end2
+            && cand.target(run_end) > cand.target(run_end - 1))
+            ++run_end;
+        Window window = { run, run, run, run_end };
+        _windows.push_back(window);
+        run = run_end;
+    }
+
+    size_t start = begin2;
+    int previous = -1;
+    for (size_t f1 = cand.next_unused(cand.slot_begin(slot1));
+         f1 < end1;
+         f1 = cand.next_unused(f1 + 1)) {
+        int pos1 = cand.target(f1);
+        if (pos1 < previous)
+            for (Window& window : _windows)
+                window.begin = window.end = window.run_begin;
+        previous = pos1;
+
+        // first match at or after start, and before start
+        size_t after = end2,
+               before = end2;
+        for (Window& window : _windows) {
+            while (window.begin < window.run_end
+                && cand.target(window.begin) <= pos1)
+                ++window.begin;
+            if (window.end < window.begin)
+                window.end = window.begin;
+            while (window.end < window.run_end
+                && cand.target(window.end) - pos1 <= closeness)
+                ++window.end;
+
+            size_t match = cand.next_unused(std::max(window.begin, start));
+            if (match < window.end)
+                after = std::min(after, match);
+            match = cand.next_unused(window.begin);
+            if (match < std::min(window.end, start))
+                before = std::min(before, match);
+        }
+
+        size_t f2 = after < end2 ? after : before;
+        if (f2 == end2) {
+            start = begin2;
             continue;
+        }
 
-        const WordToken& e1 = cand1->first,
-                         e2 = cand2->first;
-        list<WordToken> *e1_translations = cand1->second,
-                        *e2_translations = cand2->second;
-        auto f1 = e1_translations->begin(),
-             f2 = e2_translations->begin();
-
-        while (f1 != e1_translations->end()) {
-            bool f1_used = false;
-            f2 = e2_translations->begin();
-            while (f2 != e2_translations->end()) {
-                if (f1->position() < f2->position()
-                    && f1->close_to(*f2)) {
-                    hypothesis->new_sequence(Pair(e1, *f1))
-                                            ->add(Pair(e2, *f2));
-                    f1_used = true;
-                    f1 = e1_translations->erase(f1);
-                    f2 = e2_translations->erase(f2);
-                } else {
-                    ++f2;
-                }
-            }
-            if (!f1_used)
-                ++f1;
+        hypothesis->new_sequence(Pair(e1, f_text[pos1]))
+                                ->add(Pair(e2, f_text[cand.target(f2)]));
+        cand.use(slot1, f1);
+        cand.use(slot2, f2);
+        start = f2 + 1;
+    }
+}
+
+vector<pair<int, int>> AlignMake::anchors() const {
+    const Text &e_text = *_dict->get_e(),
+               &f_text = *_dict->get_f();
+
+    // hapax legomena in e with a single translation that is a
+    // hapax in f, unless another e hapax translates to it as well
+    vector<pair<int, int>> hapaxes;
+    vector<int> claims(f_text.types(), 0);
+    for (type_id et = 0; et < e_text.types(); ++et) {
+        const WordType& e_type = e_text.type(et);
+        if (e_type.frequency() != 1)
+            continue;
+        TranslationRange translations =
+            _dict->lookup(e_text[e_type.positions()[0]]);
+        if (translations.size() != 1
+         || f_text.type(translations[0]).frequency() != 1)
+            continue;
+        hapaxes.push_back(
+            std::make_pair(e_type.positions()[0],
+                           f_text.type(translations[0]).positions()[0]));
+        ++claims[translations[0]];
+    }
+    auto claimed_twice = [&](const pair<int, int>& anchor) {
+        return claims[f_text[anchor.second].get_type_id()] > 1;
+    };
+    hapaxes.erase(std::remove_if(hapaxes.begin(), hapaxes.end(),
+                                 claimed_twice),
+                  hapaxes.end());
+    std::sort(hapaxes.begin(), hapaxes.end());
+
+    // the anchors need to be in the same order in both texts, keep
+    // the longest chain of them where they are.
+    // tails[n] is the hapax that ends the best chain of length n+1.
+    vector<size_t> tails, previous(hapaxes.size());
+    for (size_t i = 0; i < hapaxes.size(); ++i) {
+        auto tail = std::lower_bound(tails.begin(), tails.end(), i,
+            [&](size_t chain_end, size_t hapax) {
+                return hapaxes[chain_end].second < hapaxes[hapax].second;
+            });
+        previous[i] = tail == tails.begin() ? i : *(tail - 1);
+        if (tail == tails.end())
+            tails.push_back(i);
+        else
+            *tail = i;
+    }
+
+    vector<pair<int, int>> chain(tails.size());
+    if (!tails.empty()) {
+        size_t hapax = tails.back();
+        for (size_t n = chain.size(); n > 0; --n) {
+            chain[n - 1] = hapaxes[hapax];
+            hapax = previous[hapax];
         }
     }
+    return chain;
+}
+
+AlignMake& AlignMake::segmented_sequences(ThreadPool* pool) {
+    const Text &e_text = *_dict->get_e(),
+               &f_text = *_dict->get_f();
+
+    // the segments don't depend on the number of threads, so
+    // that the result doesn't either
+    int segment_length = std::max(1, _context->params().segment_length());
+    vector<pair<int, int>> borders(1, std::make_pair(0, 0));
+    for (const pair<int, int>& anchor : anchors())
+        if (anchor.first - borders.back().first >= segment_length
+         && e_text.length() - anchor.first >= segment_length)
+            borders.push_back(anchor);
+    borders.push_back(std::make_pair(e_text.length(), f_text.length()));
+
+    vector<std::unique_ptr<Candidates>> candidates;
+    vector<std::unique_ptr<AlignMake>> segments;
+    vector<std::future<void>> done;
+    for (size_t i = 0; i + 1 < borders.size(); ++i) {
+        candidates.emplace_back(new Candidates(_context, *_dict));
+        segments.emplace_back(new AlignMake(candidates.back().get()));
+        segments.back()->set_join_kernel(_join_kernel);
+
+        Candidates* cand = candidates.back().get();
+        AlignMake* segment = segments.back().get();
+        pair<int, int> begin = borders[i],
+                       end = borders[i + 1];
+        done.push_back(pool->submit([=]() {
+            cand->collect(begin.first, end.first, begin.second, end.second);
+            segment->initial_sequences()
+                    .expand_sequences()
+                    .merge_sequences();
+        }));
+    }
+
+    // all tasks need to finish before the segments may go away
+    for (std::future<void>& segment_done : done)
+        pool->wait(segment_done);
+    for (std::future<void>& segment_done : done)
+        segment_done.get();
+
+    for (std::unique_ptr<AlignMake>& segment : segments)
+        hypothesis->append(segment->hypothesis);
 
     return *this;
 }
 
 AlignMake& AlignMake::expand_sequences() {
+    const int closeness = _context->params().closeness();
+    if (_context->params().monotony())
+        expand_kernel<true>(closeness);
+    else
+        expand_kernel<false>(closeness);
+
+    return *this;
+}
+
+template<bool Monotone>
+void AlignMake::expand_kernel(int closeness) {
+    Candidates& cand = *_candidates;
+    const Text& f_text = *_dict->get_f();
+
     int pairs_added;
     // XXX the checks for closeness
     // should use abs and check if
@@ -117,32 +372,47 @@ AlignMake& AlignMake::expand_sequences() {
         pairs_added = 0;
         for (Sequence* seq : *hypothesis) {
             // get next candidates entry for the sequence
-            Candidates::iterator next_slot;
-            for (next_slot = _candidates->begin();
-                 next_slot != _candidates->end(); ++next_slot)
-                if (next_slot->first.position()
-                    > seq->last_pair().source().position()
-                 && !next_slot->second->empty())
-                    break;
-
-            if (next_slot == _candidates->end())
+            size_t slot = cand.next_nonempty(
+                cand.slot_after(seq->last_pair().source().position()));
+            if (slot == cand.slots())
                 continue;
 
-            for (auto tr = next_slot->second->begin();
-                 tr != next_slot->second->end(); ++tr) {
-                Pair p(next_slot->first, *tr);
-                if (seq->add_if_close(p)) {
+            const WordToken e = cand.source(slot);
+            size_t begin = cand.slot_begin(slot),
+                   end = cand.slot_end(slot),
+                   tr = cand.next_unused(begin);
+            while (tr < end) {
+                bool added = seq->add_if_close<Monotone>(
+                                Pair(e, f_text[cand.target(tr)]), closeness);
+                if (added) {
                     ++pairs_added;
-                    tr = next_slot->second->erase(tr);
+                    cand.use(slot, tr);
+                    tr = cand.next_unused(tr);
                 }
+                // this walks the candidates like the list it used to
+                // be: the candidate after a used one is skipped, and
+                // using the last one continues at the first again
+                if (added && tr >= end)
+                    tr = cand.next_unused(begin);
+                else
+                    tr = cand.next_unused(tr + 1);
             }
         }
     } while (pairs_added != 0);
+}
+
+AlignMake& AlignMake::merge_sequences() {
+    const int closeness = _context->params().closeness();
+    if (_context->params().monotony())
+        merge_kernel<true>(closeness);
+    else
+        merge_kernel<false>(closeness);
 
     return *this;
 }
 
-AlignMake& AlignMake::merge_sequences() {
+template<bool Monotone>
+void AlignMake::merge_kernel(int closeness) {
     int combined = 0;
 
     do {
@@ -159,15 +429,14 @@ AlignMake& AlignMake::merge_sequences() {
             if (other == hypothesis->end())
                 continue;
 
-            if ((*seq)->last_pair().both_close((*other)->first_pair())) {
+            if ((*seq)->last_pair()
+                    .both_close<Monotone>((*other)->first_pair(), closeness)) {
                 (*seq)->merge(*other);
                 other = hypothesis->remove_sequence(other);
                 ++combined;
             }
         }
     } while (combined != 0);
-
-    return *this;
 }
 
 AlignMake& AlignMake::collect_scores() {
@@ -210,22 +479,22 @@ AlignMake& AlignMake::get_topranking() {
     auto remove_others =
         [&](const WordToken& tok, const Sequence* seq) -> bool {
             bool equals = false;
-            auto other_seq = tok.get_sequences()->begin();
-            while (other_seq != tok.get_sequences()->end()) {
-                if (*other_seq == seq) {
-                    ++other_seq;
+            // removing a sequence takes all its entries out of the
+            // list, and a sequence may contain the token more than
+            // once, so this needs to work on a copy
+            list<Sequence*>* tok_seqs = hypothesis->sequences_of(tok);
+            vector<Sequence*> others(tok_seqs->begin(), tok_seqs->end());
+            vector<Sequence*> removed;
+            for (Sequence* other_seq : others) {
+                if (other_seq == seq
+                 || std::find(removed.begin(), removed.end(), other_seq)
+                        != removed.end())
                     continue;
-                }
-                if ((*other_seq)->get_score() == seq->get_score())
+                if (other_seq->get_score() == seq->get_score())
                     equals = true;
-                if ((*other_seq)->get_score() <= seq->get_score()) {
-                    auto seq_to_remove = other_seq;
-                    ++other_seq;
-                    hypothesis->remove_sequence(*seq_to_remove);
-                    if (tok.get_sequences()->size() == 0)
-                        break;
-                } else {
-                    ++other_seq;
+                if (other_seq->get_score() <= seq->get_score()) {
+                    removed.push_back(other_seq);
+                    hypothesis->remove_sequence(other_seq);
                 }
             }
             return equals;
@@ -252,5 +521,69 @@ AlignMake& AlignMake::get_topranking() {
 
     return *this;
 }
-}  // namespace Align
 
+BidirectionalAlign::BidirectionalAlign(AlignContext* context,
+                                       const string& e_name,
+                                       const string& f_name)
+    : _context(context), _e_name(e_name), _f_name(f_name) {
+}
+
+BidirectionalAlign& BidirectionalAlign::restrict_to(int e_begin, int e_end,
+                                                    int f_begin, int f_end) {
+    if (e_begin > e_end || f_begin > f_end)
+        throw runtime_error("Token range ends before it begins");
+    _range = { e_begin, e_end, f_begin, f_end };
+    return *this;
+}
+
+BidirectionalAlign& BidirectionalAlign::align(ThreadPool* pool) {
+    const Dictionary* dict =
+        _context->dictionaries().get_dictionary(_e_name, _f_name);
+    align_forward(*dict, pool);
+    // the reverse pass is currently a no-op, see align_reverse(), so
+    // it isn't worth a task of its own
+    align_reverse();
+
+    Hypothesis *result  = _forward->get_result(),
+               *rresult = _reverse->get_result();
+    rresult->reverse();
+    result->munch(rresult);
+
+    return *this;
+}
+
+void BidirectionalAlign::align_forward(const Dictionary& dict,
+                                       ThreadPool* pool) {
+    _forward_candidates.reset(new Candidates(_context, dict));
+    _forward.reset(new AlignMake(_forward_candidates.get()));
+    if (!_range.empty()) {
+        int e_length = dict.get_e()->length(),
+            f_length = dict.get_f()->length();
+        _forward_candidates->collect(
+            std::min(std::max(_range[0], 0), e_length),
+            std::min(std::max(_range[1], 0), e_length),
+            std::min(std::max(_range[2], 0), f_length),
+            std::min(std::max(_range[3], 0), f_length));
+        _forward->initial_sequences()
+                 .expand_sequences();
+    } else if (_context->params().segment_length() > 0) {
+        _forward->segmented_sequences(pool);
+    } else {
+        _forward_candidates->collect();
+        _forward->initial_sequences()
+                 .expand_sequences();
+    }
+}
+
+void BidirectionalAlign::align_reverse() {
+    const Dictionary* dict = _context->dictionaries()
+                             .get_dictionary(_f_name, _e_name);
+    // the reverse candidates aren't collected - munch() can't
+    // deal with the sequences that would come out of this yet. So
+    // this pass has no sequences, and only gets the dictionary.
+    _reverse_candidates.reset(new Candidates(_context, *dict));
+    _reverse.reset(new AlignMake(_reverse_candidates.get()));
+    _reverse->initial_sequences()
+             .expand_sequences();
+}
+}  // namespace Align
@@ -1,23 +1,67 @@
 // Copyright 2012 Florian Petran
 #ifndef ALIGN_H_
 #define ALIGN_H_
+#include<cstdint>
 #include<cstdlib>
 #include<list>
+#include<vector>
 #include<utility>
 #include<map>
+#include<memory>
+#include<string>
 #include"params.h"
+#include"context.h"
 #include"text.h"
 #include"dictionary.h"
 #include"containers.h"
 #include"scorers.h"
+#include"thread_pool.h"
 
 namespace Align {
 
+/// The indices 0..n in order, some of which can be removed.
+/** next() finds the first index that wasn't removed in amortized
+ *  near constant time, since removed indices are linked to their
+ *  successor like in a union-find structure.
+ **/
+class SkipIndex {
+    public:
+        SkipIndex() : _next(1, 0) {}
+
+        /// start over with the indices 0..n, n being the end marker
+        void reset(size_t n);
+        /// remove an index - the end marker can't be removed
+        inline void remove(size_t index) {
+            _next[index] = index + 1;
+        }
+        /// the first index at or after index that wasn't removed
+        inline size_t next(size_t index) {
+            while (_next[index] != index) {
+                // path halving
+                _next[index] = _next[_next[index]];
+                index = _next[index];
+            }
+            return index;
+        }
+
+    private:
+        std::vector<size_t> _next;
+};
+
+/// All translation candidates for the e tokens.
+/** Every e token that has a dictionary entry gets a slot, in text
+ *  order. The candidates of a slot are the f positions of all
+ *  translations of the token, stored back to back with those of
+ *  the other slots. Candidates are used up by AlignMake, and removed
+ *  from their slot then. Both the next unused candidate and the
+ *  next slot that still has candidates can be found in near constant
+ *  time.
+ **/
 class Candidates {
     friend class AlignMake;
     public:
-        explicit Candidates(const Dictionary&);
-        ~Candidates();
+        /// the AlignMake working on these candidates uses the context
+        Candidates(AlignContext* context, const Dictionary& dict);
 
         Candidates() = delete;
         Candidates(const Candidates&) = delete;
@@ -25,30 +69,90 @@ class Candidates {
 
         /// collect all translation candidates
         void collect();
+        /// collect the translation candidates of e tokens in
+        /// [e_begin, e_end) that are in [f_begin, f_end) in f
+        void collect(int e_begin, int e_end, int f_begin, int f_end);
 
-        typedef std::map<WordToken, std::list<WordToken>*>::iterator
-            iterator;
-
-        inline Candidates::iterator begin() {
-            return _translations.begin();
-        };
-        inline Candidates::iterator end() {
-            return _translations.end();
-        };
-        inline std::list<WordToken>* at(const WordToken& pos) const {
-            return _translations.at(pos);
+        /// number of slots
+        inline size_t slots() const {
+            return _sources.size();
+        }
+        /// the e token of a slot
+        inline WordToken source(size_t slot) const {
+            return (*_dict->get_e())[_sources[slot]];
+        }
+        /// all candidates of a slot, used or not
+        inline PositionRange targets(size_t slot) const {
+            return PositionRange(_targets.data() + _offsets[slot],
+                                 _targets.data() + _offsets[slot + 1]);
+        }
+        /// number of unused candidates of a slot
+        inline int remaining(size_t slot) const {
+            return _remaining[slot];
+        }
+        /// the first slot for an e token after position, or slots()
+        inline size_t slot_after(int position) const {
+            if (position < _first_position)
+                return 0;
+            return static_cast<size_t>(position - _first_position)
+                        < _slot_after.size()
+                 ? _slot_after[position - _first_position]
+                 : slots();
         }
-        inline std::list<WordToken>* operator[](const WordToken& pos) {
-            return _translations[pos];
+        /// the first slot at or after slot that has unused candidates,
+        /// or slots()
+        inline size_t next_nonempty(size_t slot) {
+            return _nonempty.next(slot);
         }
 
     protected:
-        std::map<WordToken, std::list<WordToken>*> _translations;
+        /// index of the first candidate of a slot in _targets
+        inline size_t slot_begin(size_t slot) const {
+            return _offsets[slot];
+        }
+        /// index after the last candidate of a slot in _targets
+        inline size_t slot_end(size_t slot) const {
+            return _offsets[slot + 1];
+        }
+        /// f position of the candidate at index
+        inline int target(size_t index) const {
+            return _targets[index];
+        }
+        /// the first unused candidate at or after index - this may
+        /// be past the end of the slot of index
+        inline size_t next_unused(size_t index) {
+            return _unused.next(index);
+        }
+        /// remove the candidate at index from its slot
+        void use(size_t slot, size_t index);
+
+        AlignContext* _context;
         const Dictionary* _dict;
+
+    private:
+        /// e position of each slot
+        std::vector<int> _sources;
+        /// start of the candidates of each slot, plus the end of the last
+        std::vector<uint32_t> _offsets;
+        /// f positions of the candidates
+        std::vector<int> _targets;
+        std::vector<int> _remaining;
+        /// first slot after each collected e position
+        std::vector<uint32_t> _slot_after;
+        int _first_position;
+        SkipIndex _unused, _nonempty;
 };
 
 class AlignMake {
     public:
+        /// how initial_sequences() pairs up the candidates of two slots
+        enum JoinKernel {
+            /// sliding windows over the ascending runs of candidates
+            WINDOW_JOIN,
+            /// compare every candidate with every other
+            NESTED_JOIN
+        };
+
         explicit AlignMake(Candidates* cand);
         ~AlignMake();
 
@@ -63,14 +167,30 @@ class AlignMake {
         AlignMake& expand_sequences();
         /// merge Sequence that are close
         AlignMake& merge_sequences();
+        /// construct, expand and merge Sequence objects in independent
+        /// segments of the texts, in parallel. The segments are cut
+        /// at anchors(), and are at least Params::segment_length()
+        /// long. Replaces initial_sequences() and expand_sequences(),
+        /// the Candidates aren't used.
+        AlignMake& segmented_sequences(ThreadPool* pool);
         /// collect confidence scores for all Sequence
         AlignMake& collect_scores();
         /// remove all but topranking Sequence
         AlignMake& get_topranking();
 
+        /// (e, f) positions of tokens that align for certain: hapax
+        /// legomena that translate to a hapax legomenon, keeping the
+        /// longest chain of them that is in order in both texts
+        std::vector<std::pair<int, int>> anchors() const;
+
         inline Hypothesis* get_result() {
             return hypothesis;
         }
+        /// both kernels give the same result, the nested one is
+        /// only there for reference
+        inline void set_join_kernel(JoinKernel kernel) {
+            _join_kernel = kernel;
+        }
         /// return the address of Scorer container, so that users
         /// can push_back() custom Scorer methods.
         inline ScoringMethods* scorers() {
@@ -78,13 +198,83 @@ class AlignMake {
         }
 
     private:
+        /// make sequences of the candidates of two slots
+        void join_window(size_t slot1, size_t slot2);
+        template<bool Monotone>
+        void join_nested(size_t slot1, size_t slot2);
+        /// the loops of expand_sequences() and merge_sequences(), for
+        /// a monotony mode that is only looked up once for each call
+        template<bool Monotone>
+        void expand_kernel(int closeness);
+        template<bool Monotone>
+        void merge_kernel(int closeness);
+
+        /// a window of the candidates of a slot that are close enough
+        /// to follow a source position, in an ascending run of them
+        struct Window {
+            size_t run_begin, begin, end, run_end;
+        };
+
         Hypothesis* hypothesis;
+        AlignContext* _context;
+        JoinKernel _join_kernel;
+        /// buffer for join_window()
+        std::vector<Window> _windows;
 
         Candidates* _candidates;
         const Dictionary* _dict;
         /// contains all scoring methods as functors
         ScoringMethods scoring_methods;
 };
+
+/// Aligns two texts in both directions.
+/** The forward (e -> f) and the reverse (f -> e) pass each get their
+ *  Dictionary, collect their Candidates and construct and expand their
+ *  Sequence objects. The reverse result is then munched into the
+ *  forward one, and the rest of the work is done through forward().
+ *
+ *  The reverse pass currently doesn't collect its candidates, since
+ *  munch() can't deal with its sequences yet, so it contributes
+ *  nothing. It runs after the forward pass, whose Dictionary its own
+ *  is usually transposed from.
+ **/
+class BidirectionalAlign {
+    public:
+        BidirectionalAlign(AlignContext* context,
+                           const std::string& e_name,
+                           const std::string& f_name);
+        BidirectionalAlign() = delete;
+        BidirectionalAlign(const BidirectionalAlign&) = delete;
+        const BidirectionalAlign&
+            operator=(const BidirectionalAlign&) = delete;
+
+        /// only align the e tokens in [e_begin, e_end) to the f tokens
+        /// in [f_begin, f_end). The ranges are clipped to the texts.
+        /// Must be called before align(), and the forward pass isn't
+        /// segmented then.
+        BidirectionalAlign& restrict_to(int e_begin, int e_end,
+                                        int f_begin, int f_end);
+        /// run both passes. If Params::segment_length() is set, the
+        /// forward pass is segmented on the pool. May be called from a
+        /// task on the same pool.
+        BidirectionalAlign& align(ThreadPool* pool);
+        /// the forward AlignMake, only valid after align()
+        inline AlignMake& forward() {
+            return *_forward;
+        }
+
+    private:
+        void align_forward(const Dictionary& dict, ThreadPool* pool);
+        void align_reverse();
+
+        AlignContext* _context;
+        std::string _e_name, _f_name;
+        /// e begin, e end, f begin, f end - if restricted
+        std::vector<int> _range;
+        std::unique_ptr<Candidates> _forward_candidates,
+                                    _reverse_candidates;
+        std::unique_ptr<AlignMake> _forward, _reverse;
+};
 }  // namespace Align
 
 #endif  // ALIGN_H_
@@ -0,0 +1,165 @@
+// Copyright 2013 Florian Petran
+//
+// Benchmark for the closeness checks in the inner loops of AlignMake.
+// Writes a synthetic text pair with its dictionary, then compares the
+// closeness check that looks at the monotony mode on every call with
+// the ones specialized on it at compile time, and times the alignment
+// itself in both modes.
+#include<stdlib.h>
+#include<unistd.h>
+
+#include<algorithm>
+#include<chrono>
+#include<cstdio>
+#include<fstream>
+#include<iostream>
+#include<random>
+#include<stdexcept>
+#include<string>
+#include<vector>
+#include"align.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+typedef std::chrono::steady_clock bench_clock;
+
+double seconds_since(const bench_clock::time_point& start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/// write e and f texts of about tokens words each to dir, f being
+/// a noisy word by word translation of e, and a dictionary for them
+void write_corpus(const string& dir, int tokens, int types) {
+    std::mt19937 random(4711);
+    // uniform, since the number of candidates grows with the square
+    // of the frequency of a word
+    std::uniform_int_distribution<int> word(0, types - 1),
+                                       noise(0, 99);
+
+    std::ofstream e_file(dir + "/e.txt"), f_file(dir + "/f.txt");
+    for (int i = 0; i < tokens; ++i) {
+        int type = word(random);
+        e_file << "e" << type << "\n";
+        int chance = noise(random);
+        if (chance < 5)
+            continue;
+        if (chance < 10)
+            f_file << "f" << word(random) << "\n";
+        f_file << "f" << type << "\n";
+    }
+
+    std::ofstream dict_file(dir + "/bench.dictionary");
+    dict_file << "### e.txt = f.txt\n";
+    for (int type = 0; type < types; ++type) {
+        dict_file << "e" << type << " = f" << type << "\n";
+        // some translations that are wrong, to have more candidates
+        dict_file << "e" << type << " = f" << (type * 7 + 1) % types << "\n";
+    }
+    std::ofstream index_file(dir + "/INDEX");
+    index_file << "bench.dictionary:### e.txt = f.txt\n";
+}
+
+/// count the pairs of tokens in f that are close, checking each
+/// of them with Check
+template<typename Check>
+long count_close(const Align::Text& text, int closeness, int rounds,
+                 Check check) {
+    long close = 0;
+    for (int round = 0; round < rounds; ++round)
+        for (int i = 0; i < text.length(); ++i) {
+            Align::WordToken token = text[i];
+            int begin = std::max(0, i - 2 * closeness),
+                end = std::min(text.length(), i + 2 * closeness + 1);
+            for (int j = begin; j < end; ++j)
+                close += check(token, text[j]);
+        }
+    return close;
+}
+
+void bench_close_to(const Align::Text& text, int closeness, bool monotony) {
+    const int rounds = 20;
+    bench_clock::time_point start = bench_clock::now();
+    long runtime = count_close(text, closeness, rounds,
+        [&](const Align::WordToken& a, const Align::WordToken& b) {
+            return a.close_to(b, closeness, monotony);
+        });
+    double runtime_time = seconds_since(start);
+
+    start = bench_clock::now();
+    long specialized;
+    if (monotony)
+        specialized = count_close(text, closeness, rounds,
+            [&](const Align::WordToken& a, const Align::WordToken& b) {
+                return a.close_to<true>(b, closeness);
+            });
+    else
+        specialized = count_close(text, closeness, rounds,
+            [&](const Align::WordToken& a, const Align::WordToken& b) {
+                return a.close_to<false>(b, closeness);
+            });
+    double specialized_time = seconds_since(start);
+
+    if (runtime != specialized)
+        throw std::logic_error("Closeness checks disagree");
+    std::cout << "close_to, monotony " << (monotony ? "on " : "off")
+              << ": runtime flag " << runtime_time << "s, "
+              << "specialized " << specialized_time << "s" << std::endl;
+}
+
+void bench_alignment(const string& dir, bool monotony) {
+    Align::Params params;
+    params.set_dict_base(dir + "/");
+    params.set_monotony(!monotony);
+    Align::AlignContext context(params);
+    const Align::Dictionary* dict = context.dictionaries()
+        .get_dictionary(dir + "/e.txt", dir + "/f.txt");
+
+    bench_clock::time_point start = bench_clock::now();
+    Align::Candidates candidates(&context, *dict);
+    candidates.collect();
+    Align::AlignMake align_make(&candidates);
+    align_make.initial_sequences()
+              .expand_sequences()
+              .merge_sequences();
+    std::cout << "alignment, monotony " << (monotony ? "on " : "off")
+              << ": " << seconds_since(start) << "s" << std::endl;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int tokens = argc > 1 ? std::atoi(argv[1]) : 200000;
+    char dir_template[] = "/tmp/align_bench.XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        std::cerr << "Couldn't create a temporary directory" << std::endl;
+        return 1;
+    }
+    string dir = dir_template;
+
+    int status = 0;
+    try {
+        write_corpus(dir, tokens, tokens / 10 + 1);
+        std::cout << "corpus of " << tokens << " tokens in "
+                  << dir << std::endl;
+
+        Align::Params params;
+        params.set_dict_base(dir + "/");
+        Align::AlignContext context(params);
+        const Align::Text& f_text =
+            *context.dictionaries().get_text(dir + "/f.txt");
+        for (bool monotony : { true, false })
+            bench_close_to(f_text, params.closeness(), monotony);
+        for (bool monotony : { true, false })
+            bench_alignment(dir, monotony);
+    } catch(const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+
+    for (const char* name : { "e.txt", "f.txt", "bench.dictionary",
+                              "INDEX" })
+        std::remove((dir + "/" + name).c_str());
+    rmdir(dir.c_str());
+    return status;
+}
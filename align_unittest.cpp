@@ -1,11 +1,23 @@
 // Copyright 2012 Florian Petran
+#include<sys/stat.h>
+#include<unistd.h>
+#include<chrono>
+#include<cstdio>
+#include<fstream>
+#include<future>
 #include<list>
+#include<sstream>
+#include<stdexcept>
 #include<string>
+#include<thread>
 #include<vector>
 #include<map>
+#include<utility>
 #include<gtest/gtest.h> // NOLINT[build/include_order]
 #include"align.h"
 #include"align_config.h"
+#include"batch.h"
+#include"server.h"
 #include"string_impl.h"
 
 /*
@@ -20,21 +32,23 @@
 class AlignTest_Fixture : public testing::Test {
     protected:
         virtual void SetUp() {
-            Align::Params* params = Align::Params::get();
-            params->set_dict_base(ALIGN_TEST_DICT);
-            Align::DictionaryFactory* df =
-                Align::DictionaryFactory::get_instance();
-            _dict = df->get_dictionary(ALIGN_TEST_E, ALIGN_TEST_F);
-            c = new Align::Candidates(*_dict);
+            Align::Params params;
+            params.set_dict_base(ALIGN_TEST_DICT);
+            context = new Align::AlignContext(params);
+            _dict = context->dictionaries()
+                    .get_dictionary(ALIGN_TEST_E, ALIGN_TEST_F);
+            c = new Align::Candidates(context, *_dict);
             c->collect();
             sc = new Align::AlignMake(c);
         }
         virtual void TearDown() {
-            delete c;
             delete sc;
+            delete c;
+            delete context;
         }
 
         // data members
+        Align::AlignContext* context;
         const Align::Dictionary* _dict;
         Align::Candidates* c;
         Align::AlignMake *sc;
@@ -53,15 +67,34 @@ TEST_F(AlignTest, CandidatesTest) {
       { 17, {19, 30, 40} } };
     std::map<int, std::list<int>> tr_actual;
 
-    for (auto act = c->begin(); act != c->end(); ++act)
-        for (auto act_tr = act->second->begin();
-                act_tr != act->second->end(); ++act_tr)
-            tr_actual[act->first.position()].push_back(act_tr->position());
+    for (size_t slot = 0; slot < c->slots(); ++slot)
+        for (int tr_pos : c->targets(slot))
+            tr_actual[c->source(slot).position()].push_back(tr_pos);
 
     EXPECT_EQ(tr_exp.size(), tr_actual.size());
     EXPECT_EQ(tr_exp, tr_actual);
 }
 
+TEST_F(AlignTest, CandidatesSlots) {
+    // the next slot after an e position is the first slot for a
+    // later position, and slots lose their candidates when they
+    // are used up
+    EXPECT_EQ(0u, c->slot_after(0));
+    EXPECT_EQ(1u, c->slot_after(8));
+    EXPECT_EQ(2u, c->slot_after(9));
+    EXPECT_EQ(5u, c->slot_after(13));
+    EXPECT_EQ(c->slots(), c->slot_after(17));
+    for (size_t slot = 0; slot < c->slots(); ++slot)
+        EXPECT_EQ(c->targets(slot).size(),
+                  static_cast<size_t>(c->remaining(slot)));
+    EXPECT_EQ(0u, c->next_nonempty(0));
+
+    // the first bigram uses up one candidate of each of the two slots
+    sc->initial_sequences();
+    EXPECT_EQ(2, c->remaining(0));
+    EXPECT_EQ(2, c->remaining(1));
+}
+
 TEST_F(AlignTest, SequenceTestInital) {
     sc->initial_sequences();
 
@@ -85,6 +118,23 @@ TEST_F(AlignTest, SequenceTestInital) {
     }
 }
 
+TEST_F(AlignTest, JoinKernels) {
+    // the nested join is the reference for the window join
+    Align::Candidates nested_c(context, *_dict);
+    nested_c.collect();
+    Align::AlignMake nested(&nested_c);
+    nested.set_join_kernel(Align::AlignMake::NESTED_JOIN);
+
+    sc->initial_sequences();
+    nested.initial_sequences();
+
+    std::vector<std::vector<int>> expected = *(nested.get_result()),
+                                  actual = *(sc->get_result());
+    EXPECT_EQ(expected, actual);
+    for (size_t slot = 0; slot < c->slots(); ++slot)
+        EXPECT_EQ(nested_c.remaining(slot), c->remaining(slot));
+}
+
 TEST_F(AlignTest, SequenceTestExpand) {
     sc->initial_sequences();
     sc->expand_sequences();
@@ -124,6 +174,325 @@ TEST_F(AlignTest, SequenceTestMerge) {
     EXPECT_EQ(expected, actual);
 }
 
+TEST_F(AlignTest, Anchors) {
+    // anchors are hapaxes in both texts, and in the same order
+    const Align::Text &e = *_dict->get_e(),
+                      &f = *_dict->get_f();
+    std::vector<std::pair<int, int>> anchors = sc->anchors();
+    for (size_t i = 0; i < anchors.size(); ++i) {
+        EXPECT_EQ(1, e[anchors[i].first].get_type().frequency());
+        EXPECT_EQ(1, f[anchors[i].second].get_type().frequency());
+        if (i > 0) {
+            EXPECT_LT(anchors[i - 1].first, anchors[i].first);
+            EXPECT_LT(anchors[i - 1].second, anchors[i].second);
+        }
+    }
+}
+
+TEST_F(AlignTest, SegmentedSequences) {
+    // blocks of words that only translate to the same block, with a
+    // hapax between them and untranslated words around it, so that
+    // no sequence crosses the anchors. Segments shorter than the text
+    // split it there, and should give the unsegmented alignment.
+    mkdir("segment_test", 0700);
+    {
+        std::ofstream e("segment_test/e.txt"), f("segment_test/f.txt"),
+                      dict("segment_test/e-f.dictionary"),
+                      index("segment_test/INDEX");
+        dict << "### e.txt = f.txt\n";
+        for (int block = 0; block < 6; ++block) {
+            for (int side = 0; side < 2; ++side) {
+                if (side == 1) {
+                    e << "h" << block << '\n';
+                    f << "g" << block << '\n';
+                    dict << "h" << block << " = g" << block << '\n';
+                }
+                for (int filler = 0; filler < 3; ++filler) {
+                    e << "x\n";
+                    f << "y\n";
+                }
+            }
+            for (int word = 0; word < 12; ++word) {
+                e << "w" << block << "_" << word * 7 % 4 << '\n';
+                f << "v" << block << "_" << word * 3 % 4 << '\n';
+                if (word % 5 == 0)
+                    f << "v" << block << "_" << word % 3 << '\n';
+            }
+            for (int ew = 0; ew < 4; ++ew)
+                for (int fw = ew % 2; fw < 4; fw += 2)
+                    dict << "w" << block << "_" << ew
+                         << " = v" << block << "_" << fw << '\n';
+        }
+        index << "e-f.dictionary:### e.txt = f.txt\n";
+    }
+
+    Align::Params params;
+    params.set_dict_base("segment_test/");
+    Align::AlignContext whole_context(params);
+    Align::Candidates whole_c(&whole_context,
+                              *whole_context.dictionaries()
+                              .get_dictionary("segment_test/e.txt",
+                                              "segment_test/f.txt"));
+    whole_c.collect();
+    Align::AlignMake whole(&whole_c);
+    EXPECT_EQ(6, whole.anchors().size());
+    whole.initial_sequences();
+    whole.expand_sequences();
+    whole.merge_sequences();
+    std::vector<std::vector<int>> expected = *(whole.get_result());
+    EXPECT_FALSE(expected.empty());
+
+    // six segments of about 19 tokens, and a single one
+    for (int segment_length : { 10, 1000 }) {
+        params.set_segment_length(segment_length);
+        Align::AlignContext segmented_context(params);
+        Align::ThreadPool pool(2);
+        Align::Candidates unused_c(&segmented_context,
+                                   *segmented_context.dictionaries()
+                                   .get_dictionary("segment_test/e.txt",
+                                                   "segment_test/f.txt"));
+        Align::AlignMake segmented(&unused_c);
+        segmented.segmented_sequences(&pool);
+
+        std::vector<std::vector<int>> actual = *(segmented.get_result());
+        EXPECT_EQ(expected, actual) << segment_length;
+    }
+
+    for (const char* name : { "e.txt", "f.txt", "e-f.dictionary", "INDEX" })
+        std::remove((std::string("segment_test/") + name).c_str());
+    rmdir("segment_test");
+}
+
+TEST_F(AlignTest, ThreadPool) {
+    Align::ThreadPool pool(3);
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 20; ++i)
+        results.push_back(pool.submit([i]() { return i * i; }));
+    for (int i = 0; i < 20; ++i)
+        EXPECT_EQ(i * i, results[i].get());
+
+    std::future<int> failed = pool.submit([]() -> int {
+        throw std::runtime_error("failed");
+    });
+    EXPECT_THROW(failed.get(), std::runtime_error);
+
+    // a task waiting for its own subtasks doesn't block the only
+    // worker, it runs them itself
+    Align::ThreadPool single(1);
+    std::future<int> nested = single.submit([&single]() {
+        std::vector<std::future<int>> parts;
+        for (int i = 0; i < 10; ++i)
+            parts.push_back(single.submit([i]() { return i; }));
+        int sum = 0;
+        for (std::future<int>& part : parts) {
+            single.wait(part);
+            sum += part.get();
+        }
+        return sum;
+    });
+    single.wait(nested);
+    EXPECT_EQ(45, nested.get());
+}
+
+TEST_F(AlignTest, Batch) {
+    std::ofstream manifest("test.manifest");
+    manifest << "# e f output\n"
+             << ALIGN_TEST_E << " " << ALIGN_TEST_F << " test_ef.align\n"
+             << "\n"
+             << ALIGN_TEST_E << " no_such_text test_failed.align\n";
+    manifest.close();
+    std::vector<Align::BatchEntry> batch =
+        Align::read_manifest("test.manifest");
+    ASSERT_EQ(2, batch.size());
+    EXPECT_EQ("test_ef.align", batch[0].output);
+
+    Align::ThreadPool pool(2);
+    std::ostringstream errors;
+    EXPECT_EQ(1, Align::align_batch(context, batch, &pool, &errors));
+    EXPECT_NE(std::string::npos, errors.str().find("no_such_text"));
+
+    // the same as a single alignment
+    sc->initial_sequences();
+    sc->expand_sequences();
+    sc->merge_sequences();
+    sc->collect_scores();
+    sc->get_topranking();
+    std::ostringstream expected;
+    for (Align::Sequence* seq : *(sc->get_result()))
+        expected << *seq << '\n';
+    std::ifstream output("test_ef.align");
+    std::stringstream actual;
+    actual << output.rdbuf();
+    EXPECT_EQ(expected.str(), actual.str());
+
+    std::remove("test.manifest");
+    std::remove("test_ef.align");
+    std::remove("test_failed.align");
+}
+
+TEST_F(AlignTest, BatchBothDirections) {
+    // the alignment of a pair on its own, with nothing else loaded
+    auto align_alone = [](const char* e_name, const char* f_name) {
+        Align::Params params;
+        params.set_dict_base(ALIGN_TEST_DICT);
+        Align::AlignContext alone(params);
+        Align::Candidates candidates(&alone,
+                                     *alone.dictionaries()
+                                     .get_dictionary(e_name, f_name));
+        candidates.collect();
+        Align::AlignMake align_make(&candidates);
+        align_make.initial_sequences()
+                  .expand_sequences()
+                  .merge_sequences()
+                  .collect_scores()
+                  .get_topranking();
+        std::ostringstream result;
+        for (Align::Sequence* seq : *(align_make.get_result()))
+            result << *seq << '\n';
+        return result.str();
+    };
+    const std::string expected_ef = align_alone(ALIGN_TEST_E, ALIGN_TEST_F),
+                      expected_fe = align_alone(ALIGN_TEST_F, ALIGN_TEST_E);
+    ASSERT_FALSE(expected_ef.empty());
+    ASSERT_FALSE(expected_fe.empty());
+
+    // one of the dictionaries is made from the other, whichever
+    // direction comes first
+    for (bool ef_first : { true, false }) {
+        std::ofstream manifest("test.manifest");
+        const std::string ef = std::string(ALIGN_TEST_E) + " "
+                             + ALIGN_TEST_F + " test_ef.align\n",
+                          fe = std::string(ALIGN_TEST_F) + " "
+                             + ALIGN_TEST_E + " test_fe.align\n";
+        manifest << (ef_first ? ef + fe : fe + ef);
+        manifest.close();
+
+        Align::Params params;
+        params.set_dict_base(ALIGN_TEST_DICT);
+        Align::AlignContext batch_context(params);
+        Align::ThreadPool pool(2);
+        std::ostringstream errors;
+        EXPECT_EQ(0, Align::align_batch(&batch_context,
+                                        Align::read_manifest("test.manifest"),
+                                        &pool, &errors));
+
+        for (const std::pair<const char*, const std::string*>& output :
+                { std::make_pair("test_ef.align", &expected_ef),
+                  std::make_pair("test_fe.align", &expected_fe) }) {
+            std::ifstream file(output.first);
+            std::stringstream actual;
+            actual << file.rdbuf();
+            EXPECT_EQ(*output.second, actual.str()) << output.first;
+        }
+    }
+
+    std::remove("test.manifest");
+    std::remove("test_ef.align");
+    std::remove("test_fe.align");
+}
+
+TEST_F(AlignTest, Server) {
+    Align::Params params;
+    params.set_dict_base(ALIGN_TEST_DICT);
+    // drop everything after each request
+    params.set_memory_budget(0);
+    Align::ThreadPool pool(2);
+    Align::AlignServer server(params, &pool);
+    std::thread serving([&]() { server.serve("test.sock"); });
+
+    sc->initial_sequences();
+    sc->expand_sequences();
+    sc->merge_sequences();
+    sc->collect_scores();
+    sc->get_topranking();
+    std::ostringstream expected;
+    size_t count = 0;
+    for (Align::Sequence* seq : *(sc->get_result())) {
+        expected << *seq << '\n';
+        ++count;
+    }
+    expected.str("ok " + std::to_string(count) + "\n" + expected.str());
+
+    std::string align_request = std::string("align ")
+                              + ALIGN_TEST_E + " " + ALIGN_TEST_F;
+    std::string answer;
+    // the server might not listen yet
+    for (int tries = 0; answer.empty(); ++tries)
+        try {
+            answer = Align::request("test.sock", align_request);
+        } catch(const std::runtime_error&) {
+            ASSERT_LT(tries, 500);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    EXPECT_EQ(expected.str(), answer);
+    std::string stats = Align::request("test.sock", "stats");
+    // the counters of the dropped dictionaries are kept
+    EXPECT_EQ(0, stats.find("ok 2\n0 bytes\n"));
+    EXPECT_EQ(std::string::npos, stats.find(" 0 misses"));
+    // loaded again after being dropped
+    EXPECT_EQ(expected.str(), Align::request("test.sock", align_request));
+
+    EXPECT_EQ("ok 0\n",
+              Align::request("test.sock", align_request + " e_range=0:0"));
+    EXPECT_EQ(0, Align::request("test.sock", align_request + " closeness=x")
+                 .find("error "));
+    EXPECT_EQ(0, Align::request("test.sock",
+                                std::string("align ") + ALIGN_TEST_E
+                                + " no_such_text").find("error "));
+
+    EXPECT_EQ("ok 0\n", Align::request("test.sock", "shutdown"));
+    serving.join();
+}
+
+TEST_F(AlignTest, BidirectionalAlign) {
+    Align::ThreadPool pool(2);
+    Align::BidirectionalAlign bi_align(context, ALIGN_TEST_E, ALIGN_TEST_F);
+    bi_align.align(&pool).forward()
+            .merge_sequences()
+            .collect_scores()
+            .get_topranking();
+
+    sc->initial_sequences();
+    sc->expand_sequences();
+    sc->merge_sequences();
+    sc->collect_scores();
+    sc->get_topranking();
+
+    std::vector<std::vector<int>> expected = *(sc->get_result()),
+                                  actual =
+                                      *(bi_align.forward().get_result());
+    EXPECT_EQ(expected, actual);
+}
+
+TEST_F(AlignTest, ParallelContexts) {
+    // alignments with different parameters in the same process
+    auto run = [](int closeness) {
+        Align::Params params;
+        params.set_dict_base(ALIGN_TEST_DICT);
+        params.set_closeness(closeness);
+        Align::AlignContext context(params);
+        Align::ThreadPool pool(1);
+        Align::BidirectionalAlign bi_align(&context,
+                                           ALIGN_TEST_E, ALIGN_TEST_F);
+        bi_align.align(&pool).forward()
+                .merge_sequences();
+        std::vector<std::vector<int>> result =
+            *(bi_align.forward().get_result());
+        return result;
+    };
+    std::vector<std::vector<int>> narrow = run(1),
+                                  wide = run(5);
+    EXPECT_NE(narrow, wide);
+
+    for (int i = 0; i < 3; ++i) {
+        std::future<std::vector<std::vector<int>>>
+            narrow_result = std::async(std::launch::async, run, 1),
+            wide_result = std::async(std::launch::async, run, 5);
+        EXPECT_EQ(narrow, narrow_result.get());
+        EXPECT_EQ(wide, wide_result.get());
+    }
+}
+
 TEST_F(AlignTest, TestAll) {
     sc->initial_sequences();
     sc->expand_sequences();
@@ -143,6 +512,32 @@ TEST_F(AlignTest, TestAll) {
     EXPECT_EQ(expected, actual);
 }
 
+TEST_F(AlignTest, ParamsSwitches) {
+    // the switches turn off monotony and mapping, whatever the defaults
+    char program[] = "palign", e_flag[] = "-e", e_name[] = "e.txt",
+         f_flag[] = "-f", f_name[] = "f.txt", no_monotony[] = "-M",
+         no_mmap[] = "--no-mmap";
+    char* argv[] = { program, e_flag, e_name, f_flag, f_name,
+                     no_monotony, no_mmap };
+    Align::Params params;
+    EXPECT_EQ(std::make_pair(std::string("e.txt"), std::string("f.txt")),
+              params.parse(7, argv));
+    EXPECT_FALSE(params.monotony());
+    EXPECT_FALSE(params.mapped_texts());
+
+    Align::Params defaults;
+    defaults.parse(5, argv);
+    EXPECT_EQ(ALIGN_DEFAULT_MONOTONY, defaults.monotony());
+    EXPECT_EQ(ALIGN_DEFAULT_MAPPED_TEXTS, defaults.mapped_texts());
+
+    // a negative number of jobs is one per core, as 0 is
+    char negative_jobs[] = "--jobs=-3";
+    argv[5] = negative_jobs;
+    Align::Params jobs;
+    jobs.parse(6, argv);
+    EXPECT_EQ(0, jobs.jobs());
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,79 @@
+// Copyright 2013 Florian Petran
+#include"batch.h"
+
+#include<exception>
+#include<fstream>
+#include<future>
+#include<sstream>
+#include<stdexcept>
+#include<string>
+#include<vector>
+#include"align.h"
+#include"containers.h"
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+namespace Align {
+
+vector<BatchEntry> read_manifest(const string& fname) {
+    std::ifstream manifest(fname);
+    if (!manifest)
+        throw runtime_error(string("Manifest file not found: ") + fname);
+
+    vector<BatchEntry> batch;
+    string line;
+    for (int line_no = 1; std::getline(manifest, line); ++line_no) {
+        std::istringstream fields(line);
+        BatchEntry entry;
+        if (!(fields >> entry.e_name) || entry.e_name[0] == '#')
+            continue;
+        if (!(fields >> entry.f_name >> entry.output))
+            throw runtime_error(fname + ":" + std::to_string(line_no)
+                                + ": need e text, f text and output file");
+        batch.push_back(entry);
+    }
+    return batch;
+}
+
+namespace {
+void align_entry(AlignContext* context, const BatchEntry& entry,
+                 ThreadPool* pool) {
+    BidirectionalAlign bi_align(context, entry.e_name, entry.f_name);
+    AlignMake& align_make = bi_align.align(pool).forward();
+    align_make.merge_sequences()
+              .collect_scores()
+              .get_topranking();
+
+    std::ofstream output(entry.output);
+    for (Sequence* seq : *align_make.get_result())
+        output << *seq << '\n';
+    output.close();
+    if (!output)
+        throw runtime_error(string("Couldn't write ") + entry.output);
+}
+}  // namespace
+
+size_t align_batch(AlignContext* context, const vector<BatchEntry>& batch,
+                   ThreadPool* pool, std::ostream* errors) {
+    vector<std::future<void>> done;
+    for (const BatchEntry& entry : batch)
+        done.push_back(pool->submit([=, &entry]() {
+            align_entry(context, entry, pool);
+        }));
+
+    size_t failed = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        pool->wait(done[i]);
+        try {
+            done[i].get();
+        } catch(const std::exception& e) {
+            ++failed;
+            *errors << batch[i].e_name << " - " << batch[i].f_name
+                    << ": " << e.what() << std::endl;
+        }
+    }
+    return failed;
+}
+}  // namespace Align
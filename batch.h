@@ -0,0 +1,41 @@
+// Copyright 2013 Florian Petran
+// align many text pairs in one go
+#ifndef BATCH_H_
+#define BATCH_H_
+#include<ostream>
+#include<string>
+#include<vector>
+#include"context.h"
+#include"thread_pool.h"
+
+namespace Align {
+
+/// a text pair of a batch, and the file its alignment goes to
+struct BatchEntry {
+    std::string e_name, f_name, output;
+};
+
+/// Read the text pairs of a batch from a manifest file.
+/** Each line has the e text, the f text and the output file,
+ *  separated by whitespace. Empty lines and lines starting with
+ *  # are skipped. Throws runtime_error if the file can't be read,
+ *  or if a line doesn't have all three.
+ **/
+std::vector<BatchEntry> read_manifest(const std::string& fname);
+
+/// Align all pairs of a batch, each as a task on the pool.
+/** The texts and dictionaries are loaded only once through the
+ *  context, no matter how many pairs they're in. Large pairs are
+ *  split into segments on the same pool if Params::segment_length()
+ *  is set, like with a single pair. Each alignment is written to its
+ *  output as soon as it is done. A pair that fails doesn't stop the
+ *  others, its error goes to errors instead.
+ *
+ *  Returns the number of pairs that failed.
+ **/
+size_t align_batch(AlignContext* context,
+                   const std::vector<BatchEntry>& batch,
+                   ThreadPool* pool, std::ostream* errors);
+}  // namespace Align
+
+#endif  // BATCH_H_
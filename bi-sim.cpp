@@ -1,53 +1,415 @@
 // Copyright 2012 Florian Petran
 #include"bi-sim.h"
+#include<cstring>
+#include<stdexcept>
 #include<vector>
 #include<algorithm>
 
 using std::vector;
 using std::max;
+using std::min;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BI_SIM_X86
+#endif
 
 namespace bi_sim {
-    typedef unsigned int uint;
-    typedef vector<num_ty> mat_ty;
+namespace {
+    /// the scores are sums of 0, 1 and 2, so they're exact integers
+    typedef int32_t cell_ty;
+    typedef cell_ty (*kernel_ty)(const unit_ty*, size_t,
+                                 const unit_ty*, size_t);
+    typedef void (*batch_kernel_ty)(const unit_ty*, size_t, const Batch&,
+                                    num_ty*);
+
+    /// scratch space of the current thread, that only ever grows
+    inline cell_ty* scratch(size_t cells) {
+        thread_local vector<cell_ty> buffer;
+        if (buffer.size() < cells)
+            buffer.resize(cells);
+        return buffer.data();
+    }
 
-    inline num_ty id(uint x, uint y) {
+    inline cell_ty id(unit_ty x, unit_ty y) {
         return x == y ? 1 : 0;
     }
 
+    cell_ty scalar_kernel(const unit_ty* x, size_t m,
+                          const unit_ty* y, size_t n) {
+        cell_ty *last = scratch(2 * (n + 1)),
+                *current = last + n + 1;
+        std::fill(last, last + n + 1, 0);
+        current[0] = 0;
+
+        for (size_t i = 1; i <= m; ++i) {
+            unit_ty x_before = x[i-1],
+                    x_here = x[i];
+            cell_ty left = 0;
+            for (size_t j = 1; j <= n; ++j) {
+                left = max(max(last[j], left),
+                           last[j-1]
+                         + id(x_before, y[j-1])
+                         + id(x_here, y[j]));
+                current[j] = left;
+            }
+            std::swap(last, current);
+        }
+        return last[n];
+    }
+
+    void scalar_batch_kernel(const unit_ty* x, size_t m, const Batch& batch,
+                             num_ty* results) {
+        const size_t n = batch.length();
+        const num_ty divisor = 2 * max(m, n);
+        thread_local vector<unit_ty> y;
+        y.resize(n + 1);
+        for (size_t k = 0; k < batch.size(); ++k) {
+            for (size_t j = 0; j <= n; ++j)
+                y[j] = batch.units(k / batch_lanes, j)[k % batch_lanes];
+            results[k] = static_cast<num_ty>(scalar_kernel(x, m, y.data(), n))
+                       / divisor;
+        }
+    }
+
+#ifdef BI_SIM_X86
+    /// Fill the matrix along its anti-diagonals, so that the cells
+    /// of a diagonal only depend on the two before it, and several
+    /// of them can be done at once.
+    /** The diagonals are indexed by i, and y is reversed, which
+     *  makes the units that a diagonal compares contiguous, too.
+     *  The diagonals, x and reversed y are padded, so that the last
+     *  lanes of a diagonal can run past its end. Lanes in the first
+     *  column are masked to 0, and lanes past m don't feed into the
+     *  matrix. Needs to be inlined into a function for the target
+     *  that has vectors of that many bytes.
+     **/
+    template<size_t Bytes>
+    inline __attribute__((always_inline))
+    cell_ty diagonal_kernel(const unit_ty* x, size_t m,
+                            const unit_ty* y, size_t n) {
+        // only aligned like the cells, so that they can be loaded
+        // from anywhere in the diagonals
+        typedef cell_ty Lanes __attribute__((vector_size(Bytes), aligned(4)));
+        const size_t lanes = Bytes / sizeof(cell_ty),
+                     rows = m + 1 + lanes;
+        cell_ty *before = scratch(4 * rows + n + 1 + lanes),
+                *last = before + rows,
+                *current = last + rows;
+        unit_ty *padded_x = reinterpret_cast<unit_ty*>(current + rows),
+                *reversed = padded_x + rows;
+        std::fill(before, before + 4 * rows + n + 1 + lanes, 0);
+        std::copy(x, x + m + 1, padded_x);
+        for (size_t k = 0; k <= n; ++k)
+            reversed[k] = y[n - k];
+
+        cell_ty lane_offsets[lanes];
+        for (size_t lane = 0; lane < lanes; ++lane)
+            lane_offsets[lane] = lane;
+        const Lanes& offsets = *reinterpret_cast<const Lanes*>(lane_offsets);
+
+        for (size_t d = 2; d <= m + n; ++d) {
+            // y[j] with j = d - i is reversed[n + i - d]
+            for (size_t i = d > n ? d - n : 1; i <= min(m, d - 1);
+                 i += lanes) {
+                const unit_ty *x_i = padded_x + i,
+                              *y_i = reversed + n + i - d;
+                const Lanes
+                    &up = *reinterpret_cast<const Lanes*>(last + i - 1),
+                    &left = *reinterpret_cast<const Lanes*>(last + i),
+                    &diagonal = *reinterpret_cast<const Lanes*>(before + i - 1),
+                    &x_before = *reinterpret_cast<const Lanes*>(x_i - 1),
+                    &x_here = *reinterpret_cast<const Lanes*>(x_i),
+                    &y_before = *reinterpret_cast<const Lanes*>(y_i + 1),
+                    &y_here = *reinterpret_cast<const Lanes*>(y_i);
+                // == is -1 for equal lanes, and < for lanes with j > 0
+                Lanes best = up > left ? up : left,
+                      step = diagonal - (x_before == y_before)
+                                      - (x_here == y_here),
+                      in_matrix = offsets + static_cast<cell_ty>(i)
+                                < static_cast<cell_ty>(d);
+                *reinterpret_cast<Lanes*>(current + i) =
+                    (best > step ? best : step) & in_matrix;
+            }
+
+            cell_ty* oldest = before;
+            before = last;
+            last = current;
+            current = oldest;
+        }
+        return last[m];
+    }
+
+    /// The row by row dynamic program of scalar_kernel(), for the
+    /// words of a block of the batch at once.
+    /** Each lane has a word of the block, and the units of x are
+     *  broadcast to all of them. Needs to be inlined into a function
+     *  for a target, like diagonal_kernel().
+     **/
+    inline __attribute__((always_inline))
+    void lane_batch_kernel(const unit_ty* x, size_t m, const Batch& batch,
+                           num_ty* results) {
+        typedef cell_ty Lanes
+            __attribute__((vector_size(batch_lanes * sizeof(cell_ty)),
+                           aligned(4)));
+        const size_t n = batch.length();
+        const num_ty divisor = 2 * max(m, n);
+        Lanes *last = reinterpret_cast<Lanes*>(
+                          scratch(2 * (n + 1) * batch_lanes)),
+              *current = last + n + 1;
+        const Lanes zero = {};
+
+        for (size_t block = 0; block * batch_lanes < batch.size(); ++block) {
+            const Lanes* y =
+                reinterpret_cast<const Lanes*>(batch.units(block, 0));
+            for (size_t j = 0; j <= n; ++j)
+                last[j] = zero;
+            current[0] = zero;
+
+            for (size_t i = 1; i <= m; ++i) {
+                // == is -1 for equal lanes
+                const Lanes x_before = zero + static_cast<cell_ty>(x[i-1]),
+                            x_here = zero + static_cast<cell_ty>(x[i]);
+                Lanes left = zero;
+                for (size_t j = 1; j <= n; ++j) {
+                    Lanes best = last[j] > left ? last[j] : left,
+                          step = last[j-1] - (x_before == y[j-1])
+                                           - (x_here == y[j]);
+                    left = best > step ? best : step;
+                    current[j] = left;
+                }
+                std::swap(last, current);
+            }
+
+            cell_ty block_scores[batch_lanes];
+            std::memcpy(block_scores, &last[n], sizeof(block_scores));
+            size_t words = min(batch_lanes,
+                               batch.size() - block * batch_lanes);
+            for (size_t word = 0; word < words; ++word)
+                results[block * batch_lanes + word] =
+                    static_cast<num_ty>(block_scores[word]) / divisor;
+        }
+    }
+
+    __attribute__((target("sse4.1")))
+    void sse41_batch_kernel(const unit_ty* x, size_t m, const Batch& batch,
+                            num_ty* results) {
+        lane_batch_kernel(x, m, batch, results);
+    }
+
+    __attribute__((target("avx2")))
+    void avx2_batch_kernel(const unit_ty* x, size_t m, const Batch& batch,
+                           num_ty* results) {
+        lane_batch_kernel(x, m, batch, results);
+    }
+
+    __attribute__((target("sse4.1")))
+    cell_ty sse41_kernel(const unit_ty* x, size_t m,
+                         const unit_ty* y, size_t n) {
+        return diagonal_kernel<16>(x, m, y, n);
+    }
+
+    __attribute__((target("avx2")))
+    cell_ty avx2_kernel(const unit_ty* x, size_t m,
+                        const unit_ty* y, size_t n) {
+        return diagonal_kernel<32>(x, m, y, n);
+    }
+#endif  // BI_SIM_X86
+
+    const uint64_t empty_key = 0,
+                   busy_key = UINT64_MAX;
+    /// slots that a pair can be in, starting at its home
+    const size_t probes = 4;
+
+    /// the key of a pair in the cache, which is never empty
+    inline uint64_t pack(uint32_t x, uint32_t y) {
+        return (static_cast<uint64_t>(x) << 32 | y) + 1;
+    }
+
+    kernel_ty kernel_function(Kernel kernel) {
+        if (!supported(kernel))
+            throw std::runtime_error("bi_sim kernel not supported");
+        switch (kernel) {
+#ifdef BI_SIM_X86
+            case SSE41_KERNEL:
+                return sse41_kernel;
+            case AVX2_KERNEL:
+                return avx2_kernel;
+#endif
+            default:
+                return scalar_kernel;
+        }
+    }
+
+    batch_kernel_ty batch_kernel_function(Kernel kernel) {
+        if (!supported(kernel))
+            throw std::runtime_error("bi_sim kernel not supported");
+        switch (kernel) {
+#ifdef BI_SIM_X86
+            case SSE41_KERNEL:
+                return sse41_batch_kernel;
+            case AVX2_KERNEL:
+                return avx2_batch_kernel;
+#endif
+            default:
+                return scalar_batch_kernel;
+        }
+    }
+}  // namespace
+
+    bool supported(Kernel kernel) {
+        switch (kernel) {
+#ifdef BI_SIM_X86
+            case SSE41_KERNEL:
+                return __builtin_cpu_supports("sse4.1");
+            case AVX2_KERNEL:
+                return __builtin_cpu_supports("avx2");
+#endif
+            case SCALAR_KERNEL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    Kernel best_kernel() {
+        for (Kernel kernel : { AVX2_KERNEL, SSE41_KERNEL })
+            if (supported(kernel))
+                return kernel;
+        return SCALAR_KERNEL;
+    }
+
+    void normalize(const string_impl& word, vector<unit_ty>* units) {
+        units->clear();
+        append_normalized(word, units);
+    }
+
+    void append_normalized(const string_impl& word,
+                           vector<unit_ty>* units) {
+        string_impl lower = word;
+        lower_case(&lower);
+        char_impl first = char_at(lower, 0);
+        upper_case(&first);
+
+        units->push_back(first);
+        for (string_size i = 0; i < lower.length(); i = next_char(lower, i))
+            units->push_back(char_at(lower, i));
+    }
+
+    num_ty bi_sim(const unit_ty* x, size_t m, const unit_ty* y, size_t n,
+                  Kernel kernel) {
+        return static_cast<num_ty>(kernel_function(kernel)(x, m, y, n))
+             / (2 * max(m, n));
+    }
+
+    num_ty bi_sim(const unit_ty* x, size_t m, const unit_ty* y, size_t n) {
+        static const kernel_ty best = kernel_function(best_kernel());
+        // the diagonals of shorter words don't fill enough lanes
+        // to make up for the setup
+        kernel_ty kernel = min(m, n) < 8 ? scalar_kernel : best;
+        return static_cast<num_ty>(kernel(x, m, y, n)) / (2 * max(m, n));
+    }
+
+    Batch::Batch(size_t n) : _length(n), _size(0) {}
+
+    void Batch::add(const unit_ty* y) {
+        if (_size % batch_lanes == 0)
+            _units.resize(_units.size() + (_length + 1) * batch_lanes, 0);
+        unit_ty* block = _units.data()
+                       + _size / batch_lanes * (_length + 1) * batch_lanes;
+        for (size_t j = 0; j <= _length; ++j)
+            block[j * batch_lanes + _size % batch_lanes] = y[j];
+        ++_size;
+    }
+
+    void bi_sim(const unit_ty* x, size_t m, const Batch& batch,
+                num_ty* results, Kernel kernel) {
+        batch_kernel_function(kernel)(x, m, batch, results);
+    }
+
+    void bi_sim(const unit_ty* x, size_t m, const Batch& batch,
+                num_ty* results) {
+        static const batch_kernel_ty best =
+            batch_kernel_function(best_kernel());
+        best(x, m, batch, results);
+    }
+
+    Cache::Cache(size_t slots) : _slot_count(0), _hits(0), _misses(0) {
+        if (slots == 0)
+            return;
+        _slot_count = probes;
+        while (_slot_count < slots)
+            _slot_count *= 2;
+        _slots.reset(new Slot[_slot_count]);
+        for (size_t i = 0; i < _slot_count; ++i) {
+            _slots[i].key = empty_key;
+            _slots[i].value = 0;
+        }
+    }
+
+    size_t Cache::home(uint64_t key) const {
+        // Fibonacci hashing, the high bits are the best mixed
+        return (key * UINT64_C(0x9e3779b97f4a7c15) >> 32)
+             & (_slot_count - 1);
+    }
+
+    bool Cache::find(uint32_t x, uint32_t y, num_ty* value) const {
+        if (_slot_count == 0)
+            return false;
+        uint64_t key = pack(x, y);
+        size_t first = home(key);
+        for (size_t probe = 0; probe < probes; ++probe) {
+            const Slot& slot = _slots[(first + probe) & (_slot_count - 1)];
+            if (slot.key.load(std::memory_order_acquire) != key)
+                continue;
+            uint64_t bits = slot.value.load(std::memory_order_relaxed);
+            // the key is checked again, in case the slot was taken
+            // over while reading the value
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.key.load(std::memory_order_relaxed) != key)
+                return false;
+            std::memcpy(value, &bits, sizeof(*value));
+            return true;
+        }
+        return false;
+    }
+
+    void Cache::insert(uint32_t x, uint32_t y, num_ty value) {
+        if (_slot_count == 0)
+            return;
+        uint64_t key = pack(x, y);
+        size_t first = home(key);
+        // an empty slot if there is one, otherwise one of them
+        // is replaced, depending on the pair
+        Slot* target = &_slots[(first + (key >> 7) % probes)
+                               & (_slot_count - 1)];
+        for (size_t probe = 0; probe < probes; ++probe) {
+            Slot& slot = _slots[(first + probe) & (_slot_count - 1)];
+            uint64_t taken = slot.key.load(std::memory_order_relaxed);
+            if (taken == key)
+                return;
+            if (taken == empty_key) {
+                target = &slot;
+                break;
+            }
+        }
+
+        uint64_t old = target->key.load(std::memory_order_relaxed);
+        if (old == busy_key
+         || !target->key.compare_exchange_strong(old, busy_key,
+                                                 std::memory_order_relaxed))
+            // somebody else is writing it
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        target->value.store(bits, std::memory_order_relaxed);
+        target->key.store(key, std::memory_order_release);
+    }
+
     num_ty bi_sim(const string_impl& w1, const string_impl& w2) {
-        uint m = w1.length(),
-             n = w2.length();
-        string_impl x = w1,
-                    y = w2;
-        lower_case(&x);
-        lower_case(&y);
-        char_impl x1 = x[0],
-                  y1 = y[0];
-        upper_case(&x1);
-        upper_case(&y1);
-
-        x = x1 + x;
-        y = y1 + y;
-
-        // initialize and fill matrix
-        vector<vector<num_ty>> f;
-        f.resize(m+1);
-        for (uint i = 0; i <= m; ++i) {
-            f[i].resize(n+1);
-            f[i][0] = 0.0;
-        }
-        for (uint i = 0; i <= n; ++i)
-            f[0][i] = 0.0;
-
-        // calculate bi_sim
-        for (uint i = 1; i <= m; ++i)
-            for (uint j = 1; j <= n; ++j)
-                f[i][j] = max(max(f[i-1][j], f[i][j-1]),
-                              f[i-1][j-1]
-                            + id(x[i-1], y[j-1])
-                            + id(x[i], y[j]));
-
-        return f[m][n] / (2 * max(m, n));
+        thread_local vector<unit_ty> x, y;
+        normalize(w1, &x);
+        normalize(w2, &y);
+        return bi_sim(x.data(), x.size() - 1, y.data(), y.size() - 1);
     }
 }  // namespace bi_sim
-
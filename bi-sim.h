@@ -1,12 +1,168 @@
 // Copyright 2012 Florian Petran
 #ifndef BI_SIM_H_
 #define BI_SIM_H_
+#include<atomic>
+#include<cstddef>
+#include<cstdint>
+#include<memory>
+#include<vector>
 #include"string_impl.h"
 
 namespace bi_sim {
     typedef double num_ty;
+    /// a character of a normalized word
+    typedef uint32_t unit_ty;
+
+    /// the implementations of the dynamic program
+    enum Kernel {
+        /// row by row, in two rows
+        SCALAR_KERNEL,
+        /// along the anti-diagonals, four cells at once
+        SSE41_KERNEL,
+        /// along the anti-diagonals, eight cells at once
+        AVX2_KERNEL
+    };
+
+    /// whether the cpu can run a kernel
+    bool supported(Kernel);
+    /// the fastest kernel the cpu can run, which bi_sim() uses
+    /// for all but short words
+    Kernel best_kernel();
+
+    /// Normalize a word for bi_sim(), into one unit more than it has
+    /// characters.
+    /** The first unit is the upper cased first letter, followed by
+     *  the characters of the lower cased word. These are code points
+     *  with ICU, and bytes with std::string.
+     **/
+    void normalize(const string_impl& word, std::vector<unit_ty>* units);
+    /// the same, appended to units, to keep many normalized words
+    /// in one array
+    void append_normalized(const string_impl& word,
+                           std::vector<unit_ty>* units);
+
+    /// bi_sim of normalized words, x has m + 1 units and y n + 1.
+    /** Doesn't allocate once the thread local scratch space has
+     *  grown to the longest words.
+     **/
+    num_ty bi_sim(const unit_ty* x, size_t m, const unit_ty* y, size_t n);
+    /// the same with a particular kernel, which must be supported
+    num_ty bi_sim(const unit_ty* x, size_t m, const unit_ty* y, size_t n,
+                  Kernel kernel);
     num_ty bi_sim(const string_impl&, const string_impl&);
+
+    /// words in a block of a Batch
+    const size_t batch_lanes = 8;
+
+    /// Normalized words of the same length, to compare one word to
+    /// all of them at once.
+    /** The words are interleaved in blocks of batch_lanes, so that
+     *  the units at one position of the words in a block are
+     *  contiguous. A kernel runs the dynamic program for each of them
+     *  in a lane of its own, with the other word in registers. The
+     *  last block is padded with zero units.
+     **/
+    class Batch {
+        public:
+            /// for words of n + 1 units
+            explicit Batch(size_t n);
+            /// add a word of n + 1 units
+            void add(const unit_ty* y);
+            /// number of words added
+            inline size_t size() const {
+                return _size;
+            }
+            /// the n of the words
+            inline size_t length() const {
+                return _length;
+            }
+            /// the units at position j of the words in a block
+            inline const unit_ty* units(size_t block, size_t j) const {
+                return _units.data()
+                     + (block * (_length + 1) + j) * batch_lanes;
+            }
+
+        private:
+            size_t _length, _size;
+            std::vector<unit_ty> _units;
+    };
+
+    /// bi_sim of x with m + 1 units against all words of the batch,
+    /// into results, which takes batch.size() values
+    void bi_sim(const unit_ty* x, size_t m, const Batch& batch,
+                num_ty* results);
+    /// the same with a particular kernel, which must be supported.
+    /// The scalar kernel compares the words one by one.
+    void bi_sim(const unit_ty* x, size_t m, const Batch& batch,
+                num_ty* results, Kernel kernel);
+
+    /// A bounded cache of bi_sim values, for pairs of word ids.
+    /** The ids are up to the user, e.g. the type ids of two texts,
+     *  but must be below UINT32_MAX. The table has a fixed number of
+     *  slots, and a pair can be in one of a few neighbouring ones.
+     *  Once those are taken, a new pair replaces one of them.
+     *
+     *  Lookups and inserts don't lock, so the cache can be shared
+     *  by any number of threads. A slot that is being written is
+     *  marked as busy, so a lookup never sees a value of another
+     *  pair, and a pair that is written by two threads at once is
+     *  only stored once.
+     **/
+    class Cache {
+        public:
+            /// a table of at least this many slots, rounded up to a
+            /// power of two. Without slots, nothing is cached.
+            explicit Cache(size_t slots);
+            Cache(const Cache&) = delete;
+            const Cache& operator=(const Cache&) = delete;
+
+            /// the value for the pair, from the cache or computed
+            /// by compute() and then cached
+            template<typename Compute>
+            num_ty get(uint32_t x, uint32_t y, Compute compute);
+            /// look up the value for a pair, false if it isn't there
+            bool find(uint32_t x, uint32_t y, num_ty* value) const;
+            void insert(uint32_t x, uint32_t y, num_ty value);
+
+            /// number of get() calls answered from the cache
+            inline uint64_t hits() const {
+                return _hits;
+            }
+            /// number of get() calls that needed compute()
+            inline uint64_t misses() const {
+                return _misses;
+            }
+            inline size_t memory_size() const {
+                return _slot_count * sizeof(Slot);
+            }
+
+        private:
+            struct Slot {
+                /// the packed pair plus one, or empty or busy
+                std::atomic<uint64_t> key;
+                /// the bits of the value
+                std::atomic<uint64_t> value;
+            };
+            /// the first slot a packed pair can be in
+            size_t home(uint64_t key) const;
+
+            std::unique_ptr<Slot[]> _slots;
+            size_t _slot_count;
+            std::atomic<uint64_t> _hits, _misses;
+    };
+
+    template<typename Compute>
+    num_ty Cache::get(uint32_t x, uint32_t y, Compute compute) {
+        num_ty value;
+        if (find(x, y, &value)) {
+            _hits.fetch_add(1, std::memory_order_relaxed);
+            return value;
+        }
+        _misses.fetch_add(1, std::memory_order_relaxed);
+        value = compute();
+        insert(x, y, value);
+        return value;
+    }
 }
 
 #endif  // BI_SIM_H_
-
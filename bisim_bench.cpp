@@ -0,0 +1,106 @@
+// Copyright 2013 Florian Petran
+//
+// Benchmark for the bi_sim kernels in dictionary induction, where every
+// word of one vocabulary is compared to every word of the other. Times
+// the pairs one by one with the scalar kernel and with the kernel that
+// bi_sim() picks, and the batched kernel that compares a word to all
+// words of a length at once.
+#include<stdlib.h>
+
+#include<algorithm>
+#include<chrono>
+#include<cmath>
+#include<iostream>
+#include<map>
+#include<random>
+#include<utility>
+#include<vector>
+#include"bi-sim.h"
+
+using std::vector;
+
+namespace {
+typedef std::chrono::steady_clock bench_clock;
+typedef vector<bi_sim::unit_ty> word;
+
+double seconds_since(const bench_clock::time_point& start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/// normalized words of 2 to 14 characters, mostly around 7
+vector<word> make_vocabulary(std::mt19937* random, int types) {
+    std::normal_distribution<double> length(7, 2.5);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    vector<word> vocabulary;
+    for (int type = 0; type < types; ++type) {
+        int n = std::max(2, std::min(14, static_cast<int>(length(*random))));
+        word units(n + 1);
+        for (bi_sim::unit_ty& unit : units)
+            unit = letter(*random);
+        units[0] -= 'a' - 'A';
+        vocabulary.push_back(units);
+    }
+    return vocabulary;
+}
+
+void report(const char* name, double time, size_t pairs, double sum) {
+    std::cout << name << ": " << time << "s, "
+              << pairs / time / 1e6 << "M pairs/s, checksum " << sum
+              << std::endl;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int types = argc > 1 ? std::atoi(argv[1]) : 2000;
+    std::mt19937 random(4711);
+    const vector<word> e_words = make_vocabulary(&random, types),
+                       f_words = make_vocabulary(&random, types);
+    const size_t pairs = e_words.size() * f_words.size();
+    const char* kernel_names[] = { "scalar", "sse4.1", "avx2" };
+    std::cout << types << " x " << types << " words, best kernel "
+              << kernel_names[bi_sim::best_kernel()] << std::endl;
+
+    double scalar_sum = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (const word& x : e_words)
+        for (const word& y : f_words)
+            scalar_sum += bi_sim::bi_sim(x.data(), x.size() - 1,
+                                         y.data(), y.size() - 1,
+                                         bi_sim::SCALAR_KERNEL);
+    report("pairs, scalar kernel", seconds_since(start), pairs, scalar_sum);
+
+    double dispatch_sum = 0;
+    start = bench_clock::now();
+    for (const word& x : e_words)
+        for (const word& y : f_words)
+            dispatch_sum += bi_sim::bi_sim(x.data(), x.size() - 1,
+                                           y.data(), y.size() - 1);
+    report("pairs, dispatched", seconds_since(start), pairs, dispatch_sum);
+
+    // the batches are made once for a vocabulary, so they aren't timed
+    std::map<size_t, bi_sim::Batch> batches;
+    for (const word& y : f_words) {
+        size_t n = y.size() - 1;
+        batches.insert(std::make_pair(n, bi_sim::Batch(n)))
+            .first->second.add(y.data());
+    }
+    double batch_sum = 0;
+    vector<bi_sim::num_ty> results(f_words.size());
+    start = bench_clock::now();
+    for (const word& x : e_words)
+        for (const std::pair<const size_t, bi_sim::Batch>& batch : batches) {
+            bi_sim::bi_sim(x.data(), x.size() - 1, batch.second,
+                           results.data());
+            for (size_t k = 0; k < batch.second.size(); ++k)
+                batch_sum += results[k];
+        }
+    report("batched", seconds_since(start), pairs, batch_sum);
+
+    // summed in another order, so only about the same
+    if (std::abs(batch_sum - scalar_sum) > 1e-6 * scalar_sum
+     || dispatch_sum != scalar_sum) {
+        std::cerr << "Kernels disagree" << std::endl;
+        return 1;
+    }
+    return 0;
+}
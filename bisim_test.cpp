@@ -5,6 +5,8 @@
 // Kondrak/Dorr (2006): Automatic identification of confusable
 // drug names, p.5
 #include"bi-sim.h"
+#include<algorithm>
+#include<vector>
 #include<gtest/gtest.h> // NOLINT[build/include_order]
 
 class Bisim_Test : public testing::Test {
@@ -29,3 +31,126 @@ TEST_F(Bisim_Test, CorrectValues) {
             bi_sim::bi_sim("Toradol", "Taxol"));
 }
 
+
+TEST_F(Bisim_Test, Normalize) {
+    std::vector<bi_sim::unit_ty> units;
+    bi_sim::normalize("Toradol", &units);
+    bi_sim::append_normalized("taxol", &units);
+    EXPECT_EQ(14, units.size());
+    EXPECT_EQ('T', units[8]);
+    EXPECT_EQ('t', units[9]);
+    EXPECT_EQ('x', units[11]);
+
+#ifdef USE_ICU_STRING
+    // characters outside of the BMP take one unit, not two
+    const char apfel[] = "\xf0\x9d\x94\xb8pfel";
+    bi_sim::normalize(from_utf8(apfel, sizeof(apfel) - 1), &units);
+    EXPECT_EQ(6, units.size());
+    EXPECT_EQ(0x1d538, units[0]);
+    EXPECT_EQ(0x1d538, units[1]);
+    EXPECT_EQ('p', units[2]);
+#endif
+}
+
+TEST_F(Bisim_Test, Kernels) {
+    // long enough to fill several lanes of the vector kernels
+    const char* words[] = { "", "T", "Toradol", "Tramadol", "Tobradex",
+                            "Torsemide", "Theraflu",
+                            "Hydrochlorothiazide", "Hydroxychloroquine",
+                            "Chlorpropamide", "Chlorpromazine",
+                            "Dextroamphetaminesaccharate" };
+    std::vector<std::vector<bi_sim::unit_ty>> units;
+    for (const char* word : words) {
+        units.push_back(std::vector<bi_sim::unit_ty>());
+        bi_sim::normalize(word, &units.back());
+    }
+    EXPECT_EQ(8, units[2].size());
+    EXPECT_EQ('T', units[2][0]);
+    EXPECT_EQ('t', units[2][1]);
+
+    for (bi_sim::Kernel kernel : { bi_sim::SCALAR_KERNEL,
+                                   bi_sim::SSE41_KERNEL,
+                                   bi_sim::AVX2_KERNEL }) {
+        if (!bi_sim::supported(kernel))
+            continue;
+        EXPECT_DOUBLE_EQ(bi_sim::num_ty(0.6875),
+                bi_sim::bi_sim(units[2].data(), 7, units[3].data(), 8,
+                               kernel));
+        // the empty word is only compared to others
+        for (size_t i = 0; i < units.size(); ++i)
+            for (size_t j = i == 0 ? 1 : 0; j < units.size(); ++j)
+                EXPECT_EQ(bi_sim::bi_sim(words[i], words[j]),
+                          bi_sim::bi_sim(units[i].data(), units[i].size() - 1,
+                                         units[j].data(), units[j].size() - 1,
+                                         kernel))
+                    << words[i] << " - " << words[j];
+    }
+}
+
+TEST_F(Bisim_Test, Cache) {
+    bi_sim::Cache cache(10);
+    EXPECT_EQ(16 * 16, cache.memory_size());
+    bi_sim::num_ty value = 0;
+    EXPECT_FALSE(cache.find(1, 2, &value));
+    cache.insert(1, 2, 0.5);
+    EXPECT_TRUE(cache.find(1, 2, &value));
+    EXPECT_DOUBLE_EQ(0.5, value);
+    // the pairs are ordered
+    EXPECT_FALSE(cache.find(2, 1, &value));
+
+    int computed = 0;
+    auto compute = [&]() { ++computed; return bi_sim::num_ty(0.25); };
+    EXPECT_DOUBLE_EQ(0.5, cache.get(1, 2, compute));
+    EXPECT_DOUBLE_EQ(0.25, cache.get(2, 1, compute));
+    EXPECT_DOUBLE_EQ(0.25, cache.get(2, 1, compute));
+    EXPECT_EQ(1, computed);
+    EXPECT_EQ(2, cache.hits());
+    EXPECT_EQ(1, cache.misses());
+
+    // more pairs than slots only replace older ones
+    for (uint32_t x = 0; x < 100; ++x)
+        cache.insert(x, x + 1, x);
+    for (uint32_t x = 0; x < 100; ++x)
+        if (cache.find(x, x + 1, &value)) {
+            EXPECT_DOUBLE_EQ(x, value);
+        }
+
+    bi_sim::Cache disabled(0);
+    EXPECT_EQ(0, disabled.memory_size());
+    EXPECT_DOUBLE_EQ(0.25, disabled.get(1, 2, compute));
+    EXPECT_FALSE(disabled.find(1, 2, &value));
+    EXPECT_EQ(0, disabled.hits());
+    EXPECT_EQ(1, disabled.misses());
+}
+
+TEST_F(Bisim_Test, Batch) {
+    const char* words[] = { "Tramadol", "Tobradex", "Theraflu",
+                            "Tegretol", "Toradols", "Tramadol",
+                            "Trazodon", "Torsemid", "Tenormin" };
+    std::vector<bi_sim::unit_ty> x, y;
+    bi_sim::normalize("Toradol", &x);
+    bi_sim::Batch batch(8);
+    for (const char* word : words) {
+        bi_sim::normalize(word, &y);
+        batch.add(y.data());
+    }
+    EXPECT_EQ(9, batch.size());
+    EXPECT_EQ(8, batch.length());
+    // the second block only has one word
+    EXPECT_EQ('t', batch.units(1, 1)[0]);
+    EXPECT_EQ(0, batch.units(1, 1)[1]);
+
+    std::vector<bi_sim::num_ty> results(batch.size());
+    for (bi_sim::Kernel kernel : { bi_sim::SCALAR_KERNEL,
+                                   bi_sim::SSE41_KERNEL,
+                                   bi_sim::AVX2_KERNEL }) {
+        if (!bi_sim::supported(kernel))
+            continue;
+        std::fill(results.begin(), results.end(), -1);
+        bi_sim::bi_sim(x.data(), 7, batch, results.data(), kernel);
+        EXPECT_DOUBLE_EQ(bi_sim::num_ty(0.6875), results[0]);
+        for (size_t k = 0; k < batch.size(); ++k)
+            EXPECT_EQ(bi_sim::bi_sim("Toradol", words[k]), results[k])
+                << words[k];
+    }
+}
@@ -0,0 +1,108 @@
+// Copyright 2013 Florian Petran
+//
+// Send requests to palign --serve, and print the answers. The request
+// is given on the command line, or read from stdin one per line.
+#include<utility>
+#include<string>
+#include<vector>
+#include<stdexcept>
+#include<iostream>
+#include"align_config.h"
+#include"server.h"
+#include<boost/program_options.hpp> // NOLINT[build/include_order]
+
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::string;
+
+namespace po = boost::program_options;
+
+namespace {
+struct opts {
+    string socket_name;
+    vector<string> request;
+} myopts;
+
+pair<bool, int> get_options(opts* myopts,
+                            int argc, char* argv[]) {
+    po::options_description desc
+        (static_cast<std::string>("pAlign v")
+            + ALIGN_VERSION + " client\n"
+            + "Sends a request to palign --serve, for example\n"
+            + "    palign-client -s <socket> align <e text> <f text>\n"
+            + "Without a request, reads one request per line from stdin.\n"
+            + "Allowed options");
+
+    desc.add_options()
+        ("help,h",
+         "display this helpful message")
+        ("socket,s",
+         po::value<string>(&(myopts->socket_name)),
+         "socket of the server")
+        ; //NOLINT
+    po::options_description hidden("Hidden options");
+    hidden.add_options()
+        ("request",
+         po::value<vector<string>>(&(myopts->request)),
+         "request words");
+    po::positional_options_description p;
+    p.add("request", -1);
+    po::options_description cmdline_opts;
+    cmdline_opts.add(desc).add(hidden);
+
+    po::variables_map m;
+    po::store(po::command_line_parser(argc, argv).
+                  options(cmdline_opts).positional(p).run(), m);
+    po::notify(m);
+
+    if (m.count("help")) {
+        std::cout << desc << std::endl;
+        return make_pair(true, 0);
+    }
+
+    if (!m.count("socket")) {
+        std::cout << "Error: No socket specified!" << std::endl
+                  << desc << std::endl;
+        return make_pair(true, 1);
+    }
+
+    return make_pair(false, 0);
+}
+
+/// print the answer without the header, true if it wasn't an error
+bool print_answer(const string& answer) {
+    if (answer.compare(0, 3, "ok ") != 0) {
+        std::cerr << answer;
+        return false;
+    }
+    std::cout << answer.substr(answer.find('\n') + 1);
+    return true;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    pair<bool, int> quitcode = get_options(&myopts, argc, argv);
+    if (quitcode.first)
+        return quitcode.second;
+
+    try {
+        if (!myopts.request.empty()) {
+            string line;
+            for (const string& word : myopts.request)
+                line += (line.empty() ? "" : " ") + word;
+            return print_answer(Align::request(myopts.socket_name, line))
+                 ? 0 : 1;
+        }
+
+        bool failed = false;
+        for (string line; std::getline(std::cin, line);)
+            if (!line.empty())
+                failed |= !print_answer(Align::request(myopts.socket_name,
+                                                       line));
+        return failed ? 1 : 0;
+    } catch(const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
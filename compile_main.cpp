@@ -0,0 +1,111 @@
+// Copyright 2013 Florian Petran
+//
+// Compile texts and dictionaries into binary formats that palign can
+// map directly, so that it doesn't need to parse and normalize them again.
+#include<cstdio>
+#include<utility>
+#include<string>
+#include<vector>
+#include<stdexcept>
+#include<iostream>
+#include"align_config.h"
+#include"context.h"
+#include"dictionary.h"
+#include"text.h"
+#include<boost/program_options.hpp> // NOLINT[build/include_order]
+
+using std::vector;
+using std::pair;
+using std::make_pair;
+using std::string;
+
+namespace po = boost::program_options;
+
+namespace {
+struct opts {
+    vector<string> input_files;
+    vector<string> dictionaries;
+} myopts;
+
+pair<bool, int> get_options(opts* myopts,
+                            int argc, char* argv[]) {
+    po::options_description desc
+        (static_cast<std::string>("pAlign v")
+            + ALIGN_VERSION + " compiler\n"
+            + "Compiles each text file to <file>"
+            + Align::Text::compiled_name("") + ", and each\n"
+            + "dictionary file to <file>"
+            + Align::Dictionary::compiled_name("") + ". palign will use\n"
+            + "those instead of the original files as long as they are "
+            + "up to date.\n"
+            + "Allowed options");
+
+    desc.add_options()
+        ("help,h",
+         "display this helpful message")
+        ("dictionary,d",
+         po::value<vector<string>>(&(myopts->dictionaries)),
+         "dictionary file to compile, can be given multiple times")
+        ; //NOLINT
+    po::options_description hidden("Hidden options");
+    hidden.add_options()
+        ("input-file",
+         po::value<vector<string>>(&(myopts->input_files)),
+         "input file");
+    po::positional_options_description p;
+    p.add("input-file", -1);
+    po::options_description cmdline_opts;
+    cmdline_opts.add(desc).add(hidden);
+
+    po::variables_map m;
+    po::store(po::command_line_parser(argc, argv).
+                  options(cmdline_opts).positional(p).run(), m);
+    po::notify(m);
+
+    if (m.count("help")) {
+        std::cout << desc << std::endl;
+        return make_pair(true, 0);
+    }
+
+    if (!m.count("input-file") && !m.count("dictionary")) {
+        std::cout << "Error: No input files specified!" << std::endl
+                  << desc << std::endl;
+        return make_pair(true, 1);
+    }
+
+    return make_pair(false, 0);
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    pair<bool, int> quitcode = get_options(&myopts, argc, argv);
+    if (quitcode.first)
+        return quitcode.second;
+
+    try {
+        Align::Params params;
+        Align::AlignContext context(params);
+        Align::DictionaryFactory& df = context.dictionaries();
+        for (const string& fname : myopts.input_files) {
+            string compiled = Align::Text::compiled_name(fname);
+            // an existing compiled file would be loaded instead
+            // of the text, so it needs to go first
+            std::remove(compiled.c_str());
+
+            std::cout << "Compiling " << fname << "..." << std::endl;
+            df.get_text(fname)->save(compiled);
+            std::cout << "...wrote " << compiled << "." << std::endl;
+        }
+        for (const string& fname : myopts.dictionaries) {
+            string compiled = Align::Dictionary::compiled_name(fname);
+            std::cout << "Compiling " << fname << "..." << std::endl;
+            Align::Dictionary::compile(fname, compiled);
+            std::cout << "...wrote " << compiled << "." << std::endl;
+        }
+    } catch(const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -34,6 +34,18 @@ using std::runtime_error;
 
 namespace Align {
 
+namespace {
+/// the dictionary for the opposite direction of dict
+const Dictionary* reverse_dictionary(AlignContext* context,
+                                    const Dictionary* dict) {
+    if (dict->reverse() != nullptr)
+        return dict->reverse();
+    return context->dictionaries()
+           .get_dictionary(dict->get_f()->filename(),
+                           dict->get_e()->filename());
+}
+}  // namespace
+
 Pair::Pair(const WordToken& s, const WordToken& t)
     : _source(s), _target(t) {
 }
@@ -58,14 +70,6 @@ const Pair& Pair::reverse() {
     return *this;
 }
 
-bool Pair::targets_close(const Pair& that) const {
-    return this->_target.close_to(that._target);
-}
-bool Pair::both_close(const Pair& that) const {
-    return targets_close(that)
-        && this->_source.close_to(that._source);
-}
-
 const WordToken& Pair::source() const { return _source; }
 const WordToken& Pair::target() const { return _target; }
 
@@ -78,28 +82,30 @@ const float& Sequence::get_score() const {
     return _score;
 }
 
-Sequence::Sequence(const Dictionary& dict) {
+Sequence::Sequence(Hypothesis* hypothesis) {
     _length = 0;
-    _dict = &dict;
+    _hypothesis = hypothesis;
+    _dict = hypothesis->_dict;
 }
 
-Sequence::Sequence(const Dictionary& dict, const Pair& p) {
-    _dict = &dict;
+Sequence::Sequence(Hypothesis* hypothesis, const Pair& p) {
+    _hypothesis = hypothesis;
+    _dict = hypothesis->_dict;
     this->add(p);
 }
 
 Sequence::~Sequence() {
     for (Pair& p : *this) {
-        p.target().remove_from(this);
-        p.source().remove_from(this);
+        _hypothesis->remove_member(p.target(), this);
+        _hypothesis->remove_member(p.source(), this);
     }
 }
 
 const Sequence& Sequence::operator=(const Sequence& that) {
     _dict = that._dict;
     for (Pair& p : *this) {
-        p.target().remove_from(this);
-        p.source().remove_from(this);
+        _hypothesis->remove_member(p.target(), this);
+        _hypothesis->remove_member(p.source(), this);
     }
     _length = 0;
     for (auto p = that.cbegin(); p != that.cend(); ++p) {
@@ -131,18 +137,19 @@ void Sequence::add(const Pair& p) {
         _slot = p.slot();
     this->push_back(p);
     _back_slot = p.slot();
-    p.source().add_to_sequence(this);
-    p.target().add_to_sequence(this);
+    _hypothesis->add_member(p.source(), this);
+    _hypothesis->add_member(p.target(), this);
     ++_length;
 }
 
-bool Sequence::add_if_close(const Pair& p) {
+template<bool Monotone>
+bool Sequence::add_if_close(const Pair& p, int closeness) {
     if (_length == 0) {
         add(p);
         return true;
     }
 
-    if (this->last_pair().targets_close(p)
+    if (this->last_pair().targets_close<Monotone>(p, closeness)
      && !this->has_target(p)) {
         add(p);
         return true;
@@ -150,22 +157,22 @@ bool Sequence::add_if_close(const Pair& p) {
 
     return false;
 }
+template bool Sequence::add_if_close<true>(const Pair&, int);
+template bool Sequence::add_if_close<false>(const Pair&, int);
 
 void Sequence::merge(Sequence* that) {
     for (auto pp = that->begin();
             pp != that->end(); ++pp) {
         this->add(*pp);
-        pp->target().remove_from(that);
-        pp->source().remove_from(that);
+        _hypothesis->remove_member(pp->target(), that);
+        _hypothesis->remove_member(pp->source(), that);
     }
     _back_slot = this->back().slot();
     _length += that->length();
 }
 
 const Sequence& Sequence::reverse() {
-    _dict = DictionaryFactory::get_instance()
-             .get_dictionary(_dict->get_f()->filename(),
-                             _dict->get_e()->filename());
+    _dict = reverse_dictionary(_hypothesis->_context, _dict);
     for (Pair& pair : *this)
         pair.reverse();
 
@@ -217,8 +224,8 @@ const Pair& Sequence::last_pair() const {
 
 ///////////////////////////////// Hypothesis ///////////////////////////////////
 
-Hypothesis::Hypothesis(const Dictionary& d) {
-    _dict = &d;
+Hypothesis::Hypothesis(AlignContext* context, const Dictionary& d)
+    : _context(context), _dict(&d) {
 }
 
 Hypothesis::~Hypothesis() {
@@ -227,7 +234,7 @@ Hypothesis::~Hypothesis() {
 }
 
 Sequence* Hypothesis::new_sequence(const Pair& p) {
-    Sequence* seq = new Sequence(*_dict, p);
+    Sequence* seq = new Sequence(this, p);
     this->push_back(seq);
     return seq;
 }
@@ -249,10 +256,31 @@ Hypothesis::iterator Hypothesis::remove_sequence(Sequence* seq) {
     return this->remove_sequence(pos);
 }
 
+std::list<Sequence*>* Hypothesis::sequences_of(const WordToken& tok) {
+    return &_members[tok];
+}
+
+void Hypothesis::add_member(const WordToken& tok, Sequence* seq) {
+    _members[tok].push_back(seq);
+}
+
+void Hypothesis::remove_member(const WordToken& tok, const Sequence* seq) {
+    // entries are never erased, so that pointers from
+    // sequences_of() stay valid while sequences are removed
+    auto member = _members.find(tok);
+    if (member == _members.end())
+        return;
+    std::list<Sequence*>& seqs = member->second;
+    auto si = seqs.begin();
+    while (si != seqs.end())
+        if (*si == seq)
+            si = seqs.erase(si);
+        else
+            ++si;
+}
+
 const Hypothesis& Hypothesis::reverse() {
-    _dict = DictionaryFactory::get_instance()
-             .get_dictionary(_dict->get_f()->filename(),
-                             _dict->get_e()->filename());
+    _dict = reverse_dictionary(_context, _dict);
     for (Sequence* seq : *this)
         seq->reverse();
 
@@ -277,10 +305,36 @@ const Hypothesis& Hypothesis::munch(Hypothesis *that) {
         if (*this_seq == *that_seq)
             continue;
         this->insert(++this_seq, *that_seq);
+        (*that_seq)->_hypothesis = this;
     }
 
+    // take over the token index of the other hypothesis too, and
+    // leave it empty, since we own its sequences now
+    take_members(that);
+    that->clear();
+
+    return *this;
+}
+
+const Hypothesis& Hypothesis::append(Hypothesis *that) {
+    if (this->_dict != that->_dict)
+        throw runtime_error("Dictionaries don't match - aborting append");
+
+    for (Sequence* seq : *that)
+        seq->_hypothesis = this;
+    this->splice(this->end(), *that);
+    take_members(that);
+
     return *this;
 }
+
+void Hypothesis::take_members(Hypothesis* that) {
+    for (auto& member : that->_members) {
+        std::list<Sequence*>& seqs = this->_members[member.first];
+        seqs.splice(seqs.end(), member.second);
+    }
+    that->_members.clear();
+}
 }  // namespace Align
 
 std::ostream& operator<<(std::ostream& strm, const Align::Pair& pair) {
@@ -4,12 +4,14 @@
 #define CONTAINERS_H_
 #include<list>
 #include<map>
+#include<unordered_map>
 #include<vector>
 #include<iostream>
 #include<string>
 #include"text.h"
 #include"dictionary.h"
 #include"params.h"
+#include"context.h"
 
 namespace Align {
 
@@ -21,8 +23,15 @@ namespace Align {
  **/
 class Pair {
     public:
-        bool targets_close(const Pair&) const;
-        bool both_close(const Pair&) const;
+        template<bool Monotone>
+        inline bool targets_close(const Pair& that, int closeness) const {
+            return _target.close_to<Monotone>(that._target, closeness);
+        }
+        template<bool Monotone>
+        inline bool both_close(const Pair& that, int closeness) const {
+            return targets_close<Monotone>(that, closeness)
+                 & _source.close_to<Monotone>(that._source, closeness);
+        }
 
         bool operator==(const Pair&) const;
         inline bool operator!=(const Pair& that) const {
@@ -52,7 +61,8 @@ class Sequence : std::list<Pair> {
         void add(const Pair&);
         /// add a pair if its target is close to our last target,
         /// return whether it was added or not
-        bool add_if_close(const Pair& p);
+        template<bool Monotone>
+        bool add_if_close(const Pair& p, int closeness);
         /// merge another sequence to this
         void merge(Sequence* s);
         /// reverse e and f
@@ -94,9 +104,9 @@ class Sequence : std::list<Pair> {
         operator std::vector<int>();
 
     protected:
-        explicit Sequence(const Dictionary&);
+        explicit Sequence(Hypothesis*);
         /// construct an initial Sequence over two texts from one pair
-        Sequence(const Dictionary&, const Pair&);
+        Sequence(Hypothesis*, const Pair&);
         Sequence(const Sequence&) = delete;
         const Sequence& operator=(const Sequence&);
         /// only hypothesis may call the dtor, because it
@@ -104,6 +114,8 @@ class Sequence : std::list<Pair> {
         ~Sequence();
 
     private:
+        /// the Hypothesis that owns this
+        Hypothesis* _hypothesis;
         const Dictionary* _dict;
         float _score = 0.0;
         int _slot = 0,
@@ -120,12 +132,14 @@ class AlignMake;
  *  what this class needs to do:
  *  - add and remove sequences
  *  - iterate over sequences
- *  - track/own sequence pointers on the heap stored for the WordToken
+ *  - own the sequence pointers, and track which WordToken is part
+ *    of which Sequence
  *  - reverse e/f direction
  *  - merge with another hypothesis
  */
 class Hypothesis : private std::list<Sequence*> {
     friend class AlignMake;
+    friend class Sequence;
     public:
         typedef std::list<Sequence*>::iterator iterator;
         typedef std::list<Sequence*>::const_iterator const_iterator;
@@ -147,15 +161,21 @@ class Hypothesis : private std::list<Sequence*> {
         iterator remove_sequence(iterator pos);
         iterator remove_sequence(Sequence* seq);
 
+        /// all Sequence objects the WordToken is part of
+        std::list<Sequence*>* sequences_of(const WordToken& tok);
+
         /// reverse the alignment direction of this
         /// Hypothesis
         const Hypothesis& reverse();
         /// munch up another hypothesis, adding all sequence
         /// to this and removing them from the other hypothesis
         const Hypothesis& munch(Hypothesis* other);
+        /// move all sequences of another hypothesis behind ours,
+        /// leaving the other empty
+        const Hypothesis& append(Hypothesis* other);
 
     protected:
-        explicit Hypothesis(const Dictionary& d);
+        Hypothesis(AlignContext* context, const Dictionary& d);
         ~Hypothesis();
         Hypothesis() = delete;
         Hypothesis(const Hypothesis&) = delete;
@@ -166,7 +186,17 @@ class Hypothesis : private std::list<Sequence*> {
         };
 
     private:
+        /// take over the token index of another hypothesis
+        void take_members(Hypothesis* other);
+        void add_member(const WordToken& tok, Sequence* seq);
+        void remove_member(const WordToken& tok, const Sequence* seq);
+
+        AlignContext* _context;
         const Dictionary* _dict;
+        /// Sequence objects by WordToken - only tokens that have
+        /// been part of a Sequence have an entry
+        std::unordered_map<WordToken, std::list<Sequence*>, WordTokenHash>
+            _members;
 };
 }  // namespace Align
 
@@ -0,0 +1,49 @@
+// Copyright 2013 Florian Petran
+// everything that an alignment shares with others
+#ifndef CONTEXT_H_
+#define CONTEXT_H_
+#include<memory>
+#include"params.h"
+#include"dictionary.h"
+
+namespace Align {
+
+/// The parameters of an alignment, and the texts and dictionaries
+/// loaded for it.
+/** Candidates, AlignMake and Hypothesis get their parameters and
+ *  dictionaries from the context they're given, so alignments with
+ *  different contexts don't share any state, and can run in parallel.
+ *  Alignments can also share a context, the DictionaryFactory is
+ *  safe to use from several threads, and the parameters can't be
+ *  changed once the context exists. Contexts with different
+ *  parameters can share a DictionaryFactory, too.
+ **/
+class AlignContext {
+    public:
+        explicit AlignContext(const Params& params)
+            : _params(params),
+              _owned(new DictionaryFactory(_params)),
+              _dictionaries(_owned.get()) {}
+        /// use a factory owned by someone else, which must outlive
+        /// the context. Its dictionary base directory is used, not
+        /// the one in params.
+        AlignContext(const Params& params, DictionaryFactory* dictionaries)
+            : _params(params), _dictionaries(dictionaries) {}
+        AlignContext(const AlignContext&) = delete;
+        const AlignContext& operator=(const AlignContext&) = delete;
+
+        inline const Params& params() const {
+            return _params;
+        }
+        inline DictionaryFactory& dictionaries() {
+            return *_dictionaries;
+        }
+
+    private:
+        const Params _params;
+        std::unique_ptr<DictionaryFactory> _owned;
+        DictionaryFactory* _dictionaries;
+};
+}  // namespace Align
+
+#endif  // CONTEXT_H_
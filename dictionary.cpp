@@ -1,19 +1,30 @@
 // Copyright 2012 Florian Petran
 #include"dictionary.h"
 
+#include<algorithm>
+#include<cstring>
+#include<ctime>
+#include<exception>
+#include<future>
+#include<limits>
 #include<string>
 #include<stdexcept>
 #include<utility>
 #include<map>
-#include<list>
+#include<memory>
+#include<mutex>
+#include<unordered_set>
+#include<vector>
 
 #include"containers.h"
+#include"mapped_file.h"
 #include"params.h"
 
 using std::ifstream;
 using std::string;
 using std::pair;
-using std::list;
+using std::make_pair;
+using std::vector;
 using std::map;
 using std::runtime_error;
 
@@ -21,11 +32,6 @@ namespace Align {
 
 ////////////////////////// DictionaryFactory //////////////////////////////////
 
-DictionaryFactory& DictionaryFactory::get_instance() {
-    static DictionaryFactory _instance;
-    return _instance;
-}
-
 DictionaryFactory::~DictionaryFactory() {
     for (pair<const pair<string, string>, Dictionary*>& dict_entry
             : dictionaries)
@@ -34,93 +40,431 @@ DictionaryFactory::~DictionaryFactory() {
         delete text_entry.second;
 }
 
-DictionaryFactory::DictionaryFactory()
-    : index_filename("") { }
+DictionaryFactory::DictionaryFactory(const Params& params)
+    : params(params), index_filename(""), index_time(-1), use_clock(0),
+      dropped_hits(0), dropped_misses(0) { }
 
 namespace {
     inline string basename(const string& str) {
-        return(str.substr(str.rfind("/") + 1, str.length() - 1));
+        // npos + 1 wraps around to 0 if there is no directory
+        return(str.substr(str.rfind("/") + 1));
+    }
+
+    inline string trim(const string& str) {
+        static const char* whitespace = " \t\r";
+        size_t begin = str.find_first_not_of(whitespace);
+        if (begin == string::npos)
+            return "";
+        return str.substr(begin,
+                          str.find_last_not_of(whitespace) - begin + 1);
     }
 }
 
 const Dictionary* DictionaryFactory::get_dictionary(const string& e,
                                                     const string& f) {
+    std::unique_lock<std::mutex> lock(access);
     pair<string, string> transl_pair = make_pair(basename(e),
                                                  basename(f));
+    pair<string, string> rev_pair = make_pair(transl_pair.second,
+                                              transl_pair.first);
 
     map<pair<string, string>, Dictionary*>::iterator
         dict_entry = dictionaries.find(transl_pair);
+    if (dict_entry != dictionaries.end()) {
+        last_use[transl_pair] = ++use_clock;
+        return dict_entry->second;
+    }
+
+    // another thread reads it already
+    map<textpair, std::shared_future<Dictionary*>>::iterator
+        loading = loading_dictionaries.find(transl_pair);
+    if (loading != loading_dictionaries.end()) {
+        std::shared_future<Dictionary*> pending = loading->second;
+        lock.unlock();
+        pending.wait();
+        lock.lock();
+        return pending.get();
+    }
 
-    if (dict_entry == dictionaries.end()) {
-        if (index_filename == "")
-            index_filename  = Params::get().dict_base() + "/INDEX";
-        dictionaries[transl_pair] = new Dictionary();
-        dictionaries[transl_pair]->set_texts(get_text(e), get_text(f));
-        dictionaries[transl_pair]->open(locate_dictionary_file(basename(e),
-                                                               basename(f)));
-        return dictionaries[transl_pair];
+    // the index is read with the factory locked, the files without it
+    if (index_filename == "")
+        index_filename  = params.dict_base() + "/INDEX";
+    const Dictionary* mirror = nullptr;
+    string dict_file;
+    map<pair<string, string>, Dictionary*>::iterator
+        rev_entry = dictionaries.find(rev_pair);
+    if (rev_entry != dictionaries.end()
+     && is_mirrored(transl_pair.first, transl_pair.second))
+        mirror = rev_entry->second;
+    else
+        dict_file = locate_dictionary_file(transl_pair.first,
+                                           transl_pair.second);
+
+    std::promise<Dictionary*> promise;
+    loading_dictionaries[transl_pair] = promise.get_future().share();
+    // only keep the dictionary once it's complete
+    std::unique_ptr<Dictionary> dict(new Dictionary());
+    try {
+        dict->set_texts(find_text(e, &lock), find_text(f, &lock));
+        lock.unlock();
+        if (mirror != nullptr)
+            dict->transpose(*mirror);
+        else
+            dict->open(dict_file);
+        lock.lock();
+    } catch(...) {
+        if (!lock.owns_lock())
+            lock.lock();
+        loading_dictionaries.erase(transl_pair);
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    // the reverse may have been read meanwhile
+    rev_entry = dictionaries.find(rev_pair);
+    if (rev_entry != dictionaries.end()) {
+        dict->_reverse = rev_entry->second;
+        rev_entry->second->_reverse = dict.get();
+        dict->_bisim_cache = rev_entry->second->_bisim_cache;
+        dict->_transposed_cache = !rev_entry->second->_transposed_cache;
+    } else {
+        dict->_bisim_cache =
+            std::make_shared<bi_sim::Cache>(
+            std::max(params.bisim_cache(), 0));
     }
+    dictionaries[transl_pair] = dict.get();
+    loading_dictionaries.erase(transl_pair);
+    last_use[transl_pair] = ++use_clock;
+    promise.set_value(dict.get());
+    return dict.release();
+}
+
+size_t DictionaryFactory::memory_use() {
+    std::lock_guard<std::mutex> lock(access);
+    return bytes_used();
+}
+
+void DictionaryFactory::bisim_cache_stats(uint64_t* hits,
+                                          uint64_t* misses) {
+    std::lock_guard<std::mutex> lock(access);
+    *hits = dropped_hits;
+    *misses = dropped_misses;
+    // a cache is shared by both directions, but counted once
+    for (const pair<const textpair, Dictionary*>& dict_entry : dictionaries)
+        if (!dict_entry.second->_transposed_cache
+         || dict_entry.second->_bisim_cache.use_count() == 1) {
+            *hits += dict_entry.second->bisim_cache().hits();
+            *misses += dict_entry.second->bisim_cache().misses();
+        }
+}
 
-    return dict_entry->second;
+size_t DictionaryFactory::bytes_used() const {
+    size_t bytes = 0;
+    for (const pair<const textpair, Dictionary*>& dict_entry : dictionaries)
+        bytes += dict_entry.second->memory_size();
+    for (const pair<const string, Text*>& text_entry : texts)
+        bytes += text_entry.second->memory_size();
+    return bytes;
 }
 
+void DictionaryFactory::shrink(size_t budget) {
+    std::lock_guard<std::mutex> lock(access);
+
+    // least recently used first
+    vector<pair<uint64_t, textpair>> by_use;
+    for (const pair<const textpair, uint64_t>& use : last_use)
+        by_use.push_back(make_pair(use.second, use.first));
+    std::sort(by_use.begin(), by_use.end());
+
+    for (vector<pair<uint64_t, textpair>>::iterator use = by_use.begin();
+         ; ++use) {
+        // texts of dropped dictionaries, or of ones that couldn't
+        // be read, may not be used anymore
+        std::unordered_set<const Text*> used;
+        for (const pair<const textpair, Dictionary*>& dict_entry
+                : dictionaries) {
+            used.insert(dict_entry.second->_e);
+            used.insert(dict_entry.second->_f);
+        }
+        for (map<string, Text*>::iterator text_entry = texts.begin();
+             text_entry != texts.end();)
+            if (used.count(text_entry->second)) {
+                ++text_entry;
+            } else {
+                delete text_entry->second;
+                text_entry = texts.erase(text_entry);
+            }
+
+        if (use == by_use.end() || bytes_used() <= budget)
+            break;
+        Dictionary* dict = dictionaries[use->second];
+        if (dict->_bisim_cache.use_count() == 1) {
+            dropped_hits += dict->bisim_cache().hits();
+            dropped_misses += dict->bisim_cache().misses();
+        }
+        if (dict->_reverse != nullptr)
+            const_cast<Dictionary*>(dict->_reverse.load())->_reverse
+                = nullptr;
+        delete dict;
+        dictionaries.erase(use->second);
+        last_use.erase(use->second);
+    }
+}
+
+
 Text* DictionaryFactory::get_text(const string& fname) {
-    map<string, Text*>::iterator text_entry = texts.find(fname);
+    std::unique_lock<std::mutex> lock(access);
+    return find_text(fname, &lock);
+}
 
-    if (text_entry == texts.end()) {
-        texts[fname] = new Text(fname);
-        return texts[fname];
+Text* DictionaryFactory::find_text(const string& fname,
+                                   std::unique_lock<std::mutex>* lock) {
+    map<string, Text*>::iterator text_entry = texts.find(fname);
+    if (text_entry != texts.end())
+        return text_entry->second;
+
+    // another thread reads it already
+    map<string, std::shared_future<Text*>>::iterator
+        loading = loading_texts.find(fname);
+    if (loading != loading_texts.end()) {
+        std::shared_future<Text*> pending = loading->second;
+        lock->unlock();
+        pending.wait();
+        lock->lock();
+        return pending.get();
     }
 
-    return text_entry->second;
+    std::promise<Text*> promise;
+    loading_texts[fname] = promise.get_future().share();
+    lock->unlock();
+    // no entry is left behind if the text can't be read
+    Text* text;
+    try {
+        text = new Text(fname, params.mapped_texts());
+    } catch(...) {
+        lock->lock();
+        loading_texts.erase(fname);
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+    lock->lock();
+    texts[fname] = text;
+    loading_texts.erase(fname);
+    promise.set_value(text);
+    return text;
 }
 
 
-string DictionaryFactory::locate_dictionary_file(const string& e_name,
-                                                 const string& f_name) {
+void DictionaryFactory::read_index() {
+    time_t mtime = modification_time(index_filename);
+    if (mtime == index_time && mtime != -1)
+        return;
+
     ifstream index_file;
     index_file.open(index_filename);
 
     if (!index_file.is_open())
         throw runtime_error("Index file not found!");
 
-    char c_line[255];
+    // index lines look like
+    // <dictionary file>: ### <e text> = <f text>
+    // where the texts may be given with a path, and = may be ->
+    // for dictionaries that don't mirror the opposite direction
+    dictionary_files.clear();
     string line;
-    while (!index_file.eof()) {
-        index_file.getline(c_line, 255);
-        line = c_line;
+    while (std::getline(index_file, line)) {
+        size_t colon = line.find(":");
+        if (colon == string::npos)
+            continue;
+        index_entry entry = { trim(line.substr(0, colon)), false };
+        size_t div = line.find(" = ", colon),
+               div_length = 3;
+        if (div == string::npos) {
+            div = line.find(" -> ", colon);
+            div_length = 4;
+            entry.directed = true;
+        }
+        if (div == string::npos)
+            continue;
 
-        size_t e_pos = line.find(e_name);
-        size_t f_pos = line.find(f_name);
+        string e_name = trim(line.substr(colon + 1, div - colon - 1));
+        if (e_name.compare(0, 3, "###") == 0)
+            e_name = trim(e_name.substr(3));
+        string f_name = trim(line.substr(div + div_length));
 
-        if (e_pos != string::npos && f_pos != string::npos && e_pos < f_pos)
-            break;
+        // the first entry for a pair wins, as it did with
+        // the linear search
+        dictionary_files.insert(
+            make_pair(make_pair(basename(e_name), basename(f_name)),
+                      entry));
     }
 
-    index_file.clear();
     index_file.close();
+    index_time = mtime;
+}
 
-    if (line == "")
+string DictionaryFactory::locate_dictionary_file(const string& e_name,
+                                                 const string& f_name) {
+    read_index();
+
+    auto entry = dictionary_files.find(make_pair(e_name, f_name));
+    if (entry == dictionary_files.end())
         throw runtime_error(static_cast<string>("Dictionary entry for ")
                           + e_name
                           + " -> "
                           + f_name
                           + " not found in index file!");
 
-    string filename = Params::get().dict_base()
-                    + line.substr(0, line.find(":"));
-    return filename;
+    return params.dict_base() + entry->second.filename;
+}
+
+bool DictionaryFactory::is_mirrored(const string& e_name,
+                                    const string& f_name) {
+    read_index();
+
+    // a missing entry doesn't say anything against it
+    for (const textpair& texts : { make_pair(e_name, f_name),
+                                   make_pair(f_name, e_name) }) {
+        auto entry = dictionary_files.find(texts);
+        if (entry != dictionary_files.end() && entry->second.directed)
+            return false;
+    }
+    return true;
 }
 
 /////////////////////////// Dictionary ////////////////////////////////////////
 
-Dictionary::Dictionary() {}
+namespace {
+/// Header of a compiled dictionary. The arrays follow it in the
+/// order e string offsets, f string offsets, entry offsets, targets,
+/// ranks, e strings, f strings - each of them padded to 8 bytes.
+/** The e and f words are the lower cased UTF-8 strings of the
+ *  dictionary file, since their type ids are only known once the
+ *  texts are loaded. The targets of e word i are the f word indices
+ *  from targets[offsets[i]] up to targets[offsets[i+1]], and the
+ *  ranks are the places of those entries in the file.
+ **/
+struct CompiledHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t e_words;
+    uint32_t f_words;
+    uint32_t entries;
+    uint64_t e_string_bytes;
+    uint64_t f_string_bytes;
+    /// of the dictionary file it was compiled from
+    FileStamp source;
+};
+
+const char compiled_magic[4] = { 'P', 'A', 'L', 'D' };
+/// needs to be bumped whenever the layout changes
+const uint32_t compiled_version = 3;
+const uint32_t compiled_byte_order = 0x01020304;
+
+/// check if the file starts with the magic of a compiled dictionary
+inline bool is_compiled(const string& fname) {
+    return has_magic(fname, compiled_magic, sizeof(compiled_magic));
+}
+
+/// check if a compiled dictionary of this version was made from a
+/// dictionary file with this stamp
+bool compiled_from(const string& compiled, const FileStamp& source) {
+    CompiledHeader header;
+    ifstream file(compiled, std::ios::binary);
+    return file.read(reinterpret_cast<char*>(&header), sizeof(header))
+        && std::memcmp(header.magic, compiled_magic,
+                       sizeof(header.magic)) == 0
+        && header.byte_order == compiled_byte_order
+        && header.version == compiled_version
+        && header.source == source;
+}
 
-Dictionary::Dictionary(const string& fname) {
+/// call add(source, target) with the lower cased words of each
+/// entry in the dictionary file
+template<typename Callback>
+void read_entries(ifstream* file, Callback add) {
+    string raw_line;
+    while (std::getline(*file, raw_line)) {
+        string_impl line = from_bytes(raw_line.data(), raw_line.size());
+
+        // comment line in dictionaries are supposed to start
+        // with ###
+        if (string_find(line, "###") == 0)
+            continue;
+
+        string_size div = string_find(line, " = ");
+        if (div == string_npos)
+            continue;
+
+        string_impl sword, tword;
+        extract(line, 0, div, &sword);
+        lower_case(&sword);
+        extract(line, div + 3, line.length(), &tword);
+        lower_case(&tword);
+
+        add(sword, tword);
+    }
+}
+
+/// Counting sort of (source, target) pairs by source, into offsets
+/// and targets, and of the ranks that go with the pairs. Keeps the
+/// order of the targets of each source.
+void group_by_source(const vector<pair<type_id, type_id>>& pairs,
+                     const vector<uint32_t>& ranks, type_id sources,
+                     vector<uint32_t>* offsets, vector<type_id>* targets,
+                     vector<uint32_t>* grouped_ranks) {
+    offsets->assign(sources + 1, 0);
+    for (const pair<type_id, type_id>& entry : pairs)
+        ++(*offsets)[entry.first + 1];
+    for (type_id source = 0; source < sources; ++source)
+        (*offsets)[source + 1] += (*offsets)[source];
+
+    targets->resize(pairs.size());
+    grouped_ranks->resize(pairs.size());
+    vector<uint32_t> fill(offsets->begin(), offsets->end() - 1);
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        uint32_t slot = fill[pairs[i].first]++;
+        (*targets)[slot] = pairs[i].second;
+        (*grouped_ranks)[slot] = ranks[i];
+    }
+}
+
+inline ByteRange word_at(const char* strings, const uint32_t* offsets,
+                         uint32_t index) {
+    ByteRange range = { strings + offsets[index],
+                        offsets[index + 1] - offsets[index] };
+    return range;
+}
+}  // namespace
+
+Dictionary::Dictionary()
+    : _reverse(nullptr), _bisim_cache(std::make_shared<bi_sim::Cache>(0)),
+      _transposed_cache(false) {}
+
+Dictionary::Dictionary(const string& fname)
+    : _reverse(nullptr), _bisim_cache(std::make_shared<bi_sim::Cache>(0)),
+      _transposed_cache(false) {
     open(fname);
 }
 
+string Dictionary::compiled_name(const string& fname) {
+    return fname + ".pald";
+}
+
 void Dictionary::open(const string& fname) {
+    string compiled = compiled_name(fname);
+    FileStamp dict_stamp;
+
+    if (is_compiled(fname)) {
+        load(fname);
+        return;
+    } else if (file_stamp(fname, &dict_stamp)
+            && compiled_from(compiled, dict_stamp)) {
+        load(compiled);
+        return;
+    }
+
     ifstream dict_file;
     dict_file.open(fname);
 
@@ -135,60 +479,280 @@ void Dictionary::open(const string& fname) {
 }
 
 void Dictionary::read(ifstream* file) {
-    string_impl line;
-    char c_line[255];
+    vector<pair<type_id, type_id>> pairs;
+    vector<uint32_t> ranks;
+    // pack both ids into one key to drop duplicate entries
+    std::unordered_set<uint64_t> seen;
+
+    read_entries(file,
+        [&](const string_impl& sword, const string_impl& tword) {
+            // i'm a bit unsure what needs to be done if a
+            // dictionary entry doesn't occur in the texts, but
+            // probably it's safe to assume we don't need a
+            // dictionary entry for it then.
+            type_id ft = _f->find_type(tword),
+                    et = _e->find_type(sword);
+            if (ft == Vocabulary::npos || et == Vocabulary::npos)
+                return;
+
+            if (seen.insert(static_cast<uint64_t>(et) << 32 | ft).second) {
+                ranks.push_back(pairs.size());
+                pairs.push_back(make_pair(et, ft));
+            }
+        });
+
+    index(pairs, ranks);
+}
 
-    while (!file->eof()) {
-        file->getline(c_line, 255);
-        line = c_line;
+void Dictionary::compile(const string& fname, const string& out) {
+    // taken before the file is read, so that the compiled file is out
+    // of date if it changes meanwhile
+    FileStamp source = FileStamp();
+    file_stamp(fname, &source);
+    ifstream dict_file(fname);
+    if (!dict_file.is_open())
+        throw runtime_error(
+                static_cast<string>("Dictionary file not found: ") + fname);
 
-        // comment line in dictionaries are supposed to start
-        // with ###
-        if (string_find(line, "###") == 0)
-            continue;
+    // the words get ids in order of their first occurrence, which
+    // keeps the entries of each e word in file order
+    Vocabulary e_words, f_words;
+    vector<pair<type_id, type_id>> pairs;
+    vector<uint32_t> ranks;
+    std::unordered_set<uint64_t> seen;
+
+    read_entries(&dict_file,
+        [&](const string_impl& sword, const string_impl& tword) {
+            const string &e_utf8 = to_utf8(sword),
+                         &f_utf8 = to_utf8(tword);
+            ByteRange e_str = { e_utf8.data(), e_utf8.size() },
+                      f_str = { f_utf8.data(), f_utf8.size() };
+            type_id ew = e_words.intern(e_str),
+                    fw = f_words.intern(f_str);
+
+            if (seen.insert(static_cast<uint64_t>(ew) << 32 | fw).second) {
+                ranks.push_back(pairs.size());
+                pairs.push_back(make_pair(ew, fw));
+            }
+        });
+
+    vector<uint32_t> offsets, grouped_ranks;
+    vector<type_id> targets;
+    group_by_source(pairs, ranks, e_words.size(), &offsets, &targets,
+                    &grouped_ranks);
+
+    std::ofstream file(out, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+        throw runtime_error(
+                static_cast<string>("Couldn't write compiled dictionary: ")
+                + out);
+
+    CompiledHeader header;
+    std::memcpy(header.magic, compiled_magic, sizeof(header.magic));
+    header.version = compiled_version;
+    header.byte_order = compiled_byte_order;
+    header.e_words = e_words.size();
+    header.f_words = f_words.size();
+    header.entries = targets.size();
+    header.e_string_bytes = e_words.offsets()[e_words.size()];
+    header.f_string_bytes = f_words.offsets()[f_words.size()];
+    header.source = source;
+
+    write_array(&file, &header, 1);
+    write_array(&file, e_words.offsets(), e_words.size() + 1);
+    write_array(&file, f_words.offsets(), f_words.size() + 1);
+    write_array(&file, offsets.data(), offsets.size());
+    write_array(&file, targets.data(), targets.size());
+    write_array(&file, grouped_ranks.data(), grouped_ranks.size());
+    write_array(&file, e_words.buffer(), header.e_string_bytes);
+    write_array(&file, f_words.buffer(), header.f_string_bytes);
+
+    if (!file)
+        throw runtime_error(
+                static_cast<string>("Couldn't write compiled dictionary: ")
+                + out);
+    file.close();
+}
 
-        string_size div = string_find(line, " = ");
-        if (div == string_npos)
+void Dictionary::load(const string& fname) {
+    MappedFile compiled(fname);
+    const char* section = compiled.data();
+
+    CompiledHeader header;
+    if (compiled.size() < sizeof(header))
+        throw runtime_error(
+                static_cast<string>("Not a compiled dictionary: ") + fname);
+    std::memcpy(&header, section, sizeof(header));
+    if (std::memcmp(header.magic, compiled_magic, sizeof(header.magic)) != 0
+     || header.byte_order != compiled_byte_order)
+        throw runtime_error(
+                static_cast<string>("Not a compiled dictionary: ") + fname);
+    if (header.version != compiled_version)
+        throw runtime_error(
+                static_cast<string>("Compiled dictionary has the wrong "
+                                    "version, please recompile: ") + fname);
+
+    size_t expected_size = padded(sizeof(header))
+                         + 2 * padded((header.e_words + 1) * sizeof(uint32_t))
+                         + padded((header.f_words + 1) * sizeof(uint32_t))
+                         + padded(header.entries * sizeof(type_id))
+                         + padded(header.entries * sizeof(uint32_t))
+                         + padded(header.e_string_bytes)
+                         + padded(header.f_string_bytes);
+    if (compiled.size() != expected_size)
+        throw runtime_error(
+                static_cast<string>("Compiled dictionary is corrupt: ")
+                + fname);
+
+    section += padded(sizeof(header));
+    const uint32_t
+        *e_offsets = read_array<uint32_t>(&section, header.e_words + 1),
+        *f_offsets = read_array<uint32_t>(&section, header.f_words + 1),
+        *offsets = read_array<uint32_t>(&section, header.e_words + 1);
+    const type_id* targets = read_array<type_id>(&section, header.entries);
+    const uint32_t* entry_ranks =
+        read_array<uint32_t>(&section, header.entries);
+    const char *e_strings = read_array<char>(&section, header.e_string_bytes),
+               *f_strings = read_array<char>(&section, header.f_string_bytes);
+
+    // everything that is looked up through the arrays needs to be in
+    // range, so that a damaged file can't make us read past them
+    bool valid = valid_offsets(e_offsets, header.e_words + 1,
+                               header.e_string_bytes)
+              && valid_offsets(f_offsets, header.f_words + 1,
+                               header.f_string_bytes)
+              && valid_offsets(offsets, header.e_words + 1, header.entries);
+    for (uint32_t entry = 0; valid && entry < header.entries; ++entry)
+        valid = targets[entry] < header.f_words
+             && entry_ranks[entry] < header.entries;
+    if (!valid)
+        throw runtime_error(
+                static_cast<string>("Compiled dictionary is corrupt: ")
+                + fname);
+
+    // translate the words of the dictionary to the types of the texts,
+    // each f word only once
+    vector<type_id> f_types(header.f_words);
+    for (uint32_t fw = 0; fw < header.f_words; ++fw)
+        f_types[fw] = _f->vocabulary().find(word_at(f_strings, f_offsets, fw));
+
+    vector<pair<type_id, type_id>> pairs;
+    vector<uint32_t> ranks;
+    pairs.reserve(header.entries);
+    ranks.reserve(header.entries);
+    for (uint32_t ew = 0; ew < header.e_words; ++ew) {
+        type_id et = _e->vocabulary().find(word_at(e_strings, e_offsets, ew));
+        if (et == Vocabulary::npos)
             continue;
+        for (uint32_t entry = offsets[ew]; entry < offsets[ew + 1]; ++entry) {
+            type_id ft = f_types[targets[entry]];
+            if (ft != Vocabulary::npos) {
+                pairs.push_back(make_pair(et, ft));
+                ranks.push_back(entry_ranks[entry]);
+            }
+        }
+    }
 
-        string_impl sword, tword;
-        extract(line, 0, div, &sword);
-        lower_case(&sword);
-        extract(line, div + 3, line.length(), &tword);
-        lower_case(&tword);
+    index(pairs, ranks);
+}
 
-        // i'm a bit unsure what needs to be done if a
-        // dictionary entry doesn't occur in the texts, but
-        // probably it's safe to assume we don't need a
-        // dictionary entry for it then.
-        if (_f->_types.find(tword) == _f->_types.end()
-         || _e->_types.find(sword) == _e->_types.end())
-            continue;
-        WordType* ft = _f->_types.at(tword);
-        WordType* et = _e->_types.at(sword);
+void Dictionary::index(const vector<pair<type_id, type_id>>& pairs,
+                       const vector<uint32_t>& ranks) {
+    type_id types = _e->types();
 
-        if (std::find((*this)[*et].begin(),
-                      (*this)[*et].end(),
-                      *ft) != (*this)[*et].end())
-            continue;
+    // counting sort by e type, which keeps the file order
+    // of the translations of each type
+    group_by_source(pairs, ranks, types, &_offsets, &_targets, &_ranks);
+    index_alpha();
+}
 
-        (*this)[*et].push_back(*ft);
+void Dictionary::transpose(const Dictionary& forward) {
+    if (forward._e != _f || forward._f != _e)
+        throw runtime_error("Can't transpose a dictionary for other texts");
+
+    // the forward entries in the order of the dictionary file, which
+    // is that of the reverse file, since they mirror each other
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
+    uint32_t end = 0;
+    for (uint32_t rank : forward._ranks)
+        end = std::max(end, rank + 1);
+    vector<uint32_t> by_rank(end, none);
+    vector<type_id> sources(forward._targets.size());
+    for (type_id ft = 0; ft < _f->types(); ++ft)
+        for (uint32_t entry = forward._offsets[ft];
+             entry < forward._offsets[ft + 1];
+             ++entry) {
+            by_rank[forward._ranks[entry]] = entry;
+            sources[entry] = ft;
+        }
+
+    // counting sort of them by their target, like index() does with
+    // the lines of the reverse file
+    type_id types = _e->types();
+    _offsets.assign(types + 1, 0);
+    for (type_id et : forward._targets)
+        ++_offsets[et + 1];
+    for (type_id et = 0; et < types; ++et)
+        _offsets[et + 1] += _offsets[et];
+
+    _targets.resize(forward._targets.size());
+    _ranks.resize(forward._targets.size());
+    vector<uint32_t> fill(_offsets.begin(), _offsets.end() - 1);
+    for (uint32_t rank = 0; rank < end; ++rank) {
+        uint32_t entry = by_rank[rank];
+        if (entry == none)
+            continue;
+        uint32_t slot = fill[forward._targets[entry]]++;
+        _targets[slot] = sources[entry];
+        _ranks[slot] = rank;
     }
+
+    index_alpha();
 }
 
-const list<WordType>& Dictionary::lookup(const WordToken& lemma) const {
+void Dictionary::index_alpha() {
+    type_id types = _e->types();
+    _alpha.resize(types);
+    for (type_id et = 0; et < types; ++et)
+        _alpha[et] = _offsets[et] != _offsets[et + 1]
+                  && has_alpha(_e->type(et).get_str());
+}
+
+size_t Dictionary::memory_size() const {
+    // the shared cache is counted once
+    size_t cache = !_transposed_cache || _bisim_cache.use_count() == 1
+                 ? _bisim_cache->memory_size()
+                 : 0;
+    return _offsets.size() * sizeof(uint32_t)
+         + _targets.size() * sizeof(type_id)
+         + _ranks.size() * sizeof(uint32_t)
+         + _alpha.size() / 8
+         + cache;
+}
+
+bi_sim::num_ty Dictionary::similarity(const WordToken& e_word,
+                                      const WordToken& f_word) const {
+    type_id et = e_word.get_type_id(),
+            ft = f_word.get_type_id();
+    // the words of a reversed sequence come the other way around
+    bool transposed = _transposed_cache != (&e_word.get_text() != _e);
+    return _bisim_cache->get(transposed ? ft : et, transposed ? et : ft,
+                             [&]() {
+                                 return bi_sim::bi_sim(e_word.get_str(),
+                                                       f_word.get_str());
+                             });
+}
+
+TranslationRange Dictionary::lookup(const WordToken& lemma) const {
     if (&lemma.get_text() != _e)
         throw runtime_error("Text of word to look up doesn't match e");
 
-    // empty list - does it need to be kept separately? will it cause
-    // an exception or memory corruption to look up a word that doesn't exit?
-    if (!this->has(lemma) || !has_alpha(lemma.get_str()))
-        return empty_entry;
+    type_id et = lemma.get_type_id();
+    if (!_alpha[et])
+        return TranslationRange(nullptr, nullptr);
 
-    // this needs to be at(), because operator[] doesn't return
-    // const. if the range checking proves to be too expensive,
-    // change to operator[] and const_cast
-    return this->at(lemma.get_type());
+    return TranslationRange(_targets.data() + _offsets[et],
+                            _targets.data() + _offsets[et + 1]);
 }
 
 
@@ -196,7 +760,7 @@ bool Dictionary::has(const WordToken& lemma) const {
     if (&lemma.get_text() != _e)
         throw runtime_error("Text of word to look up doesn't match e");
 
-    return this->count(lemma.get_type()) >= 1;
+    type_id et = lemma.get_type_id();
+    return _offsets[et] != _offsets[et + 1];
 }
 }  // namespace Align
-
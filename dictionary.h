@@ -1,11 +1,21 @@
 // Copyright 2012 Florian Petran
 #ifndef DICTIONARY_H_
 #define DICTIONARY_H_
+#include<cstdint>
+#include<ctime>
+#include<functional>
 #include<string>
+#include<fstream>
+#include<future>
 #include<map>
+#include<mutex>
+#include<unordered_map>
 #include<utility>
-#include<list>
+#include<vector>
 #include<algorithm>
+#include<atomic>
+#include<memory>
+#include"bi-sim.h"
 #include"text.h"
 #include"params.h"
 
@@ -13,16 +23,38 @@ namespace Align {
 
 class Dictionary;
 
+/// The type ids of the translations of a word
+typedef ArrayRange<type_id> TranslationRange;
+
 /// Construct Dictionary objects.
 /** Reads the dictionary index file and the Dictionary objects
  *  from their files.
  *  Holds the index to Dictionary objects already created, and
  *  will create a new one if it is requested. Constructs the
  *  Text objects as well. Owns all Text pointers.
+ *
+ *  Lines of the index file look like
+ *      <dictionary file>: ### <e text> = <f text>
+ *  Dictionaries are assumed to mirror the one for the opposite
+ *  direction, like the ones from mkdict do, so if that one is
+ *  already loaded, the new one is made by transposing it. If the
+ *  two directions differ, the entries need to be marked with ->
+ *  instead of =, then each direction is read from its own file.
+ *
+ *  Both getters are safe to call from several threads, the
+ *  objects are created only once. Different objects are read
+ *  concurrently. Usually, the factory is owned by an AlignContext.
+ *
+ *  A long running process can keep the memory use in check with
+ *  shrink(), which drops the dictionaries that were least recently
+ *  requested, and the texts that only those used.
  **/
 class DictionaryFactory {
     public:
-        static DictionaryFactory& get_instance();
+        /// params must outlive the factory
+        explicit DictionaryFactory(const Params& params);
+        DictionaryFactory(const DictionaryFactory&) = delete;
+        const DictionaryFactory& operator=(const DictionaryFactory&) = delete;
         /// read a dictionary from the file if its first requested,
         /// otherwise just return the pointer to the dictionary entry
         const Dictionary* get_dictionary(const std::string&,
@@ -31,16 +63,67 @@ class DictionaryFactory {
         /// or just return the text pointer otherwise
         Text* get_text(const std::string&);
         ~DictionaryFactory();
+
+        /// approximate number of bytes taken by texts and dictionaries
+        size_t memory_use();
+        /// sum up the counters of the bi_sim caches of all dictionaries,
+        /// including the ones that shrink() dropped
+        void bisim_cache_stats(uint64_t* hits, uint64_t* misses);
+        /// drop the texts that no dictionary uses, and then the least
+        /// recently requested dictionaries and their texts, until the
+        /// memory use is at most budget. Nothing from the factory may
+        /// be in use while this runs, since it deletes the objects.
+        void shrink(size_t budget);
     private:
+        typedef std::pair<std::string, std::string> textpair;
+        struct textpair_hash {
+            inline size_t operator()(const textpair& texts) const {
+                std::hash<std::string> hash;
+                return hash(texts.first) * 31 + hash(texts.second);
+            }
+        };
+
+        /// get_text(), with the factory locked by lock. The lock is
+        /// released while the text is read, or while waiting for
+        /// another thread that reads it.
+        Text* find_text(const std::string&,
+                        std::unique_lock<std::mutex>* lock);
+        /// memory_use(), with the factory already locked
+        size_t bytes_used() const;
         std::string locate_dictionary_file(const std::string&,
                                            const std::string&);
+        /// (re-)read the index file, if it changed since the last read
+        void read_index();
+        /// check if the dictionaries for e, f and f, e mirror each other
+        bool is_mirrored(const std::string&, const std::string&);
+        struct index_entry {
+            std::string filename;
+            /// not necessarily the mirror of the opposite direction
+            bool directed;
+        };
+        const Params& params;
         std::string index_filename;
-        typedef std::pair<std::string, std::string> textpair;
+        /// modification time of the index file at the last read
+        time_t index_time;
+        /// dictionary files by the basenames of their texts
+        std::unordered_map<textpair, index_entry, textpair_hash>
+            dictionary_files;
         /// an index mapping the text pair to their Dictionary objects
         std::map<textpair, Dictionary*> dictionaries;
+        /// when each dictionary was requested last, by use_clock
+        std::map<textpair, uint64_t> last_use;
+        uint64_t use_clock;
+        /// bi_sim cache counters of the dictionaries that were dropped
+        uint64_t dropped_hits, dropped_misses;
         /// an index mapping the filenames to the Text objects
         std::map<std::string, Text*> texts;
-        DictionaryFactory();
+        /// the texts and dictionaries that are being read, which other
+        /// threads that request them wait for
+        std::map<std::string, std::shared_future<Text*>> loading_texts;
+        std::map<textpair, std::shared_future<Dictionary*>>
+            loading_dictionaries;
+        /// held while looking up objects, but not while reading them
+        std::mutex access;
 };
 
 
@@ -57,25 +140,51 @@ class DictionaryFactory {
  *  from it for each f and e texts. Also note that the Text objects
  *  need to be pointers since they are mutually dependent on Dictionary.
  *
- *  The actual translation dictionary is stored as a map of vectors. Keys
- *  of that map are the e Words, and the vector value stores all f Words.
+ *  The actual translation dictionary is stored in compressed sparse
+ *  row form: the translations of e type t are the f type ids in
+ *  _targets[_offsets[t]] up to _targets[_offsets[t+1]], in the
+ *  order they appear in the dictionary file.
  **/
-class Dictionary : private std::map<WordType, std::list<WordType> > {
+class Dictionary {
     friend class DictionaryFactory;
     public:
         const Dictionary& operator=(const Dictionary&) = delete;
         Dictionary(const Dictionary&) = delete;
 
-        /// look up a WordToken, and get a list to its translations
-        /// translations may be multiple types which might in turn
-        /// have multiple locations in the target file
-        const std::list<WordType>& lookup(const WordToken&) const;
+        /// look up a WordToken, and get a list of the type ids of its
+        /// translations in f. Translations may be multiple types which
+        /// might in turn have multiple locations in the target file
+        TranslationRange lookup(const WordToken&) const;
         /// check if the dictionary has an entry for word
         bool has(const WordToken&) const;
         /// return the source text for this dictionary
         inline const Text* get_e() const { return _e; }
         /// return the target text for this dictionary
         inline const Text* get_f() const { return _f; }
+        /// the dictionary for the opposite direction, if the
+        /// factory has created it yet
+        inline const Dictionary* reverse() const { return _reverse; }
+        /// approximate number of bytes taken by the tables, without
+        /// the texts
+        size_t memory_size() const;
+        /// bi_sim of an e word and an f word, or the other way
+        /// around, through a cache that is shared with the
+        /// dictionary for the opposite direction
+        bi_sim::num_ty similarity(const WordToken& e_word,
+                                  const WordToken& f_word) const;
+        inline const bi_sim::Cache& bisim_cache() const {
+            return *_bisim_cache;
+        }
+
+        /// write a compiled version of the dictionary file to out.
+        /** The compiled file doesn't depend on the texts, and is
+         *  used instead of the dictionary file by open() as long as
+         *  that has the size and modification time it was compiled
+         *  from.
+         **/
+        static void compile(const std::string& fname, const std::string& out);
+        /// name of the compiled file for a dictionary file
+        static std::string compiled_name(const std::string& fname);
 
     protected:
         explicit Dictionary(const std::string&);
@@ -88,11 +197,38 @@ class Dictionary : private std::map<WordType, std::list<WordType> > {
 
         void open(const std::string&);
         void read(std::ifstream*);
+        /// read a compiled dictionary
+        void load(const std::string&);
+        /// make this the reverse of a dictionary for f, e
+        void transpose(const Dictionary&);
+        /// build the tables from (e type, f type) pairs without
+        /// duplicates, in dictionary file order, and the places of
+        /// the pairs in the file
+        void index(const std::vector<std::pair<type_id, type_id>>&,
+                   const std::vector<uint32_t>& ranks);
+        /// determine which entries are looked up
+        void index_alpha();
 
     private:
         Text *_e, *_f;
-        /// an empty dictionary entry
-        const std::list<WordType> empty_entry;
+        /// set by the factory when the opposite direction is
+        /// created, which may happen while others read it
+        std::atomic<const Dictionary*> _reverse;
+        /// start of the translations of each e type in _targets,
+        /// plus the end of the last
+        std::vector<uint32_t> _offsets;
+        /// f type ids of the translations
+        std::vector<type_id> _targets;
+        /// the place of each translation among the entries of the
+        /// dictionary file, so that transpose() keeps their order
+        std::vector<uint32_t> _ranks;
+        /// whether the e type has any alphabetic characters - only
+        /// those are looked up
+        std::vector<bool> _alpha;
+        /// bi_sim values by (e type, f type), or by (f type, e type)
+        /// if it was made for the opposite direction
+        std::shared_ptr<bi_sim::Cache> _bisim_cache;
+        bool _transposed_cache;
 };
 }  // namespace Align
 #endif  // DICTIONARY_H_
@@ -1,15 +1,19 @@
 // Copyright 2012 Florian Petran
+#include<cstdint>
 #include<string>
 #include<utility>
 #include<stdexcept>
 #include<iostream>
 
 #include"align.h"
+#include"batch.h"
+#include"server.h"
 
 int main(int argc, char* argv[]) {
+    Align::Params params;
     std::pair<std::string, std::string> files;
     try {
-        files = Align::Params::get().parse(argc, argv);
+        files = params.parse(argc, argv);
     } catch(std::runtime_error e) {
         std::cerr << e.what() << std::endl;
         return 1;
@@ -19,32 +23,42 @@ int main(int argc, char* argv[]) {
         const std::string &e_name = files.first,
                           &f_name = files.second;
 
-        Align::DictionaryFactory* df =
-            &Align::DictionaryFactory::get_instance();
-        const Align::Dictionary* dict = df->get_dictionary(e_name, f_name);
-        Align::Candidates c(*dict);
-        c.collect();
-
-        Align::AlignMake align_make(&c);
-        align_make.initial_sequences()
-                  .expand_sequences();
-
-        const Align::Dictionary* rdict = df->get_dictionary(f_name, e_name);
-        Align::Candidates rc(*rdict);
-        Align::AlignMake reverse_make(&rc);
-        reverse_make.initial_sequences()
-                    .expand_sequences();
-        Align::Hypothesis *result  = align_make.get_result(),
-                          *rresult = reverse_make.get_result();
-        rresult->reverse();
-        result->munch(rresult);
-
-        align_make.merge_sequences()
-                  .collect_scores()
-                  .get_topranking();
-
-        for (Align::Sequence* seq : *result)
-            std::cout << *seq << std::endl;
+        Align::AlignContext context(params);
+        Align::ThreadPool pool(params.jobs());
+        if (!params.serve().empty()) {
+            Align::AlignServer server(params, &pool);
+            server.serve(params.serve());
+            return 0;
+        }
+        int quitcode = 0;
+        if (!params.batch().empty()) {
+            size_t failed =
+                Align::align_batch(&context,
+                                   Align::read_manifest(params.batch()),
+                                   &pool, &std::cerr);
+            quitcode = failed == 0 ? 0 : 1;
+        } else {
+            Align::BidirectionalAlign bi_align(&context, e_name, f_name);
+            Align::AlignMake& align_make = bi_align.align(&pool).forward();
+            align_make.merge_sequences()
+                      .collect_scores()
+                      .get_topranking();
+
+            Align::Hypothesis* result = align_make.get_result();
+            for (Align::Sequence* seq : *result)
+                std::cout << *seq << std::endl;
+        }
+
+        if (params.cache_stats()) {
+            uint64_t hits, misses;
+            context.dictionaries().bisim_cache_stats(&hits, &misses);
+            std::cerr << "bi_sim cache: " << hits << " hits, " << misses
+                      << " misses, "
+                      << (hits + misses == 0
+                          ? 0.0 : 100.0 * hits / (hits + misses))
+                      << "% hit rate" << std::endl;
+        }
+        return quitcode;
     }
     catch(std::runtime_error e) {
         std::cerr << e.what() << std::endl;
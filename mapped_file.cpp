@@ -0,0 +1,77 @@
+// Copyright 2013 Florian Petran
+#include"mapped_file.h"
+
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+#include<cstring>
+#include<fstream>
+#include<string>
+#include<stdexcept>
+
+using std::string;
+using std::ifstream;
+using std::runtime_error;
+
+namespace Align {
+
+MappedFile::MappedFile(const string& fname)
+    : _data(nullptr), _size(0) {
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw runtime_error(string("File not found: ") + fname);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        ::close(fd);
+        throw runtime_error(string("Couldn't stat file: ") + fname);
+    }
+    _size = st.st_size;
+
+    // mmap refuses zero length mappings, so leave
+    // empty files unmapped
+    if (_size > 0) {
+        void* addr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw runtime_error(string("Couldn't map file: ") + fname);
+        }
+        madvise(addr, _size, MADV_SEQUENTIAL);
+        _data = static_cast<const char*>(addr);
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (_data != nullptr)
+        munmap(const_cast<char*>(_data), _size);
+}
+
+bool has_magic(const string& fname, const char* magic, size_t size) {
+    string head(size, '\0');
+    ifstream file(fname, std::ios::binary);
+    return file.read(&head[0], size)
+        && std::memcmp(head.data(), magic, size) == 0;
+}
+
+time_t modification_time(const string& fname) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) == -1)
+        return -1;
+    return st.st_mtime;
+}
+
+bool file_stamp(const string& fname, FileStamp* stamp) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) == -1)
+        return false;
+    stamp->size = st.st_size;
+    stamp->seconds = st.st_mtim.tv_sec;
+    stamp->nanoseconds = st.st_mtim.tv_nsec;
+    return true;
+}
+}  // namespace Align
@@ -0,0 +1,199 @@
+// Copyright 2013 Florian Petran
+// read-only memory mapped files, and views into them
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+#include<cstddef>
+#include<cstdint>
+#include<cstring>
+#include<ctime>
+#include<ostream>
+#include<string>
+#include<vector>
+
+namespace Align {
+
+/// A non-owning view of a byte range, e.g. a line in a MappedFile.
+/** Can be used as key in hashed containers via ByteRangeHash,
+ *  as long as the memory it points to outlives the container.
+ **/
+struct ByteRange {
+    const char* data;
+    size_t size;
+
+    inline bool operator==(const ByteRange& other) const {
+        return size == other.size
+            && std::memcmp(data, other.data, size) == 0;
+    }
+    inline bool operator!=(const ByteRange& other) const {
+        return !(*this == other);
+    }
+};
+
+/// FNV-1a over the bytes of a ByteRange
+struct ByteRangeHash {
+    inline size_t operator()(const ByteRange& range) const {
+        size_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < range.size; ++i) {
+            hash ^= static_cast<unsigned char>(range.data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+/// A non-owning view of a contiguous array, e.g. a part of a FlatArray.
+template<typename T>
+class ArrayRange {
+    public:
+        ArrayRange(const T* begin, const T* end)
+            : _begin(begin), _end(end) {}
+        inline const T* begin() const {
+            return _begin;
+        }
+        inline const T* end() const {
+            return _end;
+        }
+        inline size_t size() const {
+            return _end - _begin;
+        }
+        inline bool empty() const {
+            return _begin == _end;
+        }
+        inline const T& operator[](size_t index) const {
+            return _begin[index];
+        }
+    private:
+        const T *_begin, *_end;
+};
+
+/// A file mapped read-only into memory.
+/** The mapping lives as long as the object. Empty files are
+ *  not mapped at all, and have a null data() pointer. Throws
+ *  runtime_error if the file can't be opened or mapped.
+ **/
+class MappedFile {
+    public:
+        explicit MappedFile(const std::string& fname);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        const MappedFile& operator=(const MappedFile&) = delete;
+
+        inline const char* data() const {
+            return _data;
+        }
+        inline size_t size() const {
+            return _size;
+        }
+
+    private:
+        const char* _data;
+        size_t _size;
+};
+
+/// last modification time of a file, or -1 if it doesn't exist
+time_t modification_time(const std::string& fname);
+
+/// The size and modification time of a file. A compiled file keeps
+/// the one of its source, and is only used while the source still
+/// has it, which also catches changes within the same second.
+struct FileStamp {
+    uint64_t size;
+    int64_t seconds;
+    int64_t nanoseconds;
+};
+
+inline bool operator==(const FileStamp& a, const FileStamp& b) {
+    return a.size == b.size && a.seconds == b.seconds
+        && a.nanoseconds == b.nanoseconds;
+}
+
+/// get the stamp of a file, false if it doesn't exist
+bool file_stamp(const std::string& fname, FileStamp* stamp);
+
+/// check if the file starts with the given magic bytes
+bool has_magic(const std::string& fname, const char* magic, size_t size);
+
+/// Sections of compiled files are padded to 8 bytes, so that
+/// the arrays in them are aligned when the file is mapped.
+inline size_t padded(size_t bytes) {
+    return (bytes + 7) & ~static_cast<size_t>(7);
+}
+
+/// write an array as a padded section of a compiled file
+template<typename T>
+void write_array(std::ostream* file, const T* data, size_t size) {
+    static const char padding[8] = { 0 };
+    size_t bytes = size * sizeof(T);
+    file->write(reinterpret_cast<const char*>(data), bytes);
+    file->write(padding, padded(bytes) - bytes);
+}
+
+/// get an array from a padded section of a mapped compiled file,
+/// and advance the section pointer past it
+template<typename T>
+const T* read_array(const char** section, size_t size) {
+    const T* data = reinterpret_cast<const T*>(*section);
+    *section += padded(size * sizeof(T));
+    return data;
+}
+
+/// check that the offsets from a compiled file start at 0, never
+/// decrease and end at end, so that every range between two of them
+/// lies within the array they index
+template<typename T>
+bool valid_offsets(const T* offsets, size_t size, uint64_t end) {
+    if (size == 0 || offsets[0] != 0)
+        return false;
+    for (size_t i = 1; i < size; ++i)
+        if (offsets[i] < offsets[i - 1])
+            return false;
+    return static_cast<uint64_t>(offsets[size - 1]) == end;
+}
+
+/// An array that either owns its elements, or refers to
+/// elements owned by someone else, usually a MappedFile.
+template<typename T>
+class FlatArray {
+    public:
+        FlatArray() : _data(nullptr), _size(0) {}
+        FlatArray(const FlatArray&) = delete;
+        const FlatArray& operator=(const FlatArray&) = delete;
+
+        /// take over the elements of the vector, leaving it empty
+        inline void assign(std::vector<T>* elements) {
+            _owned.clear();
+            _owned.swap(*elements);
+            _data = _owned.data();
+            _size = _owned.size();
+        }
+        /// refer to elements that must outlive this
+        inline void attach(const T* data, size_t size) {
+            _owned.clear();
+            _data = data;
+            _size = size;
+        }
+
+        inline const T& operator[](size_t index) const {
+            return _data[index];
+        }
+        inline const T* data() const {
+            return _data;
+        }
+        inline size_t size() const {
+            return _size;
+        }
+        inline const T* begin() const {
+            return _data;
+        }
+        inline const T* end() const {
+            return _data + _size;
+        }
+
+    private:
+        const T* _data;
+        size_t _size;
+        std::vector<T> _owned;
+};
+}  // namespace Align
+
+#endif  // MAPPED_FILE_H_
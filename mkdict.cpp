@@ -1,166 +1,678 @@
 // Copyright 2012-2013 Florian Petran
 #include"mkdict.h"
 
+#include<sys/stat.h>
+
+#include<cerrno>
+#include<chrono>
+#include<cmath>
+#include<cstdio>
+#include<cstring>
+#include<future>
+#include<iomanip>
+#include<iterator>
+#include<sstream>
 #include<string>
 #include<stdexcept>
+#include<tuple>
 #include<algorithm>
+#include"align_config.h"
 
 using std::string;
 using std::ifstream;
 using std::ofstream;
 using std::mutex;
+using std::vector;
 
 namespace {
-inline bool is_cognate(const string_impl& w1, const string_impl& w2,
-                       const string_size wordlength_threshold,
-                       const bi_sim::num_ty cognate_threshold) {
-    return (w1 == w2)
-        || (std::min(w1.length(), w2.length()) > wordlength_threshold
-            && bi_sim::bi_sim(w1, w2) >= cognate_threshold);
+using DictionaryInducer::bigram;
+using DictionaryInducer::Bucket;
+using DictionaryInducer::File;
+typedef vector<std::pair<bigram, uint32_t>> bigram_counts;
+
+/// the distinct bigrams of a normalized word of n + 1 units, with
+/// their counts
+void count_bigrams(const bi_sim::unit_ty* units, size_t n,
+                   bigram_counts* counts) {
+    thread_local vector<bigram> bigrams;
+    bigrams.clear();
+    for (size_t i = 1; i <= n; ++i)
+        bigrams.push_back(static_cast<bigram>(units[i-1]) << 32 | units[i]);
+    std::sort(bigrams.begin(), bigrams.end());
+    counts->clear();
+    for (bigram pair : bigrams)
+        if (!counts->empty() && counts->back().first == pair)
+            ++counts->back().second;
+        else
+            counts->push_back(std::make_pair(pair, 1));
+}
+
+/// The smallest score of the dynamic program of bi_sim for words
+/// of m and n units that reaches the threshold, computed the way
+/// bi_sim does. More than 2 min(m, n) if it can't be reached.
+/** A step of the dynamic program adds 2 for a shared bigram, and 1
+ *  for a shared unit, and there are at most min(m, n) of them. So a
+ *  score s needs the words to have s - min(m, n) bigrams in common.
+ **/
+int min_score(size_t m, size_t n, bi_sim::num_ty threshold) {
+    const int most = 2 * std::max(m, n);
+    const bi_sim::num_ty divisor = most;
+    int score = threshold > 0
+              ? std::min(most + 1,
+                         static_cast<int>(std::ceil(threshold * divisor)))
+              : 0;
+    // the rounding of the division decides
+    while (score > 0 && (score - 1) / divisor >= threshold)
+        --score;
+    while (score <= most && score / divisor < threshold)
+        ++score;
+    return score;
+}
+
+/// The indices in f of the cognates of the i-th word in e, that are
+/// both longer than the wordlength threshold.
+/** Buckets of words that are too short or long to reach the
+ *  threshold are skipped. From the others, the bigram index yields
+ *  the words that share enough bigrams, which are compared one by
+ *  one. If a word can reach the threshold without sharing bigrams,
+ *  or if exhaustive is given, the whole bucket is compared at once.
+ **/
+void find_cognates(const File& e, size_t i, const File& f,
+                   const string_size wordlength_threshold,
+                   const bi_sim::num_ty cognate_threshold,
+                   bool exhaustive, bi_sim::Cache* cache,
+                   vector<size_t>* cognates) {
+    thread_local bigram_counts x_bigrams;
+    thread_local vector<bi_sim::num_ty> scores;
+    thread_local vector<uint32_t> shared, touched;
+    const bi_sim::unit_ty* x = e.units(i);
+    const size_t m = e.lengths[i];
+    count_bigrams(x, m, &x_bigrams);
+
+    for (const std::pair<const size_t, Bucket>& entry : f.buckets) {
+        const size_t n = entry.first;
+        if (static_cast<string_size>(n) <= wordlength_threshold)
+            continue;
+        const Bucket& bucket = entry.second;
+        const int shortest = std::min(m, n),
+                  needed = min_score(m, n, cognate_threshold) - shortest;
+        if (!exhaustive && needed > shortest)
+            continue;
+
+        if (exhaustive || needed <= 0) {
+            scores.resize(bucket.words.size());
+            bi_sim::bi_sim(x, m, bucket.batch, scores.data());
+            for (size_t k = 0; k < bucket.words.size(); ++k)
+                if (scores[k] >= cognate_threshold)
+                    cognates->push_back(bucket.words[k]);
+            continue;
+        }
+
+        // count the bigrams shared with each word of the bucket
+        shared.resize(bucket.words.size());
+        touched.clear();
+        for (const std::pair<bigram, uint32_t>& x_bigram : x_bigrams) {
+            auto postings = bucket.postings.find(x_bigram.first);
+            if (postings == bucket.postings.end())
+                continue;
+            for (const std::pair<uint32_t, uint32_t>& posting
+                    : postings->second) {
+                if (shared[posting.first] == 0)
+                    touched.push_back(posting.first);
+                shared[posting.first] += std::min(x_bigram.second,
+                                                  posting.second);
+            }
+        }
+
+        for (uint32_t k : touched) {
+            if (shared[k] >= static_cast<uint32_t>(needed)) {
+                size_t word = bucket.words[k];
+                const bi_sim::unit_ty* y = f.units(word);
+                auto similarity = [&]() {
+                    return bi_sim::bi_sim(x, m, y, n);
+                };
+                if ((cache != nullptr
+                     ? cache->get(e.ids[i], f.ids[word], similarity)
+                     : similarity()) >= cognate_threshold)
+                    cognates->push_back(word);
+            }
+            shared[k] = 0;
+        }
+    }
+}
+
+/// the white space of the C locale
+inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/// FNV-1a, a byte at a time
+void hash_add(uint64_t* hash, uint64_t value, size_t bytes = 8) {
+    for (size_t byte = 0; byte < bytes; ++byte) {
+        *hash ^= value & 0xff;
+        *hash *= 1099511628211ULL;
+        value >>= 8;
+    }
+}
+
+const uint64_t hash_start = 14695981039346656037ULL;
+/// changed whenever the same files give other dictionaries than
+/// before, so that those of older versions aren't reused
+const uint64_t result_version = 2;
+
+/// copy a file by way of a temporary file, so that to is either
+/// complete or missing
+void copy_file(const string& from, const string& to) {
+    const string temporary = to + ".tmp";
+    {
+        ifstream in(from, std::ios_base::binary);
+        ofstream out(temporary, std::ios_base::binary);
+        if (in)
+            std::copy(std::istreambuf_iterator<char>(in),
+                      std::istreambuf_iterator<char>(),
+                      std::ostreambuf_iterator<char>(out));
+        if (!in || !out.flush())
+            throw std::runtime_error("Couldn't copy " + from + " to "
+                                     + temporary);
+    }
+    if (std::rename(temporary.c_str(), to.c_str()) != 0)
+        throw std::runtime_error("Couldn't rename " + temporary + ": "
+                                 + std::strerror(errno));
 }
 }
 
 namespace DictionaryInducer {
 
-//////////////////////// Producer /////////////////////////////////////////////
+//////////////////////// WordIds //////////////////////////////////////////////
 
-void Producer::notify() {
-    this->notified = true;
-    this->cv.notify_one();
+size_t WordHash::operator()(const string_impl& word) const {
+    uint64_t hash = hash_start;
+    for (string_size i = 0; i < word.length(); ++i)
+        hash_add(&hash, word[i], sizeof(word[i]));
+    return hash;
 }
 
-bool Producer::is_notified() {
-    return this->notified;
+void WordIds::number(const std::vector<string_impl>& words,
+                     std::vector<uint32_t>* word_ids) {
+    // so that each shard is locked only once
+    vector<vector<size_t>> by_shard(shard_count);
+    for (size_t i = 0; i < words.size(); ++i)
+        by_shard[WordHash()(words[i]) % shard_count].push_back(i);
+
+    word_ids->resize(words.size());
+    for (size_t s = 0; s < shard_count; ++s) {
+        Shard& shard = shards[s];
+        std::lock_guard<mutex> lock(shard.m);
+        for (size_t i : by_shard[s])
+            (*word_ids)[i] = shard.ids.insert(
+                std::make_pair(words[i],
+                               shard.ids.size() * shard_count + s))
+                .first->second;
+    }
 }
 
-//////////////////////// File /////////////////////////////////////////////////
+//////////////////////// Bucket ///////////////////////////////////////////////
 
-void File::notify() {
-    this->notified = true;
-    this->cv.notify_all();
+void Bucket::add(size_t word, const bi_sim::unit_ty* units, size_t n) {
+    thread_local bigram_counts counts;
+    count_bigrams(units, n, &counts);
+    for (const std::pair<bigram, uint32_t>& count : counts)
+        postings[count.first].push_back(
+            std::make_pair(static_cast<uint32_t>(words.size()), count.second));
+    batch.add(units);
+    words.push_back(word);
 }
 
-void File::open(const string& fname) {
-    string line;
+//////////////////////// File /////////////////////////////////////////////////
+
+void File::open(const string& fname, WordIds* word_ids) {
     ifstream file;
-    file.open(fname);
+    file.open(fname, std::ios_base::binary);
     if (!file.is_open())
         throw std::runtime_error(fname + " : File not found!");
-    while (file >> line)
-        this->words.push_back(line.c_str());
-    std::sort(words.begin(), words.end());
-    auto it = std::unique(words.begin(), words.end());
-    this->words.resize(std::distance(words.begin(), it));
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    const string text = contents.str();
     file.close();
+
+    // split where operator>> would, into the offsets and lengths of
+    // the tokens
+    vector<std::pair<size_t, size_t>> tokens;
+    for (size_t i = 0; i < text.size();) {
+        while (i < text.size() && is_space(text[i]))
+            ++i;
+        const size_t begin = i;
+        while (i < text.size() && !is_space(text[i]))
+            ++i;
+        if (i > begin)
+            tokens.push_back(std::make_pair(begin, i - begin));
+    }
+    auto compare = [&text](const std::pair<size_t, size_t>& a,
+                           const std::pair<size_t, size_t>& b) {
+        const int order = std::memcmp(text.data() + a.first,
+                                      text.data() + b.first,
+                                      std::min(a.second, b.second));
+        return order != 0 ? order : (a.second > b.second)
+                                  - (a.second < b.second);
+    };
+    std::sort(tokens.begin(), tokens.end(),
+              [&](const std::pair<size_t, size_t>& a,
+                  const std::pair<size_t, size_t>& b) {
+                  return compare(a, b) < 0;
+              });
+    tokens.erase(std::unique(tokens.begin(), tokens.end(),
+                             [&](const std::pair<size_t, size_t>& a,
+                                 const std::pair<size_t, size_t>& b) {
+                                 return compare(a, b) == 0;
+                             }),
+                 tokens.end());
+    for (const std::pair<size_t, size_t>& token : tokens)
+        words.push_back(from_bytes(text.data() + token.first, token.second));
+
+    // strings may be ordered differently than their bytes, and tokens
+    // that aren't valid in the encoding may become the same word
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    if (word_ids != nullptr)
+        word_ids->number(words, &ids);
+
+    // the string implementation changes which words are cognates
+    hash = hash_start;
+    hash_add(&hash, sizeof(char_impl));
+    for (const string_impl& word : words) {
+        hash_add(&hash, word.length());
+        for (string_size i = 0; i < word.length(); ++i)
+            hash_add(&hash, word[i], sizeof(word[i]));
+    }
+
+    offsets.resize(words.size());
+    lengths.resize(words.size());
+    for (size_t i = 0; i < words.size(); ++i) {
+        offsets[i] = arena.size();
+        bi_sim::append_normalized(words[i], &arena);
+        lengths[i] = arena.size() - offsets[i] - 1;
+    }
+    // only once the arena doesn't move anymore
+    for (size_t i = 0; i < words.size(); ++i)
+        buckets.insert(std::make_pair(lengths[i], Bucket(lengths[i])))
+               .first->second.add(i, units(i), lengths[i]);
 }
 
 //////////////////////// Result ///////////////////////////////////////////////
 
-Result::Result(const string& e, const string& f)
-    : Producer(), done(false) {
+Result::Result(const string& e, const string& f, size_t number)
+    : number(number), temporary("mkdict-" + std::to_string(number) + ".tmp"),
+      reverse_temporary("mkdict-" + std::to_string(number) + "-reverse.tmp"),
+      spilled(false), reused(false), swapped(false), parts(1), received(0), next_part(0),
+      ready(0), buffered_bytes(0), spillable_bytes(0) {
     this->header = this->dict_head(e.c_str(), f.c_str());
-    this->add_line(this->header);
+    this->reverse_header = this->dict_head(f.c_str(), e.c_str());
+}
+
+void Result::expect_parts(size_t count) {
+    parts = count;
 }
 
-void Result::add_line(const string_impl& line) {
-    lines.push(line);
+void Result::add_part(Block* block) {
+    Part& part = pending[block->part];
+    part.lines.swap(block->lines);
+    part.reverse_lines.swap(block->reverse_lines);
+    part.bytes = 0;
+    for (const vector<string_impl>* lines :
+            { &part.lines, &part.reverse_lines })
+        for (const string_impl& line : *lines)
+            part.bytes += sizeof(line) + line.length() * sizeof(line[0]);
+    buffered_bytes += part.bytes;
+    ++received;
+
+    std::map<size_t, Part>::const_iterator next;
+    while ((next = pending.find(ready)) != pending.end()) {
+        spillable_bytes += next->second.bytes;
+        ++ready;
+    }
 }
 
-string_impl Result::get_line() {
-    string_impl line = lines.front();
-    lines.pop();
-    notified = false;
-    return line;
+void Result::spill() {
+    std::ios_base::openmode mode = spilled ? std::ios_base::app
+                                           : std::ios_base::trunc;
+    ofstream file(temporary, mode), reverse_file(reverse_temporary, mode);
+    if (!file || !reverse_file)
+        throw std::runtime_error("Couldn't write " + temporary);
+    if (!spilled) {
+        file << header << '\n';
+        reverse_file << reverse_header << '\n';
+        spilled = true;
+    }
+    for (; next_part < ready; ++next_part) {
+        std::map<size_t, Part>::iterator part = pending.find(next_part);
+        for (const string_impl& line : part->second.lines)
+            file << line << '\n';
+        for (const string_impl& line : part->second.reverse_lines)
+            reverse_file << line << '\n';
+        pending.erase(part);
+    }
+    buffered_bytes -= spillable_bytes;
+    spillable_bytes = 0;
+    if (!file.flush() || !reverse_file.flush())
+        throw std::runtime_error("Couldn't write " + temporary);
 }
 
-bool Result::empty() { return lines.empty(); }
+void Result::write(const string& name, const string& reverse_name) {
+    if (reused) {
+        // the lines of a dictionary are grouped by its e words, and
+        // those of the reverse one by the same words
+        copy_reused(cached, header, name, swapped ? by_source : as_cached);
+        copy_reused(reverse_cached, reverse_header, reverse_name,
+                    swapped ? by_target : as_cached);
+        return;
+    }
+
+    spill();
+    if (std::rename(temporary.c_str(), name.c_str()) != 0
+     || std::rename(reverse_temporary.c_str(), reverse_name.c_str()) != 0)
+        throw std::runtime_error("Couldn't rename " + temporary + ": "
+                                 + std::strerror(errno));
+    if (!cached.empty()) {
+        copy_file(name, cached);
+        copy_file(reverse_name, reverse_cached);
+    }
+}
+
+bool Result::reuse(const string& cached, const string& reverse_cached,
+                   bool swapped) {
+    if (!ifstream(cached) || !ifstream(reverse_cached))
+        return false;
+    this->cached = cached;
+    this->reverse_cached = reverse_cached;
+    this->swapped = swapped;
+    reused = true;
+    parts = 1;
+    return true;
+}
+
+void Result::keep(const string& cached, const string& reverse_cached) {
+    this->cached = cached;
+    this->reverse_cached = reverse_cached;
+}
+
+void Result::copy_reused(const string& from, const string_impl& header,
+                         const string& to, LineOrder order) {
+    ifstream in(from, std::ios_base::binary);
+    ofstream out(to, std::ios_base::binary);
+    // it has the names of the files of that run
+    string old_header;
+    std::getline(in, old_header);
+    out << header << '\n';
+    if (order == as_cached) {
+        std::copy(std::istreambuf_iterator<char>(in),
+                  std::istreambuf_iterator<char>(),
+                  std::ostreambuf_iterator<char>(out));
+    } else {
+        // the words of each line in the order to sort by, which is
+        // that of the words of a File, and the line
+        vector<std::tuple<string_impl, string_impl, string>> lines;
+        string line;
+        while (std::getline(in, line)) {
+            const size_t div = line.find(" = ");
+            if (div == string::npos)
+                throw std::runtime_error(from + " is not a dictionary");
+            string_impl e = from_bytes(line.data(), div),
+                        f = from_bytes(line.data() + div + 3,
+                                       line.size() - div - 3);
+            if (order == by_target)
+                std::swap(e, f);
+            lines.push_back(std::make_tuple(e, f, line));
+        }
+        std::sort(lines.begin(), lines.end());
+        for (const std::tuple<string_impl, string_impl, string>& sorted
+                : lines)
+            out << std::get<2>(sorted) << '\n';
+    }
+    if (!out.flush())
+        throw std::runtime_error("Couldn't write " + to);
+}
 
 string_impl Result::dict_head(const char* e, const char* f) {
     string_impl head = "### ";
     return head + e + " = " + f;
 }
 
-//////////////////////// ResultSet ////////////////////////////////////////////
+//////////////////////// Channel //////////////////////////////////////////////
+
+struct Channel::Ring {
+    explicit Ring(size_t size) : slots(size), head(0), tail(0) {}
+    std::vector<Block> slots;
+    /// the next block to receive, only written by the outputter
+    std::atomic<size_t> head;
+    /// keeps head and tail in cache lines of their own
+    char padding[64];
+    /// the next slot to send to, only written by the worker
+    std::atomic<size_t> tail;
+};
+
+namespace {
+std::atomic<uint64_t> channel_count(0);
+}
+
+Channel::Channel(size_t senders, size_t ring_size)
+    : _claimed(0), _id(++channel_count), _next_ring(0), _waiting(false),
+      _closed(false) {
+    size_t size = 1;
+    while (size < ring_size)
+        size *= 2;
+    for (size_t sender = 0; sender < senders; ++sender)
+        _rings.emplace_back(new Ring(size));
+}
+
+Channel::~Channel() {}
+
+Channel::Ring* Channel::ring() {
+    thread_local uint64_t owner = 0;
+    thread_local Ring* own = nullptr;
+    if (owner != _id) {
+        size_t index = _claimed++;
+        if (index >= _rings.size())
+            throw std::runtime_error("More threads than channel rings");
+        own = _rings[index].get();
+        owner = _id;
+    }
+    return own;
+}
+
+void Channel::send(Block* block) {
+    Ring* own = ring();
+    const size_t mask = own->slots.size() - 1,
+                 tail = own->tail.load(std::memory_order_relaxed);
+    // back off while the outputter is behind
+    for (int tries = 0;
+         tail - own->head.load(std::memory_order_acquire) > mask; ++tries)
+        if (_closed)
+            return;
+        else if (tries < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+    Block& slot = own->slots[tail & mask];
+    slot.result = block->result;
+    slot.part = block->part;
+    slot.lines.swap(block->lines);
+    slot.reverse_lines.swap(block->reverse_lines);
+    block->lines.clear();
+    block->reverse_lines.clear();
+    // sequentially consistent with the check in wait(), so that either
+    // the outputter sees the block, or this sees it waiting
+    own->tail.store(tail + 1);
+    if (_waiting.load()) {
+        std::lock_guard<mutex> lock(_mutex);
+        _sent.notify_one();
+    }
+}
+
+bool Channel::receive(Block* block) {
+    for (size_t checked = 0; checked < _rings.size(); ++checked) {
+        Ring& next = *_rings[_next_ring];
+        _next_ring = (_next_ring + 1) % _rings.size();
+        const size_t head = next.head.load(std::memory_order_relaxed);
+        if (head == next.tail.load(std::memory_order_acquire))
+            continue;
+        Block& slot = next.slots[head & (next.slots.size() - 1)];
+        block->result = slot.result;
+        block->part = slot.part;
+        block->lines.swap(slot.lines);
+        block->reverse_lines.swap(slot.reverse_lines);
+        next.head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
 
-void ResultSet::add_result(Result* r) {
-    this->m.lock();
-    results.push(r);
-    this->m.unlock();
+bool Channel::pending() const {
+    for (const std::unique_ptr<Ring>& next : _rings)
+        if (next->head.load(std::memory_order_relaxed) != next->tail.load())
+            return true;
+    return false;
 }
 
-Result* ResultSet::get_result() {
-    Result* r = results.front();
-    results.pop();
-    return r;
+void Channel::close() {
+    _closed = true;
 }
 
-bool ResultSet::empty() { return results.empty(); }
+void Channel::wait() {
+    std::unique_lock<mutex> lock(_mutex);
+    _waiting.store(true);
+    // the timeout is only a safety net
+    if (!pending())
+        _sent.wait_for(lock, std::chrono::milliseconds(10));
+    _waiting.store(false, std::memory_order_relaxed);
+}
 
 //////////////////////// worker functions /////////////////////////////////////
 
 mutex dict_cout_mutex;
 
 void file_reader(const string& fname,
-                 const FileSet& files) {
+                 const FileSet& files, WordIds* word_ids) {
     dict_cout_mutex.lock();
     std::cout << "Reading file " << fname << "..." << std::endl;
     dict_cout_mutex.unlock();
 
-    File* f = files.at(fname);
-    std::lock_guard<mutex> lock(f->m);
-    f->open(fname);
-    f->notify();
+    files.at(fname)->open(fname, word_ids);
 
     dict_cout_mutex.lock();
     std::cout << "...done reading " << fname << "." << std::endl;
     dict_cout_mutex.unlock();
 }
 
-void fileset_processor(const string& e_name, const string& f_name,
-                       const FileSet& files, ResultSet* resultset,
-                       const int wordlength_threshold,
-                       const bi_sim::num_ty cognate_threshold) {
+ResultCache::ResultCache(const string& directory,
+                         const int wordlength_threshold,
+                         const bi_sim::num_ty cognate_threshold)
+    : directory(directory), thresholds(hash_start) {
+    if (::mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+        throw std::runtime_error("Couldn't create " + directory + ": "
+                                 + std::strerror(errno));
+    uint64_t bits;
+    static_assert(sizeof(bits) == sizeof(cognate_threshold),
+                  "thresholds are hashed as 64 bits");
+    std::memcpy(&bits, &cognate_threshold, sizeof(bits));
+    hash_add(&thresholds, result_version);
+    hash_add(&thresholds, wordlength_threshold);
+    hash_add(&thresholds, bits);
+}
+
+bool ResultCache::reuse(const string& e_name, const string& f_name,
+                        const FileSet& files, Result* result) const {
+    const File &e = *files.at(e_name),
+               &f = *files.at(f_name);
+    const string forward = path(e, f), backward = path(f, e);
+    // a pair that was cached the other way round has the directions
+    // swapped
+    if (result->reuse(forward, forward + ".reverse", false)
+     || result->reuse(backward + ".reverse", backward, true)) {
+        dict_cout_mutex.lock();
+        std::cout << "Reusing pair "
+                  << e_name << " - " << f_name << "." << std::endl;
+        dict_cout_mutex.unlock();
+        return true;
+    }
+    result->keep(forward, forward + ".reverse");
+    return false;
+}
+
+string ResultCache::path(const File& e, const File& f) const {
+    std::ostringstream name;
+    name << directory << '/' << std::hex << std::setfill('0')
+         << std::setw(16) << e.hash << '-'
+         << std::setw(16) << f.hash << '-'
+         << std::setw(16) << thresholds;
+    return name.str();
+}
+
+void pair_processor(const string& e_name, const string& f_name,
+                    const FileSet& files, Result* r,
+                    const Settings& settings, bi_sim::Cache* cache,
+                    Channel* channel, Align::ThreadPool* pool) {
     dict_cout_mutex.lock();
     std::cout << "Processing pair "
               << e_name << " - " << f_name << "..." << std::endl;
     dict_cout_mutex.unlock();
 
-    File *e = files.at(e_name),
-         *f = files.at(f_name);
-    std::unique_lock<mutex> lock_e(e->m),
-                            lock_f(f->m);
-
-    Result* r = new Result(e_name, f_name);
-    Result* r_reverse = new Result(f_name, e_name);
-
-    resultset->add_result(r);
-    resultset->add_result(r_reverse);
-    resultset->notify();
-
-    while (!e->is_notified())
-        e->cv.wait(lock_e);
-    while (!f->is_notified())
-        f->cv.wait(lock_f);
-
-    for (const string_impl& e_word : e->words)
-        for (const string_impl& f_word : f->words)
-            if (is_cognate(e_word, f_word,
-                           wordlength_threshold,
-                           cognate_threshold)) {
-                r->add_line(e_word + " = " + f_word);
-                r->notify();
-                r_reverse->add_line(f_word + " = " + e_word);
-                r_reverse->notify();
-            }
-    r->done = true;
-    r->notify();
-    r_reverse->done = true;
-    r_reverse->notify();
+    const size_t part_words = std::max<size_t>(settings.part_words, 1),
+                 words = files.at(e_name)->words.size(),
+                 parts = std::max<size_t>(1, (words + part_words - 1)
+                                             / part_words);
+    const int wordlength_threshold = settings.wordlength_threshold;
+    const bi_sim::num_ty cognate_threshold = settings.cognate_threshold;
+    const bool exhaustive = settings.exhaustive;
+    r->expect_parts(parts);
+    for (size_t part = 0; part < parts; ++part)
+        pool->submit([=, &files]() {
+            fileset_processor(e_name, f_name, files, part * part_words,
+                              std::min(words, (part + 1) * part_words),
+                              part, r, wordlength_threshold,
+                              cognate_threshold, cache, exhaustive,
+                              channel);
+        });
+}
 
-    dict_cout_mutex.lock();
-    std::cout << "...done processing "
-              << e_name << " - " << f_name << "!" << std::endl;
-    dict_cout_mutex.unlock();
+void fileset_processor(const string& e_name, const string& f_name,
+                       const FileSet& files, size_t begin, size_t end,
+                       size_t part, Result* r,
+                       const int wordlength_threshold,
+                       const bi_sim::num_ty cognate_threshold,
+                       bi_sim::Cache* cache, bool exhaustive,
+                       Channel* channel) {
+    const File *e = files.at(e_name),
+               *f = files.at(f_name);
+
+    const string_size threshold = wordlength_threshold;
+    vector<size_t> cognates;
+    Block block;
+    block.result = r;
+    block.part = part;
+    for (size_t i = begin; i < end; ++i) {
+        const string_impl& e_word = e->words[i];
+        cognates.clear();
+        if (e_word.length() > threshold)
+            find_cognates(*e, i, *f, threshold, cognate_threshold,
+                          exhaustive, cache, &cognates);
+        // the same word is a cognate regardless of its length
+        vector<string_impl>::const_iterator same =
+            std::lower_bound(f->words.begin(), f->words.end(), e_word);
+        if (same != f->words.end() && *same == e_word)
+            cognates.push_back(same - f->words.begin());
+        // in the order of f, like comparing with each word in turn
+        std::sort(cognates.begin(), cognates.end());
+        cognates.erase(std::unique(cognates.begin(), cognates.end()),
+                       cognates.end());
+
+        for (size_t j : cognates) {
+            const string_impl& f_word = f->words[j];
+            block.lines.push_back(e_word + " = " + f_word);
+            block.reverse_lines.push_back(f_word + " = " + e_word);
+        }
+    }
+    channel->send(&block);
 }
 
 /* TODO(fpetran):
@@ -170,69 +682,280 @@ void fileset_processor(const string& e_name, const string& f_name,
  * and it would be easier to set via parameters if the dictionary
  * should be written to files or to stdout.
  */
-void result_outputter(ResultSet* resultset) {
+void result_outputter(ResultSet* resultset, Channel* channel,
+                      size_t buffer_size, std::ostream* numbers) {
     dict_cout_mutex.lock();
     std::cout << "Writing to files...\n";
     dict_cout_mutex.unlock();
 
     int result_id = 100001;
-    std::unique_lock<mutex> set_lock(resultset->m);
     ofstream index_file;
     index_file.open("INDEX");
 
-    while (!resultset->is_notified())
-        resultset->cv.wait(set_lock);
-
-    while (!resultset->empty()) {
-        Result *r1 = resultset->get_result(),
-               *r2 = resultset->get_result();
-
-        ofstream file;
-        file.open(std::to_string(result_id));
-        while (!r1->done) {
-            std::unique_lock<mutex> lock(r1->m);
-            while (!r1->is_notified())
-                r1->cv.wait(lock);
-
-            file << r1->get_line() << std::endl;
-        }
-        // output anything that remains for the results
-        // TODO(fpetran) find out if there is a less clumsy
-        // solution for this
-        while (!r1->empty())
-            file << r1->get_line() << std::endl;
-
+    // numbered once it's finished, both directions at once
+    auto write = [&](Result* r) {
+        r->write(std::to_string(result_id), std::to_string(result_id + 1));
         index_file << std::to_string(result_id)
-                   << ": " << r1->get_header()
-                   << std::endl;
-        file.close();
+                   << ": " << r->get_header() << std::endl
+                   << std::to_string(result_id + 1)
+                   << ": " << r->get_reverse_header() << std::endl;
         dict_cout_mutex.lock();
         std::cout << "...done writing "
-                  << std::to_string(result_id) << "." << std::endl;
+                  << std::to_string(result_id) << "." << std::endl
+                  << "...done writing "
+                  << std::to_string(result_id + 1) << "." << std::endl;
         dict_cout_mutex.unlock();
-        result_id++;
-        delete r1;
-
-        // processor always produces two results in one go,
-        // so we don't need to care about it any more while
-        // we're outputting the second one.
-        file.open(std::to_string(result_id));
-        while (!r2->empty()) {
-            file << to_cstr(r2->get_line()) << std::endl;
+        if (numbers)
+            *numbers << r->get_number() << ' ' << result_id << '\n';
+        result_id += 2;
+        resultset->erase(r);
+        delete r;
+    };
+
+    // bytes kept by all results
+    size_t buffered = 0;
+    Block block;
+    while (!resultset->empty()) {
+        if (!channel->receive(&block)) {
+            // the run failed, and nothing is sent anymore
+            if (channel->closed())
+                return;
+            channel->wait();
+            continue;
+        }
+        Result* r = block.result;
+        buffered -= r->buffered();
+        r->add_part(&block);
+        if (r->complete()) {
+            write(r);
+            continue;
+        }
+
+        buffered += r->buffered();
+        // parts that came before the ones they follow can't be
+        // spilled, so they may still go over the buffer
+        while (buffered > buffer_size) {
+            Result* largest = *std::max_element(
+                resultset->begin(), resultset->end(),
+                [](const Result* a, const Result* b) {
+                    return a->spillable() < b->spillable();
+                });
+            if (largest->spillable() == 0)
+                break;
+            buffered -= largest->buffered();
+            largest->spill();
+            buffered += largest->buffered();
         }
-        index_file << std::to_string(result_id)
-                   << ": " << to_cstr(r2->get_header())
-                   << std::endl;
-        file.close();
-        dict_cout_mutex.lock();
-        std::cout << "...done writing "
-                  << std::to_string(result_id) << "." << std::endl;
-        dict_cout_mutex.unlock();
-        result_id++;
-        delete r2;
     }
     index_file.close();
     std::cout << "...done writing!\n";
 }
+
+Settings::Settings()
+    : wordlength_threshold(DICTIONARY_WORDLENGTH_THRESHOLD),
+      cognate_threshold(DICTIONARY_COGNATE_THRESHOLD),
+      cache_size(DICTIONARY_BISIM_CACHE), exhaustive(false),
+      jobs(ALIGN_DEFAULT_JOBS),
+      buffer_size(static_cast<size_t>(DICTIONARY_BUFFER_SIZE) << 20),
+      sharded(false), shard_index(0), shard_count(1),
+      part_words(DictionaryInducer::part_words),
+      ring_blocks(DictionaryInducer::ring_blocks) {}
+
+void make_dictionaries(const Settings& settings) {
+    FileSet files;
+    ResultSet results;
+    // the words are only numbered for the cache
+    WordIds word_ids;
+    bi_sim::Cache cache(settings.cache_size);
+    WordIds* numbering = settings.cache_size > 0 ? &word_ids : nullptr;
+    bi_sim::Cache* shared_cache = settings.cache_size > 0 ? &cache : nullptr;
+
+    const size_t jobs = settings.jobs > 0
+                      ? settings.jobs : std::thread::hardware_concurrency();
+    // a ring for every worker, and one for the reused results, which
+    // this thread sends
+    Channel channel(std::max<size_t>(jobs, 1) + 1,
+                    std::max<size_t>(settings.ring_blocks, 1));
+
+    // the pairs are numbered in the order of the files, and only those
+    // of the shard are made. The results are numbered once they are
+    // finished.
+    const vector<string>& names = settings.input_files;
+    // by the indices of e and f
+    std::map<std::pair<size_t, size_t>, Result*> pair_results;
+    size_t pair_count = 0;
+    for (size_t e = 0; e < names.size(); ++e)
+        for (size_t f = e + 1; f < names.size(); ++f, ++pair_count) {
+            if (settings.sharded
+             && pair_count % settings.shard_count != settings.shard_index)
+                continue;
+            Result* result = new Result(names[e], names[f], pair_count);
+            pair_results[std::make_pair(e, f)] = result;
+            results.insert(result);
+        }
+
+    std::unique_ptr<ResultCache> result_cache;
+    if (!settings.cache_dir.empty())
+        result_cache.reset(new ResultCache(settings.cache_dir,
+                                           settings.wordlength_threshold,
+                                           settings.cognate_threshold));
+
+    // only there once the shard is done
+    ofstream shard;
+    if (settings.sharded) {
+        shard.open("SHARD.tmp");
+        shard << settings.shard_index << '/' << settings.shard_count
+              << ' ' << pair_count << '\n';
+    }
+    // started before any file is read, so that the workers never wait
+    // on a full ring for it while a read waits for them
+    std::future<void> output = std::async(std::launch::async, [&]() {
+        try {
+            result_outputter(&results, &channel, settings.buffer_size,
+                             settings.sharded ? &shard : nullptr);
+        } catch(...) {
+            // nobody writes the results, so the workers mustn't wait
+            channel.close();
+            throw;
+        }
+    });
+
+    // destroyed first, so its tasks finish before the rest goes
+    Align::ThreadPool pool(jobs);
+    try {
+        // all files are queued before the pairs, which are only queued
+        // once both of their files are read. The readers look up their
+        // files, so those are all there before the first one starts.
+        for (const std::pair<const std::pair<size_t, size_t>, Result*>&
+                 result : pair_results)
+            for (size_t index : { result.first.first,
+                                  result.first.second })
+                if (files.count(names[index]) == 0)
+                    files[names[index]] = new File();
+        std::map<string, std::shared_future<void>> reads;
+        for (const string& fname : names)
+            if (files.count(fname) != 0 && reads.count(fname) == 0)
+                reads[fname] = pool.submit([&files, numbering, fname]() {
+                    file_reader(fname, files, numbering);
+                }).share();
+
+        // in the order the files come in, so that the pairs of the
+        // first files don't wait for the last one
+        for (size_t f = 0; f < names.size(); ++f) {
+            if (reads.count(names[f]) == 0)
+                continue;
+            // rethrows if the file couldn't be read
+            reads[names[f]].get();
+            for (size_t e = 0; e < f; ++e) {
+                if (pair_results.count(std::make_pair(e, f)) == 0)
+                    continue;
+                Result* result = pair_results[std::make_pair(e, f)];
+                if (result_cache
+                 && result_cache->reuse(names[e], names[f], files, result)) {
+                    // its only part is empty, and tells the outputter
+                    // that it's complete
+                    Block block;
+                    block.result = result;
+                    block.part = 0;
+                    channel.send(&block);
+                    continue;
+                }
+                pair_processor(names[e], names[f], files, result, settings,
+                               shared_cache, &channel, &pool);
+            }
+        }
+        // rethrows if a result couldn't be written
+        output.get();
+    } catch(...) {
+        // nobody writes the results, so the workers mustn't wait
+        channel.close();
+        throw;
+    }
+    if (settings.sharded
+     && (!shard.flush() || std::rename("SHARD.tmp", "SHARD") != 0))
+        throw std::runtime_error("Couldn't write SHARD");
+    if (shared_cache != nullptr)
+        std::cout << "bi-sim cache: " << cache.hits() << " hits, "
+                  << cache.misses() << " misses" << std::endl;
+
+    for (std::pair<const string, File*>& f : files)
+        delete f.second;
+}
+
+void merge_shards(const vector<string>& directories) {
+    struct stat here, there;
+    if (::stat(".", &here) != 0)
+        throw std::runtime_error(string("Couldn't stat the current "
+                                        "directory: ") + std::strerror(errno));
+
+    size_t shards = 0, pairs = 0;
+    vector<bool> merged;
+    // the directory and the id of the file of each pair
+    vector<std::pair<const string*, int>> found;
+    for (const string& directory : directories) {
+        if (::stat(directory.c_str(), &there) == 0
+         && there.st_dev == here.st_dev && there.st_ino == here.st_ino)
+            throw std::runtime_error("Can't merge into the shard "
+                                     + directory);
+        ifstream shard(directory + "/SHARD");
+        size_t index, count, total;
+        char slash;
+        if (!(shard >> index >> slash >> count >> total)
+         || slash != '/' || index >= count)
+            throw std::runtime_error(directory
+                                     + " has no finished shard of mkdict");
+        if (shards == 0) {
+            shards = count;
+            pairs = total;
+            merged.assign(shards, false);
+            found.assign(pairs, std::make_pair(nullptr, 0));
+        } else if (count != shards || total != pairs) {
+            throw std::runtime_error(directory + " is a shard of another run");
+        }
+        if (merged[index])
+            throw std::runtime_error("Shard " + std::to_string(index) + "/"
+                                     + std::to_string(shards)
+                                     + " is given twice");
+        merged[index] = true;
+
+        size_t number;
+        int id;
+        while (shard >> number >> id) {
+            if (number >= pairs || found[number].first)
+                throw std::runtime_error(directory
+                                         + "/SHARD has wrong pairs");
+            found[number] = std::make_pair(&directory, id);
+        }
+    }
+    for (size_t index = 0; index < shards; ++index)
+        if (!merged[index])
+            throw std::runtime_error("Shard " + std::to_string(index) + "/"
+                                     + std::to_string(shards)
+                                     + " is missing");
+    for (size_t number = 0; number < pairs; ++number)
+        if (!found[number].first)
+            throw std::runtime_error("Pair " + std::to_string(number)
+                                     + " is missing from the shards");
+
+    ofstream index_file;
+    index_file.open("INDEX");
+    int result_id = 100001;
+    for (const std::pair<const string*, int>& pair : found) {
+        // both directions
+        for (int direction = 0; direction < 2; ++direction) {
+            const string name = std::to_string(result_id + direction);
+            copy_file(*pair.first + "/"
+                      + std::to_string(pair.second + direction), name);
+            ifstream file(name);
+            string header;
+            std::getline(file, header);
+            index_file << name << ": " << header << std::endl;
+        }
+        result_id += 2;
+    }
+    index_file.close();
+    std::cout << "Merged " << pairs << " pairs from " << shards
+              << " shards." << std::endl;
+}
 }  // namespace DictionaryInducer
 
@@ -4,6 +4,9 @@
 // This is independent from the actual alignment code.
 #ifndef MKDICT_H_
 #define MKDICT_H_
+#include<atomic>
+#include<cstdint>
+#include<memory>
 #include<thread>
 #include<mutex>
 #include<condition_variable>
@@ -11,68 +14,347 @@
 #include<fstream>
 #include<string>
 #include<vector>
-#include<queue>
+#include<set>
 #include<map>
+#include<unordered_map>
+#include<utility>
 #include<algorithm>
 #include"bi-sim.h"
 #include"string_impl.h"
+#include"thread_pool.h"
 
 namespace DictionaryInducer {
-class Producer {
+/// hash of the code units of a word
+struct WordHash {
+    size_t operator()(const string_impl& word) const;
+};
+
+/// Numbers the words of all files, so that the bi_sim values of
+/// pairs of them can be cached across file pairs.
+/** The words are spread over shards by their hash, each with a lock
+ *  of its own, so that files that are read at the same time rarely
+ *  wait for each other.
+ **/
+class WordIds {
     public:
-        Producer() : notified(false) {}
-        std::condition_variable cv;
-        std::mutex m;
-        void notify();
-        bool is_notified();
-    protected:
-        bool notified;
+        /// the ids of the words, new words get the next free ones
+        void number(const std::vector<string_impl>& words,
+                    std::vector<uint32_t>* ids);
+    private:
+        static const size_t shard_count = 16;
+        /// the ids of shard s are s, s + shard_count, and so on
+        struct Shard {
+            std::mutex m;
+            std::unordered_map<string_impl, uint32_t, WordHash> ids;
+        };
+        Shard shards[shard_count];
+};
+
+/// two units of a normalized word
+typedef uint64_t bigram;
+
+/// The words of a File that have the same length.
+/** Besides the batch for comparing a word to all of them, it has an
+ *  index of their bigrams, to only compare a word to those that
+ *  share enough bigrams with it to be cognates.
+ **/
+struct Bucket {
+    explicit Bucket(size_t length) : batch(length) {}
+    /// add the normalized word of n + 1 units with the index in
+    /// File::words
+    void add(size_t word, const bi_sim::unit_ty* units, size_t n);
+    /// the normalized words
+    bi_sim::Batch batch;
+    /// their indices in File::words
+    std::vector<size_t> words;
+    /// for each bigram, the words that have it by their position in
+    /// words, and how often they have it
+    std::unordered_map<bigram, std::vector<std::pair<uint32_t, uint32_t>>>
+        postings;
 };
 
-class File : public Producer {
+/// The distinct words of a file.
+/** The file is read at once and split into tokens, which are sorted
+ *  by their bytes. Only the distinct tokens become words. Their
+ *  normalized forms are kept one after another in a single array, so
+ *  that every word is lower cased and decoded once.
+ **/
+class File {
     public:
-        void notify();
-        void open(const std::string& fname);
+        /// read the words of a file, throws runtime_error if it
+        /// can't be opened. The words are only numbered if word_ids
+        /// is given.
+        void open(const std::string& fname, WordIds* word_ids);
+
+        /// the normalized word of words[i], which has lengths[i] + 1
+        /// units
+        inline const bi_sim::unit_ty* units(size_t i) const {
+            return arena.data() + offsets[i];
+        }
+
         std::vector<string_impl> words;
+        /// the WordIds of the words, if they were numbered
+        std::vector<uint32_t> ids;
+        /// the normalized words, one after another
+        std::vector<bi_sim::unit_ty> arena;
+        /// where the normalized words start in arena
+        std::vector<size_t> offsets;
+        std::vector<uint32_t> lengths;
+        /// the words by their length, to compare a word of another
+        /// file to all words of a length at once
+        std::map<size_t, Bucket> buckets;
+        /// a hash of the words, which tells if they changed since a
+        /// pair with this file was cached
+        uint64_t hash;
+};
+
+class Result;
+
+/// the lines of a part of a result, and their reversed lines
+struct Block {
+    Result* result;
+    size_t part;
+    std::vector<string_impl> lines, reverse_lines;
 };
 
-class Result : public Producer {
+/// The dictionaries of a pair of files, in both directions.
+/** The parts of a result come in any order, and are kept until the
+ *  ones before them are in. A result is only written and numbered
+ *  once all of its parts are in, so the results are numbered in the
+ *  order they are finished. If the outputter runs out of buffer
+ *  before that, the parts that are in order can be spilled to
+ *  temporary files, which get their final names in the end. Only
+ *  used by the outputter, once the parts were set.
+ **/
+class Result {
     public:
-        explicit Result(const std::string& e,
-                        const std::string& f);
-        bool done;
-        void add_line(const string_impl& line);
-        string_impl get_line();
-        bool empty();
-        inline const string_impl& get_header() {
+        /// number is the place of the pair among all pairs, which
+        /// also tells the temporary files of the results apart
+        Result(const std::string& e, const std::string& f, size_t number);
+        /// the result is made of this many parts
+        void expect_parts(size_t count);
+        /// keep the lines of a part, which empties the block
+        void add_part(Block* block);
+        /// whether all parts are in
+        inline bool complete() const {
+            return received == parts;
+        }
+        /// bytes taken by the lines that are kept
+        inline size_t buffered() const {
+            return buffered_bytes;
+        }
+        /// bytes of the kept lines that spill() would write
+        inline size_t spillable() const {
+            return spillable_bytes;
+        }
+        /// append the parts that are next in order to the temporary
+        /// files, and drop them
+        void spill();
+        /// write the rest once the result is complete, and move it
+        /// to the files with these names
+        void write(const std::string& name, const std::string& reverse_name);
+        /// take the result from the files of an earlier run, which
+        /// leaves a single empty part to send. False if there aren't
+        /// any. swapped tells that they were made for the pair the
+        /// other way round.
+        bool reuse(const std::string& cached,
+                   const std::string& reverse_cached, bool swapped);
+        /// copy the result to these files once it's written
+        void keep(const std::string& cached,
+                  const std::string& reverse_cached);
+        inline size_t get_number() const {
+            return number;
+        }
+        inline const string_impl& get_header() const {
             return header;
         }
+        inline const string_impl& get_reverse_header() const {
+            return reverse_header;
+        }
     private:
-        string_impl header;
+        struct Part {
+            std::vector<string_impl> lines, reverse_lines;
+            size_t bytes;
+        };
+        string_impl header, reverse_header;
         string_impl dict_head(const char* e,
                               const char* f);
-        std::queue<string_impl> lines;
+        /// how the lines of a dictionary of an earlier run are put in
+        /// the order this run would give them: by the e word and then
+        /// the f word, or the other way round
+        enum LineOrder { as_cached, by_source, by_target };
+        /// copy a dictionary of an earlier run with another header
+        static void copy_reused(const std::string& from,
+                                const string_impl& header,
+                                const std::string& to, LineOrder order);
+        size_t number;
+        std::string temporary, reverse_temporary;
+        std::string cached, reverse_cached;
+        bool spilled, reused, swapped;
+        /// next_part is the first one that isn't written, and ready
+        /// the first one after it that isn't in
+        size_t parts, received, next_part, ready;
+        size_t buffered_bytes, spillable_bytes;
+        /// parts that aren't written yet
+        std::map<size_t, Part> pending;
 };
 
-class ResultSet : public Producer {
+/// the results that aren't written yet
+typedef std::set<Result*> ResultSet;
+
+/// Carries the Blocks of the results from the workers to the outputter.
+/** Every thread that sends has a ring buffer of its own, which only
+ *  it writes to and only the outputter reads from, so neither of them locks
+ *  anything to pass a block. A worker whose ring is full waits for
+ *  the outputter to catch up. The outputter sleeps once all rings
+ *  are empty, and is only woken up by a worker in that case.
+ **/
+class Channel {
     public:
-        void add_result(Result* result);
-        Result* get_result();
-        bool empty();
+        /// rings for up to senders threads, of ring_size blocks each
+        Channel(size_t senders, size_t ring_size);
+        ~Channel();
+        Channel(const Channel&) = delete;
+        const Channel& operator=(const Channel&) = delete;
+
+        /// pass a block on from a worker, which empties it
+        void send(Block* block);
+        /// take the next block of any ring, false if there is none
+        bool receive(Block* block);
+        /// wait until a block might have been sent
+        void wait();
+        /// drop the blocks that are sent from now on
+        void close();
+        inline bool closed() const {
+            return _closed;
+        }
+
     private:
-        std::queue<Result*> results;
+        struct Ring;
+        /// the ring of the calling thread
+        Ring* ring();
+        /// whether any ring has a block
+        bool pending() const;
+
+        std::vector<std::unique_ptr<Ring>> _rings;
+        std::atomic<size_t> _claimed;
+        /// to tell the rings of this channel from those of others
+        const uint64_t _id;
+        /// the ring that receive() starts looking at
+        size_t _next_ring;
+        std::atomic<bool> _waiting, _closed;
+        std::mutex _mutex;
+        std::condition_variable _sent;
 };
 
 typedef std::map<std::string, File*> FileSet;
 
-void file_reader(const std::string& fname, const FileSet& files);
+/// e words of a file pair that are compared in one task
+const size_t part_words = 1024;
+/// blocks a worker can send before it waits for the outputter
+const size_t ring_blocks = 64;
+
+/// How make_dictionaries() runs, with the defaults of mkdict.
+struct Settings {
+    Settings();
+    int wordlength_threshold;
+    bi_sim::num_ty cognate_threshold;
+    /// slots of the bi_sim cache shared by all pairs
+    size_t cache_size;
+    bool exhaustive;
+    /// worker threads, 0 for one per hardware thread
+    size_t jobs;
+    /// bytes of lines the outputter keeps before it spills them
+    size_t buffer_size;
+    /// keep the results in a ResultCache there, unless it's empty
+    std::string cache_dir;
+    /// only make the pairs whose number is shard_index modulo
+    /// shard_count, and write the SHARD file for merge_shards()
+    bool sharded;
+    size_t shard_index, shard_count;
+    size_t part_words, ring_blocks;
+    std::vector<std::string> input_files;
+};
+
+void file_reader(const std::string& fname, const FileSet& files,
+                 WordIds* word_ids);
+
+/// Dictionaries of earlier runs, by the files and the thresholds.
+/** A pair is found by the hashes of its files, so a file that was
+ *  renamed or moved but has the same words is still found. The
+ *  files of a pair are stored in the directory as
+ *      <e hash>-<f hash>-<thresholds hash>[.reverse]
+ *  and are never removed.
+ **/
+class ResultCache {
+    public:
+        /// creates the directory if it doesn't exist
+        ResultCache(const std::string& directory,
+                    const int wordlength_threshold,
+                    const bi_sim::num_ty cognate_threshold);
+        /// take the result of the pair from the cache, or have it
+        /// kept there once it's written. True if it was taken.
+        bool reuse(const std::string& e_name, const std::string& f_name,
+                   const FileSet& files, Result* result) const;
+    private:
+        std::string path(const File& e, const File& f) const;
+        std::string directory;
+        uint64_t thresholds;
+};
+
+/// Queue the parts of a pair of files that are read on the pool, so
+/// that even a single large pair keeps all workers busy.
+void pair_processor(const std::string& e, const std::string& f,
+                    const FileSet& files, Result* result,
+                    const Settings& settings, bi_sim::Cache* cache,
+                    Channel* channel, Align::ThreadPool* pool);
 
+/// Find the cognates of the e words from begin to end in f, and send
+/// them as a part of the result.
+/** Only compares the words that the bigram index of the Bucket finds
+ *  for them, unless exhaustive is given. The cache is shared by all
+ *  file pairs, and keyed by WordIds. If there is no cache, the words
+ *  don't need to be numbered.
+ **/
 void fileset_processor(const std::string& e, const std::string& f,
-                       const FileSet& files, ResultSet* results,
+                       const FileSet& files, size_t begin, size_t end,
+                       size_t part, Result* result,
                        const int wordlength_threshold,
-                       const bi_sim::num_ty cognate_threshold);
+                       const bi_sim::num_ty cognate_threshold,
+                       bi_sim::Cache* cache, bool exhaustive,
+                       Channel* channel);
+
+/// Write the results as they are finished, which are taken from
+/// results. Spills the results with the most lines that are in order
+/// once the kept lines take more than buffer_size bytes. If numbers
+/// is given, a line
+///     <number of the pair> <id of its file>
+/// is written to it for each result. Returns early if the channel is
+/// closed.
+void result_outputter(ResultSet* results, Channel* channel,
+                      size_t buffer_size, std::ostream* numbers = nullptr);
+
+/// Write the dictionaries of the pairs of the input files and their
+/// INDEX to the current directory.
+/** The files are read and the pairs compared on a pool, while the
+ *  outputter runs on a thread of its own from the start, so a worker
+ *  never waits on a full ring for a file that is still read. Throws
+ *  runtime_error if a file can't be read or a result written.
+ **/
+void make_dictionaries(const Settings& settings);
 
-void result_outputter(ResultSet* results);
+/// Put together the dictionaries that the shards of a run wrote to
+/// these directories, and write them to the current one.
+/** A shard i/n of a run only computes the pairs whose number is i
+ *  modulo n, where the pairs are numbered in the order of the input
+ *  files, and writes a file SHARD to its directory once it is done:
+ *      <i>/<n> <number of pairs>
+ *  followed by the lines of the numbers from result_outputter(). The
+ *  merged dictionaries are numbered in the order of the pairs. Throws
+ *  runtime_error if a shard is missing or unfinished, or if one of
+ *  the directories is the current one.
+ **/
+void merge_shards(const std::vector<std::string>& directories);
 }  // namespace DictionaryInducer
 
 #endif  // MKDICT_H_
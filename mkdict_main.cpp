@@ -1,5 +1,7 @@
 // Copyright 2013 Florian Petran
 #include"mkdict.h"
+#include<algorithm>
+#include<sstream>
 #include<utility>
 #include<string>
 #include<vector>
@@ -12,7 +14,6 @@ using std::vector;
 using std::pair;
 using std::make_pair;
 using std::string;
-using std::thread;
 
 namespace po = boost::program_options;
 
@@ -20,6 +21,15 @@ namespace {
 struct opts {
     int wordlength_threshold;
     bi_sim::num_ty cognate_threshold;
+    int cache_size;
+    bool exhaustive;
+    int jobs;
+    int buffer_size;
+    string cache_dir;
+    /// this process computes the pairs whose number is shard_index
+    /// modulo shard_count
+    size_t shard_index, shard_count;
+    bool sharded, merge;
     vector<string> input_files;
 } myopts;
 
@@ -41,6 +51,35 @@ pair<bool, int> get_options(opts* myopts,
          po::value<bi_sim::num_ty>(&(myopts->cognate_threshold))
                                   ->default_value(DICTIONARY_COGNATE_THRESHOLD),
          "Minimum bi-sim value for two words to be considered cognates")
+        ("cache,c",
+         po::value<int>(&(myopts->cache_size))
+            ->default_value(DICTIONARY_BISIM_CACHE),
+         "Slots of the bi-sim cache shared by all file pairs, 0 to disable")
+        ("jobs,j",
+         po::value<int>(&(myopts->jobs))->default_value(ALIGN_DEFAULT_JOBS),
+         "Number of worker threads, 0 for one per hardware thread")
+        ("buffer,b",
+         po::value<int>(&(myopts->buffer_size))
+            ->default_value(DICTIONARY_BUFFER_SIZE),
+         "Megabytes of dictionary lines kept in memory before the "
+         "unfinished ones are spilled to temporary files")
+        ("cache-dir",
+         po::value<string>(&(myopts->cache_dir)),
+         "Directory to keep the dictionaries of file pairs in, so that "
+         "later runs only compute the pairs with new or changed files")
+        ("shard",
+         po::value<string>(),
+         "Only compute every n-th pair, starting with the i-th, given as "
+         "i/n, so that n processes can share the work. Their outputs "
+         "are put together with --merge")
+        ("merge",
+         po::bool_switch(&(myopts->merge)),
+         "Merge the outputs of the shards of a run, in the directories "
+         "given instead of the input files, into the current directory")
+        ("exhaustive",
+         po::bool_switch(&(myopts->exhaustive)),
+         "Compare all pairs of words instead of those found by the bigram "
+         "index, to check it")
         ; //NOLINT
     po::options_description hidden("Hidden options");
     hidden.add_options()
@@ -62,6 +101,29 @@ pair<bool, int> get_options(opts* myopts,
         return make_pair(true, 0);
     }
 
+    myopts->shard_index = 0;
+    myopts->shard_count = 1;
+    myopts->sharded = m.count("shard") != 0;
+    if (myopts->sharded) {
+        std::istringstream shard(m["shard"].as<string>());
+        char slash = 0;
+        if (!(shard >> myopts->shard_index >> slash >> myopts->shard_count)
+         || slash != '/' || !(shard >> std::ws).eof()
+         || myopts->shard_index >= myopts->shard_count) {
+            std::cout << "Error: --shard needs to be i/n, with i < n!"
+                      << std::endl;
+            return make_pair(true, 1);
+        }
+    }
+
+    if (myopts->merge) {
+        if (m.count("input-file"))
+            return make_pair(false, 0);
+        std::cout << "Error: No shards specified!" << std::endl
+                  << desc << std::endl;
+        return make_pair(true, 1);
+    }
+
     if (!m.count("input-file") || myopts->input_files.size() <= 1) {
         std::cout << "Error: Not enough input files specified!" << std::endl
                   << desc << std::endl;
@@ -78,29 +140,25 @@ int main(int argc, char* argv[]) {
         return quitcode.second;
 
     try {
-        DictionaryInducer::FileSet files;
-        DictionaryInducer::ResultSet results;
-
-        for (const string& fname : myopts.input_files) {
-            files[fname] = new DictionaryInducer::File();
-            thread(DictionaryInducer::file_reader,
-                   fname, files).detach();
+        if (myopts.merge) {
+            DictionaryInducer::merge_shards(myopts.input_files);
+            return 0;
         }
 
-        for (auto e_name = myopts.input_files.begin();
-             e_name != myopts.input_files.end(); ++e_name)
-            for (auto f_name = e_name + 1;
-                 f_name != myopts.input_files.end(); ++f_name)
-                thread(DictionaryInducer::fileset_processor,
-                       *e_name, *f_name,
-                       files, &results,
-                       myopts.wordlength_threshold,
-                       myopts.cognate_threshold).detach();
-
-        thread(DictionaryInducer::result_outputter, &results).join();
-
-        for (pair<string, DictionaryInducer::File*> f : files)
-            delete f.second;
+        DictionaryInducer::Settings settings;
+        settings.wordlength_threshold = myopts.wordlength_threshold;
+        settings.cognate_threshold = myopts.cognate_threshold;
+        settings.cache_size = std::max(myopts.cache_size, 0);
+        settings.exhaustive = myopts.exhaustive;
+        settings.jobs = std::max(myopts.jobs, 0);
+        settings.buffer_size =
+            static_cast<size_t>(std::max(myopts.buffer_size, 0)) << 20;
+        settings.cache_dir = myopts.cache_dir;
+        settings.sharded = myopts.sharded;
+        settings.shard_index = myopts.shard_index;
+        settings.shard_count = myopts.shard_count;
+        settings.input_files = myopts.input_files;
+        DictionaryInducer::make_dictionaries(settings);
     } catch(std::runtime_error e) {
         std::cerr << e.what() << std::endl;
         return 1;
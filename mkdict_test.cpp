@@ -0,0 +1,462 @@
+// Copyright 2013 Florian Petran
+#include"mkdict.h"
+#include<dirent.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include<algorithm>
+#include<atomic>
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<fstream>
+#include<future>
+#include<map>
+#include<sstream>
+#include<stdexcept>
+#include<string>
+#include<thread>
+#include<vector>
+#include<gtest/gtest.h> // NOLINT[build/include_order]
+
+using std::string;
+using std::vector;
+
+namespace {
+/// the dictionaries of a run by their headers
+typedef std::map<string, string> Dictionaries;
+
+/// number of threads of this process
+size_t thread_count() {
+    size_t threads = 0;
+    if (DIR* dir = opendir("/proc/self/task")) {
+        while (dirent* entry = readdir(dir))
+            if (entry->d_name[0] != '.')
+                ++threads;
+        closedir(dir);
+    }
+    return threads;
+}
+
+/// the inodes of the files in a directory by their names, which
+/// change when a file is written again
+std::map<string, ino_t> inodes(const string& directory) {
+    std::map<string, ino_t> files;
+    if (DIR* dir = opendir(directory.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            struct stat file;
+            if (entry->d_name[0] != '.'
+             && stat((directory + "/" + entry->d_name).c_str(), &file) == 0)
+                files[entry->d_name] = file.st_ino;
+        }
+        closedir(dir);
+    }
+    return files;
+}
+
+/// remove the files in a directory, and the directory
+void remove_directory(const string& directory) {
+    if (DIR* dir = opendir(directory.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            const string name = entry->d_name;
+            if (name != "." && name != "..")
+                std::remove((directory + "/" + name).c_str());
+        }
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+}
+}  // namespace
+
+class Mkdict_Test : public testing::Test {
+    protected:
+        virtual void SetUp() {
+            char buffer[4096];
+            ASSERT_NE(nullptr, getcwd(buffer, sizeof(buffer)));
+            cwd = buffer;
+            char dir_template[] = "/tmp/mkdict_test.XXXXXX";
+            ASSERT_NE(nullptr, mkdtemp(dir_template));
+            directory = dir_template;
+
+            // words of a few letters, so that there are cognates, with
+            // a vocabulary that every file draws from differently
+            unsigned int seed = 1;
+            for (size_t file = 0; file < 5; ++file) {
+                const string name = directory + "/"
+                                  + std::to_string(file) + ".txt";
+                std::ofstream text(name);
+                for (size_t token = 0; token < 600; ++token) {
+                    seed = seed * 1103515245 + 12345;
+                    const size_t length = 3 + (seed >> 16) % 6;
+                    string word;
+                    for (size_t i = 0; i < length; ++i) {
+                        seed = seed * 1103515245 + 12345;
+                        word += "abcdefg"[(seed >> 16) % (3 + file)];
+                    }
+                    text << word << '\n';
+                }
+                settings.input_files.push_back("../" + std::to_string(file)
+                                               + ".txt");
+            }
+        }
+
+        virtual void TearDown() {
+            ASSERT_EQ(0, chdir(cwd.c_str()));
+            for (const string& run : runs)
+                remove_directory(directory + "/" + run);
+            remove_directory(directory + "/cache");
+            remove_directory(directory);
+        }
+
+        /// make the dictionaries in a directory of their own, and read
+        /// them back. Aborts if the run hangs.
+        Dictionaries run(const string& name,
+                         const DictionaryInducer::Settings& settings) {
+            runs.push_back(name);
+            const string run_directory = directory + "/" + name;
+            EXPECT_EQ(0, mkdir(run_directory.c_str(), 0700));
+            EXPECT_EQ(0, chdir(run_directory.c_str()));
+            std::future<void> done = std::async(std::launch::async, [&]() {
+                DictionaryInducer::make_dictionaries(settings);
+            });
+            if (done.wait_for(std::chrono::seconds(120))
+                    != std::future_status::ready) {
+                std::cerr << "make_dictionaries hangs" << std::endl;
+                std::abort();
+            }
+            done.get();
+            return read_dictionaries();
+        }
+
+        /// make the pairs of a shard i/n in a directory of their own
+        void run_shard(const string& name, size_t index, size_t count) {
+            DictionaryInducer::Settings shard = settings;
+            shard.sharded = true;
+            shard.shard_index = index;
+            shard.shard_count = count;
+            run(name, shard);
+        }
+
+        /// merge the shards of these runs in a directory of its own,
+        /// and read the dictionaries back
+        Dictionaries merge(const string& name, const vector<string>& shards) {
+            runs.push_back(name);
+            const string run_directory = directory + "/" + name;
+            EXPECT_EQ(0, mkdir(run_directory.c_str(), 0700));
+            EXPECT_EQ(0, chdir(run_directory.c_str()));
+            vector<string> shard_directories;
+            for (const string& shard : shards)
+                shard_directories.push_back("../" + shard);
+            DictionaryInducer::merge_shards(shard_directories);
+            return read_dictionaries();
+        }
+
+        /// the dictionaries in the INDEX of the current directory
+        Dictionaries read_dictionaries() {
+            Dictionaries dictionaries;
+            std::ifstream index("INDEX");
+            string id, header;
+            while (index >> id && std::getline(index >> std::ws, header)) {
+                std::ifstream file(id.substr(0, id.size() - 1));
+                std::ostringstream content;
+                content << file.rdbuf();
+                dictionaries[header] = content.str();
+            }
+            return dictionaries;
+        }
+
+        string cwd, directory;
+        vector<string> runs;
+        DictionaryInducer::Settings settings;
+};
+
+TEST_F(Mkdict_Test, MoreBlocksThanRings) {
+    settings.jobs = 1;
+    const Dictionaries expected = run("default", settings);
+    // 10 pairs
+    ASSERT_EQ(20, expected.size());
+
+    // each pair has dozens of parts, which go through rings of a
+    // single block
+    settings.jobs = 2;
+    settings.part_words = 4;
+    settings.ring_blocks = 1;
+    EXPECT_EQ(expected, run("small", settings));
+
+    // the reused results go through the channel as well
+    settings.cache_dir = directory + "/cache";
+    EXPECT_EQ(expected, run("cached", settings));
+    EXPECT_EQ(expected, run("reused", settings));
+}
+
+TEST_F(Mkdict_Test, SharedCache) {
+    settings.jobs = 1;
+    const Dictionaries expected = run("default", settings);
+
+    // the words are only numbered with a cache, which doesn't change
+    // the dictionaries, however the files are read
+    settings.cache_size = 4096;
+    EXPECT_EQ(expected, run("cache", settings));
+    settings.jobs = 3;
+    settings.part_words = 16;
+    EXPECT_EQ(expected, run("cache_jobs", settings));
+}
+
+TEST_F(Mkdict_Test, ExhaustiveThresholds) {
+    // the bigram index only skips words that can't be cognates, so it
+    // finds the same ones as comparing all pairs of words
+    settings.jobs = 2;
+    for (bi_sim::num_ty cognate_threshold : { 0.0, 0.3, 0.5, 0.7, 1.0 })
+        for (int wordlength_threshold : { 0, 2, 5 }) {
+            const string name = std::to_string(cognate_threshold) + "_"
+                              + std::to_string(wordlength_threshold);
+            settings.cognate_threshold = cognate_threshold;
+            settings.wordlength_threshold = wordlength_threshold;
+            settings.exhaustive = true;
+            const Dictionaries expected = run(name + "_exhaustive",
+                                              settings);
+            ASSERT_EQ(20, expected.size());
+            settings.exhaustive = false;
+            EXPECT_EQ(expected, run(name + "_indexed", settings))
+                << "cognate threshold " << cognate_threshold
+                << ", word length threshold " << wordlength_threshold;
+        }
+}
+
+TEST_F(Mkdict_Test, MergeShards) {
+    settings.jobs = 2;
+    const Dictionaries expected = run("whole", settings);
+    for (size_t index = 0; index < 3; ++index)
+        run_shard("shard" + std::to_string(index), index, 3);
+    // the order of the shards doesn't matter
+    EXPECT_EQ(expected, merge("merged", { "shard2", "shard0", "shard1" }));
+
+    // the merged dictionaries are numbered in the order of the pairs,
+    // each pair with both of its directions
+    std::ifstream index("INDEX");
+    const vector<string>& names = settings.input_files;
+    int id = 100001;
+    for (size_t e = 0; e < names.size(); ++e)
+        for (size_t f = e + 1; f < names.size(); ++f)
+            for (const string& header
+                    : { "### " + names[e] + " = " + names[f],
+                        "### " + names[f] + " = " + names[e] }) {
+                string line;
+                ASSERT_TRUE(std::getline(index, line));
+                EXPECT_EQ(std::to_string(id++) + ": " + header, line);
+            }
+    string line;
+    EXPECT_FALSE(std::getline(index, line));
+}
+
+TEST_F(Mkdict_Test, MergeMissingShard) {
+    run_shard("shard0", 0, 3);
+    run_shard("shard2", 2, 3);
+    EXPECT_THROW(merge("merged", { "shard0", "shard2" }),
+                 std::runtime_error);
+}
+
+TEST_F(Mkdict_Test, MergeUnfinishedShard) {
+    run_shard("shard0", 0, 2);
+    run_shard("shard1", 1, 2);
+    // a shard that didn't finish only has the temporary file
+    const string shard = directory + "/shard1/SHARD";
+    ASSERT_EQ(0, std::rename(shard.c_str(), (shard + ".tmp").c_str()));
+    EXPECT_THROW(merge("merged", { "shard0", "shard1" }),
+                 std::runtime_error);
+}
+
+TEST_F(Mkdict_Test, MergeDuplicateShard) {
+    run_shard("shard0", 0, 2);
+    run_shard("shard1", 1, 2);
+    run_shard("again", 1, 2);
+    EXPECT_THROW(merge("merged", { "shard0", "shard1", "again" }),
+                 std::runtime_error);
+}
+
+TEST_F(Mkdict_Test, MergeForeignShard) {
+    run_shard("shard0", 0, 2);
+    run_shard("shard1", 1, 2);
+    // the same shard numbers, but of a run with other files
+    settings.input_files.pop_back();
+    run_shard("foreign1", 1, 2);
+    EXPECT_THROW(merge("merged", { "shard0", "foreign1" }),
+                 std::runtime_error);
+
+    // or with another number of shards
+    run_shard("third1", 1, 3);
+    EXPECT_THROW(merge("merged_again", { "shard0", "third1" }),
+                 std::runtime_error);
+}
+
+TEST_F(Mkdict_Test, BoundedPool) {
+    settings.jobs = 1;
+    const Dictionaries expected = run("single", settings);
+
+    // however many workers split up the pairs, the dictionaries are
+    // the same, and there are never more threads than the workers,
+    // the outputter and those of the test
+    settings.part_words = 7;
+    for (size_t jobs : { 2, 3, 8 }) {
+        settings.jobs = jobs;
+        const size_t before = thread_count();
+        std::atomic<bool> running(true);
+        std::atomic<size_t> most(0);
+        std::thread watch([&]() {
+            while (running) {
+                most = std::max<size_t>(most, thread_count());
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        EXPECT_EQ(expected, run("jobs" + std::to_string(jobs), settings));
+        running = false;
+        watch.join();
+        // the watcher, the thread that runs the test and the outputter
+        EXPECT_LE(most, before + 3 + jobs) << jobs << " jobs";
+    }
+}
+
+TEST_F(Mkdict_Test, OutOfOrderSpill) {
+    runs.push_back("outputter");
+    const string run_directory = directory + "/outputter";
+    ASSERT_EQ(0, mkdir(run_directory.c_str(), 0700));
+    ASSERT_EQ(0, chdir(run_directory.c_str()));
+
+    DictionaryInducer::ResultSet results;
+    DictionaryInducer::Result *first =
+        new DictionaryInducer::Result("a.txt", "b.txt", 0),
+                              *second =
+        new DictionaryInducer::Result("a.txt", "c.txt", 1);
+    first->expect_parts(3);
+    second->expect_parts(2);
+    results.insert(first);
+    results.insert(second);
+    DictionaryInducer::Channel channel(1, 16);
+    auto send = [&](DictionaryInducer::Result* result, size_t part) {
+        const string name = result == first ? "b" : "c";
+        DictionaryInducer::Block block;
+        block.result = result;
+        block.part = part;
+        block.lines.push_back(string_impl("a = ") + name.c_str()
+                              + std::to_string(part).c_str());
+        block.reverse_lines.push_back(string_impl(name.c_str())
+                                      + std::to_string(part).c_str()
+                                      + " = a");
+        channel.send(&block);
+    };
+
+    // the parts that follow the first one of their result can only be
+    // spilled once it is in
+    send(first, 2);
+    send(second, 1);
+    send(first, 0);
+    std::ostringstream numbers;
+    std::future<void> output = std::async(std::launch::async, [&]() {
+        DictionaryInducer::result_outputter(&results, &channel, 16,
+                                            &numbers);
+    });
+    struct stat spilled;
+    for (int wait = 0; wait < 10000
+                    && stat("mkdict-0.tmp", &spilled) != 0; ++wait)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_EQ(0, stat("mkdict-0.tmp", &spilled));
+    EXPECT_NE(0, stat("mkdict-1.tmp", &spilled));
+
+    // the second result is finished first, so it gets the first number
+    send(second, 0);
+    send(first, 1);
+    ASSERT_EQ(std::future_status::ready,
+              output.wait_for(std::chrono::seconds(120)));
+    output.get();
+    EXPECT_TRUE(results.empty());
+    EXPECT_EQ("1 100001\n0 100003\n", numbers.str());
+
+    auto content = [](const string& name) {
+        std::ifstream file(name);
+        std::ostringstream text;
+        text << file.rdbuf();
+        return text.str();
+    };
+    EXPECT_EQ("100001: ### a.txt = c.txt\n100002: ### c.txt = a.txt\n"
+              "100003: ### a.txt = b.txt\n100004: ### b.txt = a.txt\n",
+              content("INDEX"));
+    EXPECT_EQ("### a.txt = c.txt\na = c0\na = c1\n", content("100001"));
+    EXPECT_EQ("### c.txt = a.txt\nc0 = a\nc1 = a\n", content("100002"));
+    EXPECT_EQ("### a.txt = b.txt\na = b0\na = b1\na = b2\n",
+              content("100003"));
+    EXPECT_EQ("### b.txt = a.txt\nb0 = a\nb1 = a\nb2 = a\n",
+              content("100004"));
+    EXPECT_NE(0, stat("mkdict-0.tmp", &spilled));
+}
+
+TEST_F(Mkdict_Test, CacheRenamedAndReversed) {
+    settings.jobs = 2;
+    settings.cache_dir = directory + "/cache";
+    run("cached", settings);
+    const std::map<string, ino_t> cached = inodes(settings.cache_dir);
+    // both directions of 10 pairs
+    ASSERT_EQ(20, cached.size());
+
+    // a file that was renamed has the same words, so its pairs are
+    // taken from the cache with the new name in their headers
+    {
+        std::ifstream original(directory + "/0.txt");
+        std::ofstream(directory + "/renamed.txt") << original.rdbuf();
+    }
+    settings.input_files[0] = "../renamed.txt";
+    const Dictionaries renamed = run("renamed", settings);
+    EXPECT_EQ(cached, inodes(settings.cache_dir));
+
+    // the pairs of files in the other order were cached the other way
+    // round
+    std::reverse(settings.input_files.begin(), settings.input_files.end());
+    const Dictionaries reversed = run("reversed", settings);
+    EXPECT_EQ(cached, inodes(settings.cache_dir));
+
+    // they are the same as without the cache
+    settings.cache_dir.clear();
+    EXPECT_EQ(reversed, run("reversed_fresh", settings));
+    std::reverse(settings.input_files.begin(), settings.input_files.end());
+    EXPECT_EQ(renamed, run("renamed_fresh", settings));
+    std::remove((directory + "/renamed.txt").c_str());
+}
+
+TEST_F(Mkdict_Test, NormalizedVocabulary) {
+    // white space of all kinds, repeated and differently cased words,
+    // and characters beyond ASCII, some of them outside of the BMP
+    const string name = directory + "/vocabulary.txt";
+    std::ofstream(name) << "Apfel apfel\tAPFEL\r\n\n  \xc3\x84pfel"
+                        << " \xc3\xa4pfel\x0b\xf0\x9f\x8d\x8e\n"
+                        << "Stra\xc3\x9f" "e strasse\fa a\n"
+                        << "\xf0\x9f\x8d\x8e" "apfel Apfel";
+
+    // the words as operator>> read them before
+    vector<string_impl> expected;
+    std::ifstream text(name);
+    string token;
+    while (text >> token)
+        expected.push_back(from_bytes(token.c_str(), token.size()));
+    std::sort(expected.begin(), expected.end());
+    expected.erase(std::unique(expected.begin(), expected.end()),
+                   expected.end());
+
+    DictionaryInducer::File file;
+    file.open(name, nullptr);
+    ASSERT_EQ(expected, file.words);
+    EXPECT_TRUE(file.ids.empty());
+
+    // each word is normalized in the arena as on its own, and has the
+    // bi_sim values of the words themselves
+    vector<bi_sim::unit_ty> units;
+    for (size_t i = 0; i < file.words.size(); ++i) {
+        bi_sim::normalize(file.words[i], &units);
+        ASSERT_EQ(units.size(), file.lengths[i] + 1);
+        EXPECT_TRUE(std::equal(units.begin(), units.end(), file.units(i)));
+        for (size_t j = 0; j < file.words.size(); ++j)
+            EXPECT_EQ(bi_sim::bi_sim(file.words[i], file.words[j]),
+                      bi_sim::bi_sim(file.units(i), file.lengths[i],
+                                     file.units(j), file.lengths[j]));
+    }
+
+    std::remove(name.c_str());
+}
@@ -1,5 +1,6 @@
 // Copyright 2012 Florian Petran
 #include"params.h"
+#include<algorithm>
 #include<iostream>
 #include<string>
 #include<utility>
@@ -11,19 +12,26 @@ using std::pair;
 
 namespace Align {
 
-Params& Params::get() {
-    static Params _instance;
-    return _instance;
-}
-
-int Params::closeness() {
+int Params::closeness() const {
     return _closeness;
 }
 
-bool Params::monotony() {
+bool Params::monotony() const {
     return _monotony;
 }
 
+bool Params::mapped_texts() const {
+    return _mapped_texts;
+}
+
+int Params::segment_length() const {
+    return _segment_length;
+}
+
+int Params::jobs() const {
+    return _jobs;
+}
+
 void Params::set_closeness(int what) {
     _closeness = what;
 }
@@ -31,18 +39,59 @@ void Params::set_closeness(int what) {
 void Params::set_monotony(bool disabled) {
     _monotony = !disabled;
 }
+void Params::set_mapped_texts(bool what) {
+    _mapped_texts = what;
+}
+void Params::set_segment_length(int what) {
+    _segment_length = what;
+}
+void Params::set_jobs(int what) {
+    // the ThreadPool takes a size_t, so negative values would wrap
+    // around. Like 0, they give one thread per core.
+    _jobs = std::max(what, 0);
+}
 void Params::set_max_skip(int what) {
     _max_skip = what;
 }
 void Params::set_dict_base(const string& what) {
     _dict_base = what;
 }
-int Params::max_skip() {
+void Params::set_batch(const string& fname) {
+    _batch = fname;
+}
+void Params::set_serve(const string& socket_name) {
+    _serve = socket_name;
+}
+void Params::set_memory_budget(int megabytes) {
+    _memory_budget = megabytes;
+}
+void Params::set_bisim_cache(int slots) {
+    _bisim_cache = slots;
+}
+void Params::set_cache_stats(bool value) {
+    _cache_stats = value;
+}
+int Params::max_skip() const {
     return _max_skip;
 }
-const string& Params::dict_base() {
+const string& Params::dict_base() const {
     return _dict_base;
 }
+const string& Params::batch() const {
+    return _batch;
+}
+const string& Params::serve() const {
+    return _serve;
+}
+int Params::memory_budget() const {
+    return _memory_budget;
+}
+int Params::bisim_cache() const {
+    return _bisim_cache;
+}
+bool Params::cache_stats() const {
+    return _cache_stats;
+}
 
 pair<string, string> Params::parse(int argc, char* argv[]) {
     namespace cfg = boost::program_options;
@@ -50,7 +99,8 @@ pair<string, string> Params::parse(int argc, char* argv[]) {
         (static_cast<std::string>("pAlign v")
          + ALIGN_VERSION
          + "\nAllowed Options");
-    bool disable_monotony = ALIGN_DEFAULT_MONOTONY;
+    bool disable_monotony = !ALIGN_DEFAULT_MONOTONY;
+    bool disable_mapping = !ALIGN_DEFAULT_MAPPED_TEXTS;
     desc.add_options()
         ("help,h", "display this helpful message")
         ("source,e", cfg::value<std::string>(), "source text to align")
@@ -67,20 +117,52 @@ pair<string, string> Params::parse(int argc, char* argv[]) {
         ("no-monotony,M", cfg::bool_switch(&disable_monotony)
                               ->default_value(!ALIGN_DEFAULT_MONOTONY),
           "disable monotony constraint")
+        ("no-mmap", cfg::bool_switch(&disable_mapping)
+                        ->default_value(!ALIGN_DEFAULT_MAPPED_TEXTS),
+          "read texts through streams instead of mapping them into memory")
+        ("segment-length,S", cfg::value<int>(&_segment_length)
+                  ->default_value(ALIGN_DEFAULT_SEGMENT_LENGTH),
+          "align independent segments of at least this many tokens, "
+          "cut at anchor words, in parallel. 0 aligns the whole text")
+        ("jobs,j",
+          cfg::value<int>(&_jobs)->default_value(ALIGN_DEFAULT_JOBS),
+          "number of threads for segmented and batch alignment, "
+          "0 for one per core")
+        ("batch,b", cfg::value<std::string>(&_batch),
+          "align all text pairs listed in this file instead of source "
+          "and target: one pair per line, as source, target and "
+          "output file")
+        ("serve", cfg::value<std::string>(&_serve),
+          "keep running, and answer alignment requests on this "
+          "UNIX socket")
+        ("memory-budget", cfg::value<int>(&_memory_budget)
+                  ->default_value(ALIGN_DEFAULT_MEMORY_BUDGET),
+          "MB of texts and dictionaries a server keeps loaded")
+        ("bisim-cache", cfg::value<int>(&_bisim_cache)
+                  ->default_value(ALIGN_DEFAULT_BISIM_CACHE),
+          "slots of the bi_sim cache of each text pair, 0 to disable it")
+        ("cache-stats", cfg::bool_switch(&_cache_stats),
+          "report how often the bi_sim cache was hit on stderr")
         ; // NOLINT[whitespace/semicolon]
-    // needs to be read separately, since the switch has opposite
-    // meanings for true and false.
-    _monotony = !disable_monotony;
 
     cfg::variables_map m;
     cfg::store(cfg::parse_command_line(argc, argv, desc), m);
     cfg::notify(m);
 
+    // need to be read separately once the switches are set, since
+    // they have opposite meanings for true and false.
+    _monotony = !disable_monotony;
+    _mapped_texts = !disable_mapping;
+    set_jobs(_jobs);
+
     if (m.count("help")) {
         std::cout << desc << std::endl;
         throw std::runtime_error("");
     }
 
+    if (!_batch.empty() || !_serve.empty())
+        return make_pair(string(), string());
+
     if (!m.count("source") || !m.count("target")) {
         std::cout << desc << std::endl;
         throw std::runtime_error("Not enough arguments!");
@@ -10,46 +10,71 @@
 namespace Align {
 
 /// Hold parameters for alignment.
-/*! A singleton that encapsulates all parameters.
- *
- *  We're using a lazy Meyers singleton, since apparently
- *  those are threadsafe in C++11.
+/*! Encapsulates all parameters. Every AlignContext has its
+ *  own copy, so that alignments with different parameters can
+ *  run side by side.
  *
  *  It also takes care of the parsing of options from the
  *  command line, and maybe eventually from a config file.
  **/
 class Params {
     public:
-        Params(const Params& p) = delete;
-        const Params& operator=(const Params& p) = delete;
-
-        static Params& get();
+        Params() = default;
 
-        int max_skip();
-        int closeness();
-        bool monotony();
-        const std::string& dict_base();
+        int max_skip() const;
+        int closeness() const;
+        bool monotony() const;
+        bool mapped_texts() const;
+        int segment_length() const;
+        int jobs() const;
+        const std::string& dict_base() const;
+        /// the batch manifest, if there is one
+        const std::string& batch() const;
+        /// the socket to serve requests on, if there is one
+        const std::string& serve() const;
+        /// how many MB of texts and dictionaries a server keeps
+        int memory_budget() const;
+        /// slots of the bi_sim cache of each text pair
+        int bisim_cache() const;
+        /// whether to report the bi_sim cache counters
+        bool cache_stats() const;
 
         void set_max_skip(int value);
         void set_closeness(int value);
         void set_monotony(bool disabled);
+        void set_mapped_texts(bool value);
+        void set_segment_length(int value);
+        void set_jobs(int value);
         void set_dict_base(const std::string& dirname);
+        void set_batch(const std::string& fname);
+        void set_serve(const std::string& socket_name);
+        void set_memory_budget(int megabytes);
+        void set_bisim_cache(int slots);
+        void set_cache_stats(bool value);
 
         /// Parse command line for parameters. Set Params members as
         /// needed, and return a pair of file names (e_name, f_name).
         /// If --help is specified, or if one or both source and target
         /// files are missing, runtime_error is thrown, which should
-        /// be caught by the client.
+        /// be caught by the client. In batch and server mode, the
+        /// texts come with the manifest or the requests, and the
+        /// file names are empty.
         /// The options descriptions is shown on stdout either way.
         std::pair<std::string, std::string> parse(int argc, char* argv[]);
 
     private:
-        Params() = default;
-
         int  _closeness         = ALIGN_DEFAULT_CLOSENESS;
         bool _monotony          = ALIGN_DEFAULT_MONOTONY;
         int _max_skip           = ALIGN_DEFAULT_MAX_SKIP;
+        bool _mapped_texts      = ALIGN_DEFAULT_MAPPED_TEXTS;
+        int _segment_length     = ALIGN_DEFAULT_SEGMENT_LENGTH;
+        int _jobs               = ALIGN_DEFAULT_JOBS;
         std::string _dict_base  = ALIGN_DEFAULT_DICT_BASE;
+        std::string _batch;
+        std::string _serve;
+        int _memory_budget      = ALIGN_DEFAULT_MEMORY_BUDGET;
+        int _bisim_cache        = ALIGN_DEFAULT_BISIM_CACHE;
+        bool _cache_stats       = false;
 };
 }  // namespace Align
 
@@ -6,16 +6,17 @@
 #include<vector>
 
 #include"bi-sim.h"
+#include"dictionary.h"
 
 using std::vector;
 
 namespace Align {
 
-ScoringMethods::ScoringMethods() {
+ScoringMethods::ScoringMethods(const Dictionary* dict) {
     // register all scoring methods here
     this->push_back(new LengthScorer);
     this->push_back(new IndexdiffScorer);
-    this->push_back(new BisimScorer);
+    this->push_back(new BisimScorer(dict));
 }
 
 ScoringMethods::~ScoringMethods() {
@@ -48,13 +49,17 @@ float IndexdiffScorer::operator()(const Sequence& seq) {
     return result;
 }
 
+BisimScorer::BisimScorer(const Dictionary* dict) : _dict(dict) {}
+
 float BisimScorer::operator()(const Sequence& seq) {
     float result = 0.0;
 
     for (auto pair = seq.cbegin(); pair != seq.cend(); ++pair)
         result +=
-                bi_sim::bi_sim(pair->source().get_str(),
-                               pair->target().get_str()) / seq.length();
+                (_dict ? _dict->similarity(pair->source(), pair->target())
+                       : bi_sim::bi_sim(pair->source().get_str(),
+                                        pair->target().get_str()))
+              / seq.length();
 
     _max = (_max > result) ? _max : result;
 
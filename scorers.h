@@ -6,6 +6,7 @@
 
 namespace Align {
 class Scorer;
+class Dictionary;
 
 /// A container of scoring methods.
 /** This class exists so that clients do not need
@@ -19,7 +20,8 @@ class Scorer;
  **/
 class ScoringMethods : public std::vector<Scorer*> {
     public:
-        ScoringMethods();
+        /// the bi_sim scores are cached in the dictionary, if given
+        explicit ScoringMethods(const Dictionary* dict = nullptr);
         ~ScoringMethods();
         ScoringMethods(const ScoringMethods&) = delete;
         const ScoringMethods& operator=(const ScoringMethods&) = delete;
@@ -71,11 +73,18 @@ class IndexdiffScorer : public Scorer {
 };
 
 /// score average bi_sim between e and f strings
+/** With a dictionary, the values come from its bi_sim cache, so
+ *  that a pair of types is only compared once.
+ **/
 class BisimScorer : public Scorer {
-    float operator()(const Sequence&);
-    const char* name() {
-        return "bi_sim";
-    }
+    public:
+        explicit BisimScorer(const Dictionary* dict = nullptr);
+    private:
+        float operator()(const Sequence&);
+        const char* name() {
+            return "bi_sim";
+        }
+        const Dictionary* _dict;
 };
 }  // namespace Align
 
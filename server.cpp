@@ -0,0 +1,310 @@
+// Copyright 2013 Florian Petran
+#include"server.h"
+
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<unistd.h>
+
+#include<cerrno>
+#include<cstring>
+#include<future>
+#include<limits>
+#include<map>
+#include<mutex>
+#include<sstream>
+#include<stdexcept>
+#include<string>
+#include<utility>
+#include<vector>
+#include"align.h"
+#include"context.h"
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+namespace Align {
+
+namespace {
+sockaddr_un socket_address(const string& socket_name) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_name.size() >= sizeof(address.sun_path))
+        throw runtime_error(string("Socket name too long: ") + socket_name);
+    std::strcpy(address.sun_path, socket_name.c_str());
+    return address;
+}
+
+/// read the next line without the newline from a socket, keeping
+/// what was read after it in buffer. False if the peer hung up first.
+bool read_line(int fd, string* buffer, string* line) {
+    size_t eol;
+    while ((eol = buffer->find('\n')) == string::npos) {
+        char chunk[4096];
+        ssize_t got = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        buffer->append(chunk, got);
+    }
+    line->assign(*buffer, 0, eol);
+    buffer->erase(0, eol + 1);
+    return true;
+}
+
+bool write_all(int fd, const string& data) {
+    for (size_t sent = 0; sent < data.size();) {
+        // don't get killed by SIGPIPE if the peer hung up
+        ssize_t put = ::send(fd, data.data() + sent, data.size() - sent,
+                             MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put < 0)
+            return false;
+        sent += put;
+    }
+    return true;
+}
+
+/// parse a token range given as begin:end
+void parse_range(const string& value, int* begin, int* end) {
+    size_t colon = value.find(':');
+    if (colon == string::npos)
+        throw runtime_error("Range needs to be <begin>:<end>: " + value);
+    *begin = std::stoi(value.substr(0, colon));
+    *end = std::stoi(value.substr(colon + 1));
+}
+}  // namespace
+
+AlignServer::AlignServer(const Params& params, ThreadPool* pool)
+    : _params(params), _dictionaries(_params), _pool(pool),
+      _budget(static_cast<size_t>(params.memory_budget()) << 20),
+      _listener(-1), _active(0), _shrinking(false), _stopping(false) {}
+
+AlignServer::~AlignServer() {
+    stop();
+    // the threads need the mutex to finish, so it isn't held here
+    for (std::pair<const std::thread::id, std::thread>& connection :
+            _connections)
+        connection.second.join();
+    if (_listener != -1)
+        ::close(_listener);
+}
+
+void AlignServer::serve(const string& socket_name) {
+    sockaddr_un address = socket_address(socket_name);
+    _listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_listener == -1)
+        throw runtime_error(string("Couldn't create socket: ")
+                            + std::strerror(errno));
+    ::unlink(socket_name.c_str());
+    if (::bind(_listener, reinterpret_cast<sockaddr*>(&address),
+               sizeof(address)) == -1
+     || ::listen(_listener, SOMAXCONN) == -1)
+        throw runtime_error("Couldn't listen on " + socket_name + ": "
+                            + std::strerror(errno));
+
+    while (true) {
+        int connection = ::accept(_listener, nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopping) {
+            if (connection != -1)
+                ::close(connection);
+            break;
+        }
+        if (connection == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throw runtime_error(string("Couldn't accept connection: ")
+                                + std::strerror(errno));
+        }
+        // so that a long running server doesn't pile up the threads
+        // of the clients that are gone
+        reap();
+        _open.insert(connection);
+        std::thread handler(&AlignServer::handle, this, connection);
+        // it can't finish before it's in there, as it needs the mutex
+        _connections[handler.get_id()] = std::move(handler);
+    }
+
+    for (std::pair<const std::thread::id, std::thread>& connection :
+            _connections)
+        connection.second.join();
+    _connections.clear();
+    _finished.clear();
+    ::unlink(socket_name.c_str());
+}
+
+void AlignServer::reap() {
+    for (std::thread::id finished : _finished) {
+        std::map<std::thread::id, std::thread>::iterator connection =
+            _connections.find(finished);
+        // it has given up the mutex, and only returns after that
+        connection->second.join();
+        _connections.erase(connection);
+    }
+    _finished.clear();
+}
+
+void AlignServer::stop() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+    // wakes up accept() and the recv() of idle clients
+    if (_listener != -1)
+        ::shutdown(_listener, SHUT_RDWR);
+    for (int connection : _open)
+        ::shutdown(connection, SHUT_RD);
+}
+
+void AlignServer::handle(int connection) {
+    string buffer, line;
+    while (read_line(connection, &buffer, &line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!write_all(connection, answer(line)))
+            break;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _open.erase(connection);
+    ::close(connection);
+    _finished.push_back(std::this_thread::get_id());
+}
+
+string AlignServer::answer(const string& request) {
+    std::istringstream fields(request);
+    vector<string> words;
+    for (string word; fields >> word;)
+        words.push_back(word);
+
+    if (words.empty())
+        return "error empty request\n";
+    if (words[0] == "shutdown") {
+        stop();
+        return "ok 0\n";
+    }
+    if (words[0] == "stats") {
+        uint64_t hits, misses;
+        _dictionaries.bisim_cache_stats(&hits, &misses);
+        return "ok 2\n" + std::to_string(_dictionaries.memory_use())
+             + " bytes\n" + std::to_string(hits) + " bi_sim cache hits, "
+             + std::to_string(misses) + " misses\n";
+    }
+    if (words[0] != "align")
+        return "error unknown request: " + words[0] + "\n";
+
+    try {
+        return align(words);
+    } catch(const std::exception& e) {
+        return string("error ") + e.what() + "\n";
+    }
+}
+
+string AlignServer::align(const vector<string>& words) {
+    if (words.size() < 3)
+        throw runtime_error("align needs an e and an f text");
+
+    Params params = _params;
+    // the ranges are clipped to the texts
+    vector<int> range = { 0, std::numeric_limits<int>::max(),
+                          0, std::numeric_limits<int>::max() };
+    bool restricted = false;
+    for (size_t i = 3; i < words.size(); ++i) {
+        size_t equals = words[i].find('=');
+        string name = words[i].substr(0, equals),
+               value = equals == string::npos
+                     ? string() : words[i].substr(equals + 1);
+        if (name == "closeness")
+            params.set_closeness(std::stoi(value));
+        else if (name == "skip")
+            params.set_max_skip(std::stoi(value));
+        else if (name == "monotony")
+            params.set_monotony(std::stoi(value) == 0);
+        else if (name == "segment_length")
+            params.set_segment_length(std::stoi(value));
+        else if (name == "e_range" || name == "f_range")
+            parse_range(value, &range[name == "e_range" ? 0 : 2],
+                        &range[name == "e_range" ? 1 : 3]);
+        else
+            throw runtime_error("unknown setting: " + name);
+        restricted |= name == "e_range" || name == "f_range";
+    }
+
+    begin_request();
+    std::future<string> result = _pool->submit([&]() {
+        AlignContext context(params, &_dictionaries);
+        BidirectionalAlign bi_align(&context, words[1], words[2]);
+        if (restricted)
+            bi_align.restrict_to(range[0], range[1], range[2], range[3]);
+        AlignMake& align_make = bi_align.align(_pool).forward();
+        align_make.merge_sequences()
+                  .collect_scores()
+                  .get_topranking();
+
+        std::ostringstream sequences;
+        size_t count = 0;
+        for (Sequence* seq : *align_make.get_result()) {
+            sequences << *seq << '\n';
+            ++count;
+        }
+        return "ok " + std::to_string(count) + "\n" + sequences.str();
+    });
+    // not a worker, so this doesn't need to help out
+    result.wait();
+    end_request();
+    return result.get();
+}
+
+void AlignServer::begin_request() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_shrinking)
+        _idle.wait(lock);
+    ++_active;
+}
+
+void AlignServer::end_request() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    --_active;
+    if (!_shrinking && _dictionaries.memory_use() > _budget)
+        _shrinking = true;
+    if (_shrinking && _active == 0) {
+        // nothing from the factory is in use now
+        _dictionaries.shrink(_budget);
+        _shrinking = false;
+        _idle.notify_all();
+    }
+}
+
+string request(const string& socket_name, const string& line) {
+    sockaddr_un address = socket_address(socket_name);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1
+     || ::connect(fd, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address)) == -1) {
+        string error = std::strerror(errno);
+        if (fd != -1)
+            ::close(fd);
+        throw runtime_error("Couldn't connect to " + socket_name + ": "
+                            + error);
+    }
+
+    string buffer, header, answer;
+    bool complete = write_all(fd, line + "\n")
+                 && read_line(fd, &buffer, &header);
+    answer = header + "\n";
+    if (complete && header.compare(0, 3, "ok ") == 0) {
+        size_t count = std::stoul(header.substr(3));
+        string sequence;
+        for (size_t i = 0; i < count && complete; ++i) {
+            complete = read_line(fd, &buffer, &sequence);
+            answer += sequence + "\n";
+        }
+    }
+    ::close(fd);
+    if (!complete)
+        throw runtime_error("Connection to " + socket_name + " lost");
+    return answer;
+}
+}  // namespace Align
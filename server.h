@@ -0,0 +1,98 @@
+// Copyright 2013 Florian Petran
+// answer alignment requests over a UNIX socket
+#ifndef SERVER_H_
+#define SERVER_H_
+#include<condition_variable>
+#include<map>
+#include<mutex>
+#include<set>
+#include<string>
+#include<thread>
+#include<vector>
+#include"params.h"
+#include"dictionary.h"
+#include"thread_pool.h"
+
+namespace Align {
+
+/// A long running aligner, that keeps texts and dictionaries loaded.
+/** Clients connect to a UNIX socket, and send one request per line.
+ *  A request looks like
+ *      align <e text> <f text> [<name>=<value> ...]
+ *  where the optional settings are closeness, skip, monotony (0 or
+ *  1) and segment_length, which default to the server's Params, and
+ *  e_range and f_range as <begin>:<end> to only align these tokens.
+ *  The answer is a line
+ *      ok <n>
+ *  followed by the n sequences of the alignment, one per line, or
+ *  a single line
+ *      error <message>
+ *  if the request failed. stats answers with the number of bytes
+ *  that the loaded texts and dictionaries take, and the hits and
+ *  misses of the bi_sim caches since the start. shutdown stops
+ *  the server once the running requests are answered.
+ *
+ *  Every connection gets a thread that reads its requests, and the
+ *  alignments run on the pool, so that an idle client never takes
+ *  up a worker. All requests share one DictionaryFactory. Once it
+ *  takes more than Params::memory_budget(), no new requests are
+ *  started until the running ones are done, and the least recently
+ *  used dictionaries are dropped.
+ **/
+class AlignServer {
+    public:
+        /// the params are copied, and give the dictionary directory,
+        /// the memory budget and the defaults for requests
+        AlignServer(const Params& params, ThreadPool* pool);
+        ~AlignServer();
+        AlignServer(const AlignServer&) = delete;
+        const AlignServer& operator=(const AlignServer&) = delete;
+
+        /// listen on socket_name, and answer requests until one of
+        /// them is shutdown. An existing socket file is replaced.
+        /// Throws runtime_error if the socket can't be opened.
+        void serve(const std::string& socket_name);
+        /// the answer to a single request line, including the final
+        /// newline. Also used by serve().
+        std::string answer(const std::string& request);
+
+    private:
+        /// read requests from a client until it hangs up
+        void handle(int connection);
+        /// align a pair on the pool, and wait for the result
+        std::string align(const std::vector<std::string>& words);
+        /// wait until no shrink is pending, and count the request
+        void begin_request();
+        /// shrink the factory if it got too big and this was the
+        /// last running request
+        void end_request();
+        /// stop accepting connections, and hang up on the clients
+        void stop();
+        /// join the threads of the clients that hung up, called with
+        /// the mutex held
+        void reap();
+
+        const Params _params;
+        DictionaryFactory _dictionaries;
+        ThreadPool* _pool;
+        size_t _budget;
+        int _listener;
+        /// guards everything below
+        std::mutex _mutex;
+        std::condition_variable _idle;
+        /// the threads of the connections that aren't joined yet
+        std::map<std::thread::id, std::thread> _connections;
+        /// those of them that are done, and only need to be joined
+        std::vector<std::thread::id> _finished;
+        std::set<int> _open;
+        int _active;
+        bool _shrinking, _stopping;
+};
+
+/// send a request line to the server on socket_name, and return its
+/// answer. Throws runtime_error if the server can't be reached.
+std::string request(const std::string& socket_name,
+                    const std::string& line);
+}  // namespace Align
+
+#endif  // SERVER_H_
@@ -9,10 +9,11 @@
 
 #ifdef USE_ICU_STRING
 #include<ostream>
+#include<string>
 #include<unicode/unistr.h> // NOLINT[build/include_order]
 #include<unicode/uchar.h>  // NOLINT[build/include_order]
 
-typedef UnicodeString string_impl;
+typedef icu::UnicodeString string_impl;
 typedef UChar32 char_impl;
 typedef int string_size;
 
@@ -25,6 +26,20 @@ inline void extract(const string_impl& str, int from, int to, string_impl* out)
     { str.extractBetween(from, to, *out); }
 inline string_size string_find(const string_impl& me, const char* you)
     { return me.indexOf(you); }
+inline string_impl from_bytes(const char* bytes, size_t length)
+    { return string_impl(bytes, static_cast<int32_t>(length)); }
+inline std::string to_utf8(const string_impl& str)
+    { std::string out; str.toUTF8String(out); return out; }
+inline string_impl from_utf8(const char* bytes, size_t length) {
+    return string_impl::fromUTF8(
+            icu::StringPiece(bytes, static_cast<int32_t>(length)));
+}
+/// the character that starts at i, which may take two code units
+inline char_impl char_at(const string_impl& str, string_size i)
+    { return str.char32At(i); }
+/// where the character after the one at i starts
+inline string_size next_char(const string_impl& str, string_size i)
+    { return str.moveIndex32(i, 1); }
 
 inline bool check_if_alpha(char_impl c) {
     return u_isalpha(c);
@@ -56,6 +71,21 @@ inline void extract(const string_impl& str, int from, int to, string_impl* out)
 inline string_size string_find(const string_impl& me, const char* you)
     { return me.find(you); }
 
+inline string_impl from_bytes(const char* bytes, size_t length)
+    { return string_impl(bytes, length); }
+
+inline const std::string& to_utf8(const string_impl& str)
+    { return str; }
+
+inline string_impl from_utf8(const char* bytes, size_t length)
+    { return string_impl(bytes, length); }
+
+inline char_impl char_at(const string_impl& str, string_size i)
+    { return str[i]; }
+
+inline string_size next_char(const string_impl&, string_size i)
+    { return i + 1; }
+
 inline bool check_if_alpha(char_impl c) {
     return isalpha(c);
 }
@@ -72,7 +102,7 @@ inline void upper_case(char_impl* c) {
     string_impl s = "";
     s += *c;
     upper_case(&s);
-    *c = s[0];
+    *c = char_at(s, 0);
 }
 
 #endif  // STRING_IMPL_H_
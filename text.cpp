@@ -1,124 +1,279 @@
 // Copyright 2012 Florian Petran
 #include"text.h"
 #include<cctype>
+#include<climits>
+#include<cstdint>
+#include<cstring>
+#include<algorithm>
 #include<string>
-#include<list>
 #include<vector>
 #include<fstream>
 #include<ostream>
 #include<stdexcept>
 #include<utility>
+#include<unordered_map>
 
 #include"string_impl.h"
+#include"mapped_file.h"
 
 using std::string;
-using std::list;
+using std::vector;
 using std::ifstream;
+using std::ofstream;
 using std::pair;
+using std::make_pair;
 using std::out_of_range;
 using std::runtime_error;
 
 namespace Align {
 
-//////////////////////////////// base Word ////////////////////////////////////
+namespace {
+/// Header of a compiled text. The arrays follow it in the order
+/// tokens, type offsets, positions, string offsets, hash slots,
+/// strings - each of them padded to 8 bytes.
+struct CompiledHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t tokens;
+    uint32_t types;
+    uint32_t slots;
+    uint64_t string_bytes;
+    /// of the text file it was compiled from
+    FileStamp source;
+};
 
-Word::Word(const Text* text) {
-    _text = text;
+const char compiled_magic[4] = { 'P', 'A', 'L', 'C' };
+/// needs to be bumped whenever the layout or the hash function changes
+const uint32_t compiled_version = 2;
+const uint32_t compiled_byte_order = 0x01020304;
+
+/// check if the file starts with the magic of a compiled text
+inline bool is_compiled(const string& fname) {
+    return has_magic(fname, compiled_magic, sizeof(compiled_magic));
 }
 
-const Text& Word::get_text() const {
-    return *_text;
+/// check if a compiled text of this version was made from a text
+/// file with this stamp
+bool compiled_from(const string& compiled, const FileStamp& source) {
+    CompiledHeader header;
+    ifstream file(compiled, std::ios::binary);
+    return file.read(reinterpret_cast<char*>(&header), sizeof(header))
+        && std::memcmp(header.magic, compiled_magic,
+                       sizeof(header.magic)) == 0
+        && header.byte_order == compiled_byte_order
+        && header.version == compiled_version
+        && header.source == source;
 }
+}  // namespace
 
 /////////////////////////////// WordToken /////////////////////////////////////
 
-WordToken::WordToken(const Text* text,
-                     list<Sequence*> * seqs,
-                     const string_impl* s,
-                     const int pos, const WordType* type)
-    : Word(text)  {
-    _position = pos;
-    _string_realization = s;
-    _type = type;
-    _sequences = seqs;
-}
+WordToken::WordToken(const Text* text, const int pos)
+    : _text(text), _position(pos) {}
 
 bool WordToken::operator==(const WordToken& other) const {
     return
-           this->_type == other._type
+           this->_text == other._text
         && this->_position == other._position;
 }
 
-void WordToken::remove_from(const Sequence* seq) const {
-    auto si = _sequences->begin();
-    while (si != _sequences->end())
-        if (*si == seq)
-            si = _sequences->erase(si);
-        else
-            ++si;
+string_impl WordToken::get_str() const {
+    return get_type().get_str();
 }
 
-bool WordToken::close_to(const WordToken& other) const {
-    bool result =  this->_position != other._position
-                && abs(this->_position - other._position)
-                   <= Params::get().closeness();
-    if (Params::get().monotony())
-        return result && this->_position < other._position;
-    return result;
+bool WordToken::close_to(const WordToken& other,
+                         int closeness, bool monotony) const {
+    if (monotony)
+        return close_to<true>(other, closeness);
+    return close_to<false>(other, closeness);
 }
 
 /////////////////////////////// WordType //////////////////////////////////////
-WordType::WordType(const Text* text)
-    : Word(text), _frequency(0) {}
+WordType::WordType(const Text* text, type_id id)
+    : _text(text), _id(id) {}
 
-const WordType& WordType::add_token(const WordToken& token) {
-    _tokens.push_back(token);
-    ++_frequency;
-    return *this;
+string_impl WordType::get_str() const {
+    ByteRange str = _text->vocabulary().str(_id);
+    return from_utf8(str.data, str.size);
 }
 
-bool WordType::operator==(const WordType& other) const {
-    for (const WordToken& this_tok : this->_tokens)
-        for (const WordToken& other_tok : other._tokens)
-            if (this_tok.get_str() == other_tok.get_str())
-                return true;
-    return false;
+////////////////////////////////// Text ///////////////////////////////////////
+WordToken Text::at(int index) const {
+    if (index >= length() || index < 0)
+        throw out_of_range("Text lookup out of range");
+    return this->operator[](index);
 }
 
-////////////////////////////////// Text ///////////////////////////////////////
-const WordToken& Text::operator[](int index) const {
-    return std::vector<WordToken>::operator[](index);
+Text::Text(const string& fname, bool mapped) : _stamp() {
+    string compiled = compiled_name(fname);
+    // taken before the text is read, so that a compiled file made
+    // from it is out of date if the text changes meanwhile
+    bool exists = file_stamp(fname, &_stamp);
+
+    if (is_compiled(fname)) {
+        load(fname);
+    } else if (exists && compiled_from(compiled, _stamp)) {
+        load(compiled);
+    } else {
+        vector<type_id> tokens;
+        if (mapped)
+            map(fname, &tokens);
+        else
+            open(fname, &tokens);
+        index_types(&tokens);
+    }
+
+    _types.reserve(_vocabulary.size());
+    for (type_id id = 0; id < _vocabulary.size(); ++id)
+        _types.push_back(WordType(this, id));
+    _fname = fname;
 }
 
-const WordToken& Text::at(int index) const {
-    if (index >= _length || index < 0)
-        throw out_of_range("Text lookup out of range");
-    return this->operator[](index);
+size_t Text::memory_size() const {
+    return _tokens.size() * sizeof(type_id)
+         + _types.size() * sizeof(WordType)
+         + _positions.size() * sizeof(int)
+         + _type_offsets.size() * sizeof(int)
+         + _vocabulary.offsets()[_vocabulary.size()]
+         + (_vocabulary.size() + 1) * sizeof(uint32_t)
+         + _vocabulary.slot_count() * sizeof(type_id);
 }
 
-Text::Text(const string& fname) {
-    open(fname);
+string Text::compiled_name(const string& fname) {
+    return fname + ".palc";
 }
 
-Text::~Text() {
-    for (pair<const string_impl, string_impl*>& sp : string_ptrs)
-        delete sp.second;
+type_id Text::intern(const string_impl& word) {
+    const string& utf8 = to_utf8(word);
+    ByteRange str = { utf8.data(), utf8.size() };
+    return _vocabulary.intern(str);
+}
 
-    for (pair<const string_impl, WordType*>& wt : _types) {
-        for (const WordToken& tok : wt.second->get_tokens())
-            delete tok.get_sequences();
-        delete wt.second;
-    }
+type_id Text::find_type(const string_impl& word) const {
+    const string& utf8 = to_utf8(word);
+    ByteRange str = { utf8.data(), utf8.size() };
+    return _vocabulary.find(str);
 }
 
-void Text::open(const string& fname) {
+void Text::index_types(vector<type_id>* tokens) {
+    // counting sort of the positions by type id
+    vector<int> offsets(_vocabulary.size() + 1, 0);
+    for (type_id id : *tokens)
+        ++offsets[id + 1];
+    for (type_id id = 0; id < _vocabulary.size(); ++id)
+        offsets[id + 1] += offsets[id];
+
+    vector<int> positions(tokens->size());
+    vector<int> next(offsets.begin(), offsets.end() - 1);
+    for (size_t pos = 0; pos < tokens->size(); ++pos)
+        positions[next[(*tokens)[pos]]++] = pos;
+
+    _tokens.assign(tokens);
+    _type_offsets.assign(&offsets);
+    _positions.assign(&positions);
+}
+
+void Text::save(const string& fname) const {
+    ofstream file(fname, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+        throw runtime_error(string("Couldn't write compiled text: ") + fname);
+
+    CompiledHeader header;
+    std::memcpy(header.magic, compiled_magic, sizeof(header.magic));
+    header.version = compiled_version;
+    header.byte_order = compiled_byte_order;
+    header.tokens = length();
+    header.types = types();
+    header.slots = _vocabulary.slot_count();
+    header.string_bytes = _vocabulary.offsets()[types()];
+    header.source = _stamp;
+
+    write_array(&file, &header, 1);
+    write_array(&file, _tokens.data(), _tokens.size());
+    write_array(&file, _type_offsets.data(), _type_offsets.size());
+    write_array(&file, _positions.data(), _positions.size());
+    write_array(&file, _vocabulary.offsets(), types() + 1);
+    write_array(&file, _vocabulary.slots(), _vocabulary.slot_count());
+    write_array(&file, _vocabulary.buffer(), header.string_bytes);
+
+    if (!file)
+        throw runtime_error(string("Couldn't write compiled text: ") + fname);
+    file.close();
+}
+
+void Text::load(const string& fname) {
+    _compiled.reset(new MappedFile(fname));
+    const char* section = _compiled->data();
+
+    CompiledHeader header;
+    if (_compiled->size() < sizeof(header))
+        throw runtime_error(string("Not a compiled text: ") + fname);
+    std::memcpy(&header, section, sizeof(header));
+    if (std::memcmp(header.magic, compiled_magic, sizeof(header.magic)) != 0
+     || header.byte_order != compiled_byte_order)
+        throw runtime_error(string("Not a compiled text: ") + fname);
+    if (header.version != compiled_version)
+        throw runtime_error(string("Compiled text has the wrong version, "
+                                   "please recompile: ") + fname);
+
+    size_t expected_size = padded(sizeof(header))
+                         + 2 * padded(header.tokens * sizeof(int))
+                         + 2 * padded((header.types + 1) * sizeof(int))
+                         + padded(header.slots * sizeof(type_id))
+                         + padded(header.string_bytes);
+    if (_compiled->size() != expected_size
+     || header.slots == 0 || (header.slots & (header.slots - 1)) != 0)
+        throw runtime_error(string("Compiled text is corrupt: ") + fname);
+
+    section += padded(sizeof(header));
+    _tokens.attach(read_array<type_id>(&section, header.tokens),
+                   header.tokens);
+    _type_offsets.attach(read_array<int>(&section, header.types + 1),
+                         header.types + 1);
+    _positions.attach(read_array<int>(&section, header.tokens),
+                      header.tokens);
+    const uint32_t* string_offsets =
+        read_array<uint32_t>(&section, header.types + 1);
+    const type_id* slots = read_array<type_id>(&section, header.slots);
+    const char* strings = read_array<char>(&section, header.string_bytes);
+
+    // everything that is looked up through the arrays needs to be in
+    // range, so that a damaged file can't make us read past them
+    bool valid = header.types < header.slots
+              && header.tokens <= static_cast<uint32_t>(INT_MAX)
+              && valid_offsets(_type_offsets.data(), header.types + 1,
+                               header.tokens)
+              && valid_offsets(string_offsets, header.types + 1,
+                               header.string_bytes);
+    for (uint32_t token = 0; valid && token < header.tokens; ++token)
+        valid = _tokens[token] < header.types;
+    // the positions of each type are ascending, and have that type
+    for (type_id type = 0; valid && type < header.types; ++type)
+        for (int i = _type_offsets[type];
+             valid && i < _type_offsets[type + 1]; ++i)
+            valid = _positions[i] >= 0
+                 && static_cast<uint32_t>(_positions[i]) < header.tokens
+                 && _tokens[_positions[i]] == type
+                 && (i == _type_offsets[type]
+                  || _positions[i - 1] < _positions[i]);
+    for (uint32_t slot = 0; valid && slot < header.slots; ++slot)
+        valid = slots[slot] < header.types
+             || slots[slot] == Vocabulary::npos;
+    if (!valid)
+        throw runtime_error(string("Compiled text is corrupt: ") + fname);
+
+    _vocabulary.attach(strings, string_offsets, header.types,
+                       slots, header.slots);
+}
+
+void Text::open(const string& fname, vector<type_id>* tokens) {
     ifstream file;
 
     file.open(fname);
     if (!file.is_open())
         throw runtime_error(string("Text file not found: ") + fname);
 
-    int pos = 0;
     char c_line[256];
     while (!file.eof()) {
         file.getline(c_line, 256);
@@ -127,27 +282,43 @@ void Text::open(const string& fname) {
 
         lower_case(&line);
 
-        if (_types.find(line) == _types.end())
-            _types[line] = new WordType(this);
-        if (string_ptrs.find(line) == string_ptrs.end())
-            string_ptrs[line] = new string_impl(line);
-        list<Sequence*> *seqs = new list<Sequence*>();
-        WordToken tok = WordToken(this,
-                                  seqs,
-                                  string_ptrs[line],
-                                  pos,
-                                  _types[line]);
-        _types[line]->add_token(tok);
-        this->push_back(tok);
-
-        ++pos;
+        tokens->push_back(intern(line));
     }
 
-    _length = pos;
-    _fname = fname;
-
     file.clear();
     file.close();
 }
-}  // namespace Align
 
+void Text::map(const string& fname, vector<type_id>* tokens) {
+    MappedFile file(fname);
+    const char *begin = file.data(),
+               *end = begin + file.size();
+
+    // every line is a token, and like with the stream reader,
+    // a trailing newline yields a final empty token
+    tokens->reserve(std::count(begin, end, '\n') + 1);
+
+    // the lines are only normalized the first time a spelling is
+    // seen, after that, the spelling is looked up in this cache
+    std::unordered_map<ByteRange, type_id, ByteRangeHash> spellings;
+
+    const char* line = begin;
+    while (true) {
+        const char* eol = std::find(line, end, '\n');
+        ByteRange spelling = { line, static_cast<size_t>(eol - line) };
+
+        auto cached = spellings.find(spelling);
+        if (cached == spellings.end()) {
+            string_impl word = from_bytes(spelling.data, spelling.size);
+            lower_case(&word);
+            cached = spellings.insert(
+                        make_pair(spelling, intern(word))).first;
+        }
+        tokens->push_back(cached->second);
+
+        if (eol == end)
+            break;
+        line = eol + 1;
+    }
+}
+}  // namespace Align
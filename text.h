@@ -2,63 +2,60 @@
 // representations for texts, and word types and tokens
 #ifndef TEXT_H_
 #define TEXT_H_
+#include<cstddef>
+#include<functional>
+#include<memory>
 #include<string>
-#include<fstream>
-#include<list>
 #include<vector>
-#include<map>
 #include"string_impl.h"
 #include"params.h"
+#include"vocabulary.h"
+#include"mapped_file.h"
 
 namespace Align {
 
-class Sequence;
 class Text;
-
-/// Base class for WordToken and WordType.
-/** Takes care of the storage and access
- *  of the Text ptr via the derived class.
- **/
-class Word {
-    public:
-        const Text& get_text() const;
-        virtual ~Word() = default;
-        Word() = delete;
-
-    protected:
-        explicit Word(const Text*);
-        const Text* _text;
-};
-
 class WordType;
 
 /// A specific word at a specific position in the Text.
-/** Provides a check for closeness with another WordToken,
- *  and a the methods to remove them from a Sequence, or
- *  add them to a Sequence.
+/** Provides a check for closeness with another WordToken.
  *
  *  Also provides access to
  *  - the WordType, if needed.
  *  - the string realization of the WordToken.
- *  - All Sequence objects this WordToken is part of.
  *
- *  Since Sequence list, and string realization are both
- *  pointers, only Text class is allowed to construct
- *  WordToken objects, to ensure consistency and prevent
- *  leaks.
+ *  A WordToken is merely a handle for a position in a Text,
+ *  and cheap to copy. The Text itself only stores the type id
+ *  for each position. Only Text constructs WordToken objects.
  **/
-class WordToken : public Word {
+class WordToken {
     friend class Text;
     public:
         bool operator==(const WordToken&) const;
-        bool close_to(const WordToken& other) const;
-        void remove_from(const Sequence* seq) const;
+        /// whether other is at most closeness positions away, and,
+        /// if monotony is required, also behind this
+        bool close_to(const WordToken& other,
+                      int closeness, bool monotony) const;
+        /// close_to() for a monotony mode known at compile time.
+        /** Without branches, so that loops that are specialized on
+         *  the mode come down to integer compares.
+         **/
+        template<bool Monotone>
+        inline bool close_to(const WordToken& other, int closeness) const {
+            unsigned distance = other._position - _position,
+                     window = closeness > 0 ? closeness : 0;
+            if (Monotone)
+                return distance - 1 < window;
+            return (distance != 0) & (distance + window <= 2 * window);
+        }
 
-        inline const string_impl& get_str() const {
-            return *_string_realization;
+        inline const Text& get_text() const {
+            return *_text;
         }
-        operator string_impl() {
-            return *_string_realization;
+        /// the (lower cased) string realization
+        string_impl get_str() const;
+        operator string_impl() const {
+            return get_str();
         }
         inline int position() const {
             return _position;
@@ -69,122 +66,206 @@ class WordToken : public Word {
         inline bool operator<(const WordToken& other) const {
             return this->_position < other._position;
         }
-        inline const WordType& get_type() const {
-            return *_type;
-        }
-
-        inline void add_to_sequence(Sequence* seq) const {
-            _sequences->push_back(seq);
-        }
-
-        inline std::list<Sequence*>* get_sequences() const {
-            return _sequences;
-        }
+        inline type_id get_type_id() const;
+        inline const WordType& get_type() const;
 
     protected:
-        WordToken(const Text* txt,
-                  std::list<Sequence*>* seqs,
-                  const string_impl* str,
-                  int pos,
-                  const WordType* type);
-        WordToken();
+        WordToken(const Text* txt, int pos);
 
     private:
-        int _position = 0;
-        const WordType* _type;
-        const string_impl* _string_realization;
-        mutable std::list<Sequence*> *_sequences;
+        const Text* _text;
+        int _position;
 };
 
+/// hash WordToken by text and position
+struct WordTokenHash {
+    inline size_t operator()(const WordToken& tok) const {
+        return std::hash<const Text*>()(&tok.get_text())
+             ^ (static_cast<size_t>(tok.position()) * 2654435761U);
+    }
+};
+
+/// The positions of the tokens of a WordType, in text order.
+typedef ArrayRange<int> PositionRange;
+
 /// A set of WordToken in a particular text.
-/** Note that the WordToken objects do not necessarily have the
- *  same string realization, therefore we can't access that here
- *  directly.
+/** All tokens with the same (lower cased) string realization
+ *  belong to one type. Each type has a dense id in its Text.
  *
  *  Provide access to
  *  - frequency of its tokens (by amount of tokens associated with it).
- *  - all WordToken objects associated with this.
+ *  - the positions of all tokens associated with this.
  **/
-class WordType : public Word {
+class WordType {
     friend class Text;
     public:
-        inline const std::list<WordToken>& get_tokens() const {
-            return _tokens;
+        inline const Text& get_text() const {
+            return *_text;
         }
-        inline int frequency() const {
-            return _frequency;
+        inline type_id id() const {
+            return _id;
         }
-        inline bool operator<(const WordType& other) const {
-            // this may be a problem. what if a type doesn't have a
-            // token yet? XXX
-            // the reason for the comparison operator is inserting
-            // in maps as keys, which currently only happens in
-            // dictionaries, so for now, it should be okay. needs
-            // revising though.
-            return this->_tokens.front() < other._tokens.front();
+        inline PositionRange positions() const;
+        inline int frequency() const {
+            return positions().size();
         }
+        string_impl get_str() const;
 
-        /// test if ANY of the associated WordToken string
-        /// representations match
-        bool operator==(const WordType&) const;
+        /// types are the same if they have the same id in the same text
+        inline bool operator==(const WordType& other) const {
+            return _text == other._text && _id == other._id;
+        }
+        inline bool operator!=(const WordType& other) const {
+            return !(*this == other);
+        }
 
     protected:
-        explicit WordType(const Text*);
-        const WordType& add_token(const WordToken&);
+        WordType(const Text*, type_id);
 
     private:
-        std::list<WordToken> _tokens;
-        int _frequency;
+        const Text* _text;
+        type_id _id;
 };
 
 /// Represents a Text as container.
 /** Provide sequential and random access to WordToken and WordType
- *  objects.
- *  Also owns the pointers to the string realizations of WordToken.
- *  For this reason, the dtor can only be called by the Dictionary
- *  objects associated with this Text.
+ *  objects. The dtor can only be called by DictionaryFactory,
+ *  which owns all Text objects.
+ *
+ *  Internally, the types are interned in a Vocabulary, and the
+ *  text is stored as a flat array of type ids, plus the positions
+ *  of each type's tokens grouped by type.
+ *
+ *  The text file has one token per line. It can either be read
+ *  through a stream, or mapped into memory and split in place,
+ *  which only needs to normalize each distinct spelling once.
+ *
+ *  Alternatively, the Text can be compiled with save(). The
+ *  compiled file holds the vocabulary, and the token and position
+ *  arrays, so loading it is just mapping it into memory. If a
+ *  compiled file exists next to the text file under
+ *  compiled_name(), and was made from the text file at its current
+ *  size and modification time, it is used instead of the text file.
  **/
-class Text : private std::vector<WordToken> {
-    friend class Dictionary;
+class Text {
     friend class DictionaryFactory;
     public:
         Text() = delete;
         Text(const Text&) = delete;
         const Text& operator=(const Text&) = delete;
 
-        const WordToken& operator[](int pos) const;
-        const WordToken& at(int pos) const;
+        inline WordToken operator[](int pos) const {
+            return WordToken(this, pos);
+        }
+        WordToken at(int pos) const;
         inline int length() const {
-            return _length;
+            return _tokens.size();
         }
         inline const std::string& filename() const {
             return _fname;
         }
+        /// approximate number of bytes taken by the text, whether
+        /// it is mapped or not
+        size_t memory_size() const;
 
-        /// access is provided via a const_iterator, since
+        /// number of distinct types in the text
+        inline type_id types() const {
+            return _types.size();
+        }
+        inline const WordType& type(type_id id) const {
+            return _types[id];
+        }
+        inline type_id type_at(int pos) const {
+            return _tokens[pos];
+        }
+        /// find the type for a lower cased string, or
+        /// Vocabulary::npos if it doesn't occur in the text
+        type_id find_type(const string_impl&) const;
+        inline const Vocabulary& vocabulary() const {
+            return _vocabulary;
+        }
+
+        /// write the compiled text to a file
+        void save(const std::string& fname) const;
+        /// name of the compiled file for a text file
+        static std::string compiled_name(const std::string& fname);
+
+        /// access is provided via a const iterator, since
         /// we don't expect to change the text at any point.
-        typedef std::vector<WordToken>::const_iterator iterator;
+        class iterator {
+            public:
+                iterator(const Text* text, int pos)
+                    : _text(text), _pos(pos) {}
+                inline WordToken operator*() const {
+                    return (*_text)[_pos];
+                }
+                inline iterator& operator++() {
+                    ++_pos;
+                    return *this;
+                }
+                inline bool operator==(const iterator& other) const {
+                    return _pos == other._pos && _text == other._text;
+                }
+                inline bool operator!=(const iterator& other) const {
+                    return !(*this == other);
+                }
+            private:
+                const Text* _text;
+                int _pos;
+        };
         inline Text::iterator begin() const {
-            return std::vector<WordToken>::cbegin();
+            return iterator(this, 0);
         }
         inline Text::iterator end() const {
-            return std::vector<WordToken>::cend();
+            return iterator(this, length());
         }
 
     protected:
-        explicit Text(const std::string&);
-        ~Text();
-        std::map<string_impl, WordType*> _types;
+        explicit Text(const std::string&, bool mapped = false);
+        ~Text() = default;
 
     private:
-        void open(const std::string&);
+        friend class WordType;
+
+        /// read the text through an ifstream
+        void open(const std::string&, std::vector<type_id>* tokens);
+        /// read the text from a memory mapping of the file
+        void map(const std::string&, std::vector<type_id>* tokens);
+        /// map a compiled text
+        void load(const std::string&);
+        /// get the type id for a lower cased string, add it if needed
+        type_id intern(const string_impl&);
+        /// group token positions by type, once all tokens are read
+        void index_types(std::vector<type_id>* tokens);
 
         std::string _fname;
-        /// these are copied between tokens, but owned by Text
-        std::map<string_impl, string_impl*> string_ptrs;
-        int _length;
+        /// of the text file when it was read, kept by save()
+        FileStamp _stamp;
+        Vocabulary _vocabulary;
+        /// type id for each position
+        FlatArray<type_id> _tokens;
+        std::vector<WordType> _types;
+        /// token positions, grouped by type
+        FlatArray<int> _positions;
+        /// start of each type in _positions, plus the end of the last
+        FlatArray<int> _type_offsets;
+        /// the compiled file, if the text was loaded from one
+        std::unique_ptr<MappedFile> _compiled;
 };
+
+inline type_id WordToken::get_type_id() const {
+    return _text->type_at(_position);
+}
+
+inline const WordType& WordToken::get_type() const {
+    return _text->type(get_type_id());
+}
+
+inline PositionRange WordType::positions() const {
+    return PositionRange(_text->_positions.data() + _text->_type_offsets[_id],
+                         _text->_positions.data()
+                       + _text->_type_offsets[_id + 1]);
+}
 }  // namespace Align
 
 #endif  // TEXT_H_
-
@@ -1,17 +1,30 @@
 // Copyright 2012 Florian Petran
+#include<algorithm>
+#include<cstdlib>
+#include<cstdio>
+#include<cstring>
 #include<fstream>
+#include<iterator>
 #include<list>
+#include<set>
 #include<string>
+#include<thread>
+#include<utility>
+#include<vector>
 #include<gtest/gtest.h> // NOLINT[build/include_order]
 #include"align_config.h"
 #include"text.h"
 #include"dictionary.h"
+#include"context.h"
 
 // fixture for all texts
 class WordTest_Fixture : public testing::Test {
     protected:
         virtual void SetUp() {
-            params->set_dict_base(ALIGN_TEST_DICT);
+            Align::Params params;
+            params.set_dict_base(ALIGN_TEST_DICT);
+            context = new Align::AlignContext(params);
+            df = &context->dictionaries();
             _dict = df->get_dictionary(ALIGN_TEST_E, ALIGN_TEST_F);
 
             _e = _dict->get_e();
@@ -21,7 +34,7 @@ class WordTest_Fixture : public testing::Test {
             f_first = get_first_line(ALIGN_TEST_F);
         }
         virtual void TearDown() {
-            // called after each test
+            delete context;
         }
 
         /// get first line from a file
@@ -40,8 +53,8 @@ class WordTest_Fixture : public testing::Test {
         }
 
         // Objects declared here can be used by all tests
-        Align::Params* params = Align::Params::get();
-        Align::DictionaryFactory* df = Align::DictionaryFactory::get_instance();
+        Align::AlignContext* context;
+        Align::DictionaryFactory* df;
 
         /// first lines from e and f, read conventionally
         string_impl f_first, e_first;
@@ -53,6 +66,33 @@ class WordTest_Fixture : public testing::Test {
 class WordTest : public WordTest_Fixture {
 };
 
+/// Text with public ctor, to compare the loaders directly
+class LoaderText : public Align::Text {
+    public:
+        LoaderText(const std::string& fname, bool mapped)
+            : Align::Text(fname, mapped) {}
+};
+
+/// Dictionary with public ctor, to compare the loaders directly
+class LoaderDictionary : public Align::Dictionary {
+    public:
+        LoaderDictionary(const std::string& fname,
+                         Align::Text* e, Align::Text* f) {
+            set_texts(e, f);
+            open(fname);
+        }
+};
+
+/// Dictionary that is made from the one for the opposite direction
+class TransposedDictionary : public Align::Dictionary {
+    public:
+        TransposedDictionary(const Align::Dictionary& forward,
+                             Align::Text* e, Align::Text* f) {
+            set_texts(e, f);
+            transpose(forward);
+        }
+};
+
 TEST_F(WordTest, Comparison) {
     // test comparison operator
     // self equality
@@ -77,6 +117,22 @@ TEST_F(WordTest, Comparison) {
     EXPECT_TRUE(&tok_e1.get_type() == &tok_e2.get_type());
 }
 
+TEST_F(WordTest, Closeness) {
+    int middle = _e->length() / 2;
+    Align::WordToken tok = _e->at(middle);
+    for (int closeness = -1; closeness <= 5; ++closeness)
+        for (int pos = 0; pos < _e->length(); ++pos) {
+            Align::WordToken other = _e->at(pos);
+            int distance = pos - middle;
+            bool close = distance != 0 && std::abs(distance) <= closeness;
+            EXPECT_EQ(close, tok.close_to<false>(other, closeness));
+            EXPECT_EQ(close && distance > 0,
+                      tok.close_to<true>(other, closeness));
+            EXPECT_EQ(close, tok.close_to(other, closeness, false));
+            EXPECT_EQ(close && distance > 0,
+                      tok.close_to(other, closeness, true));
+        }
+}
 
 TEST_F(WordTest, ReadCorrect) {
     // test if the first word from texts were read correctly from the file
@@ -102,18 +158,346 @@ TEST_F(WordTest, LookupTest) {
     Align::WordToken tok_e1 = _e->at(8),
                      tok_e2 = _e->at(17);
 
-    const std::list<Align::WordType> &trans1 = _dict->lookup(tok_e1),
-                                     &trans2 = _dict->lookup(tok_e2);
+    Align::TranslationRange trans1 = _dict->lookup(tok_e1),
+                            trans2 = _dict->lookup(tok_e2);
     int num_trans_1 = 0;
-    for (const Align::WordType& tr_type : trans1)
-        num_trans_1 += tr_type.get_tokens().size();
+    for (Align::type_id tr_type : trans1)
+        num_trans_1 += _f->type(tr_type).frequency();
     int num_trans_2 = 0;
-    for (const Align::WordType& tr_type : trans2)
-        num_trans_2 += tr_type.get_tokens().size();
+    for (Align::type_id tr_type : trans2)
+        num_trans_2 += _f->type(tr_type).frequency();
 
     EXPECT_EQ(3, num_trans_1);
     EXPECT_EQ(3, num_trans_2);
-    EXPECT_EQ(trans1, trans2);
+    ASSERT_EQ(trans1.size(), trans2.size());
+    EXPECT_TRUE(std::equal(trans1.begin(), trans1.end(), trans2.begin()));
+}
+
+TEST_F(WordTest, DictionaryEntries) {
+    // every word in e has either no entry, or entries without
+    // duplicates that are all found in f
+    for (const Align::WordToken& tok : *_e) {
+        Align::TranslationRange trans = _dict->lookup(tok);
+        if (!_dict->has(tok)) {
+            EXPECT_TRUE(trans.empty());
+            continue;
+        }
+        std::set<Align::type_id> unique(trans.begin(), trans.end());
+        EXPECT_EQ(trans.size(), unique.size());
+        for (Align::type_id tr_type : trans)
+            EXPECT_LT(tr_type, _f->types());
+    }
+}
+
+TEST_F(WordTest, TypeIds) {
+    // positions of a type should map back to the type, and
+    // the frequencies should add up to the text length
+    int tokens = 0;
+    for (Align::type_id id = 0; id < _f->types(); ++id) {
+        const Align::WordType& type = _f->type(id);
+        for (int pos : type.positions())
+            EXPECT_EQ(id, _f->at(pos).get_type_id());
+        tokens += type.frequency();
+    }
+    EXPECT_EQ(_f->length(), tokens);
+
+    // pegraben occurs at 17 and 25
+    EXPECT_EQ(2, _f->at(17).get_type().frequency());
+    EXPECT_EQ(_f->at(17).get_type_id(),
+              _f->find_type(_f->at(25).get_str()));
+}
+
+TEST_F(WordTest, MappedLoader) {
+    // the mapped loader should produce the same tokens and types
+    // as the stream reader
+    LoaderText streamed(ALIGN_TEST_F, false),
+               mapped(ALIGN_TEST_F, true);
+
+    ASSERT_EQ(streamed.length(), mapped.length());
+    for (int i = 0; i < streamed.length(); ++i) {
+        EXPECT_TRUE(streamed[i].get_str() == mapped[i].get_str());
+        EXPECT_EQ(streamed[i].get_type().frequency(),
+                  mapped[i].get_type().frequency());
+        EXPECT_EQ(&mapped, &mapped[i].get_text());
+    }
+    // same strings should share their type
+    EXPECT_EQ(&mapped.at(17).get_type(), &mapped.at(25).get_type());
+}
+
+TEST_F(WordTest, CompiledText) {
+    // a compiled text should load with the same tokens and types,
+    // and the same vocabulary lookups
+    const char* compiled_name = "test_f.txt.palc";
+    _f->save(compiled_name);
+    LoaderText compiled(compiled_name, true);
+
+    ASSERT_EQ(_f->length(), compiled.length());
+    ASSERT_EQ(_f->types(), compiled.types());
+    for (int i = 0; i < _f->length(); ++i) {
+        EXPECT_EQ(_f->at(i).get_type_id(), compiled[i].get_type_id());
+        EXPECT_TRUE(_f->at(i).get_str() == compiled[i].get_str());
+    }
+    for (Align::type_id id = 0; id < compiled.types(); ++id) {
+        EXPECT_EQ(id, compiled.find_type(compiled.type(id).get_str()));
+        EXPECT_EQ(_f->type(id).frequency(), compiled.type(id).frequency());
+    }
+    EXPECT_EQ(Align::Vocabulary::npos, compiled.find_type("not in f"));
+
+    std::remove(compiled_name);
+}
+
+TEST_F(WordTest, StaleCompiledText) {
+    // a text that changes right after it was compiled, within the
+    // same second, isn't loaded from the compiled file anymore
+    const char* text_name = "stale_test.txt";
+    const std::string compiled_name = Align::Text::compiled_name(text_name);
+    std::ofstream(text_name) << "aa\nbb";
+    LoaderText(text_name, false).save(compiled_name);
+    std::ofstream(text_name) << "cc\ndd\nee";
+
+    LoaderText text(text_name, false);
+    ASSERT_EQ(3, text.length());
+    EXPECT_TRUE(text.at(0).get_str() == "cc");
+
+    std::remove(text_name);
+    std::remove(compiled_name.c_str());
+}
+
+namespace {
+/// a copy of a compiled file with the 32 bit value at offset changed
+void corrupt_copy(const std::string& fname, const std::string& copy,
+                  size_t offset, uint32_t value) {
+    std::ifstream file(fname, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)),
+                        std::istreambuf_iterator<char>());
+    ASSERT_LE(offset + sizeof(value), content.size());
+    std::memcpy(&content[offset], &value, sizeof(value));
+    std::ofstream(copy, std::ios::binary) << content;
+}
+}  // namespace
+
+TEST_F(WordTest, CorruptCompiledText) {
+    const char* text_name = "corrupt_test.txt";
+    const std::string compiled_name = Align::Text::compiled_name(text_name),
+                      corrupt_name = "corrupt_test.palc";
+    std::ofstream(text_name) << "aa\nbb\naa";
+    LoaderText(text_name, false).save(compiled_name);
+    LoaderText(compiled_name, false);
+
+    // the sections of the 3 tokens and 2 types follow the header of 56
+    // bytes, each padded to 8 bytes: tokens, type offsets, positions,
+    // string offsets, hash slots
+    const size_t tokens = 56, type_offsets = 72, positions = 88,
+                 string_offsets = 104, slots = 120;
+    const std::vector<std::pair<size_t, uint32_t>> damages = {
+        { tokens + 4, 2 },            // a type id that doesn't exist
+        { type_offsets + 4, 4 },      // past the tokens
+        { type_offsets + 8, 2 },      // not all positions
+        { positions, 1 },             // not a position of the type
+        { positions + 4, 3 },         // past the tokens
+        { string_offsets + 4, 5 },    // past the strings
+        { string_offsets, 1 },        // not from the start
+        { slots + 4, 7 },             // neither a type nor empty
+    };
+    for (const std::pair<size_t, uint32_t>& damage : damages) {
+        corrupt_copy(compiled_name, corrupt_name,
+                     damage.first, damage.second);
+        EXPECT_THROW(LoaderText(corrupt_name, false), std::runtime_error)
+            << "offset " << damage.first;
+    }
+
+    std::remove(text_name);
+    std::remove(compiled_name.c_str());
+    std::remove(corrupt_name.c_str());
+}
+
+TEST_F(WordTest, CorruptCompiledDictionary) {
+    const char* dict_name = "corrupt_test.dictionary";
+    const std::string compiled_name =
+        Align::Dictionary::compiled_name(dict_name),
+                      corrupt_name = "corrupt_test.pald";
+    std::ofstream(dict_name) << "### test_e.txt = test_f.txt\n"
+                             << "aa = ba\naa = bb\ncc = ba\n";
+    Align::Dictionary::compile(dict_name, compiled_name);
+    LoaderDictionary(compiled_name, df->get_text(ALIGN_TEST_E),
+                     df->get_text(ALIGN_TEST_F));
+
+    // the sections of the 2 e words, 2 f words and 3 entries follow the
+    // header of 64 bytes, each padded to 8 bytes: e string offsets, f
+    // string offsets, entry offsets, targets, ranks
+    const size_t e_offsets = 64, f_offsets = 80, offsets = 96,
+                 targets = 112, ranks = 128;
+    const std::vector<std::pair<size_t, uint32_t>> damages = {
+        { e_offsets, 1 },             // not from the start
+        { e_offsets + 4, 9 },         // past the e strings
+        { f_offsets + 8, 5 },         // past the f strings
+        { offsets + 4, 4 },           // past the entries
+        { offsets + 8, 2 },           // not all entries
+        { targets + 8, 2 },           // an f word that doesn't exist
+        { ranks + 4, 3 },             // past the entries
+    };
+    for (const std::pair<size_t, uint32_t>& damage : damages) {
+        corrupt_copy(compiled_name, corrupt_name,
+                     damage.first, damage.second);
+        EXPECT_THROW(LoaderDictionary(corrupt_name,
+                                      df->get_text(ALIGN_TEST_E),
+                                      df->get_text(ALIGN_TEST_F)),
+                     std::runtime_error)
+            << "offset " << damage.first;
+    }
+
+    std::remove(dict_name);
+    std::remove(compiled_name.c_str());
+    std::remove(corrupt_name.c_str());
+}
+
+TEST_F(WordTest, StaleCompiledDictionary) {
+    // a dictionary that changes right after it was compiled, within
+    // the same second, isn't loaded from the compiled file anymore
+    const char* dict_name = "stale_test.dictionary";
+    const std::string compiled_name =
+        Align::Dictionary::compiled_name(dict_name);
+    std::ofstream(dict_name) << "### test_e.txt = test_f.txt\naa = ba\n";
+    Align::Dictionary::compile(dict_name, compiled_name);
+    std::ofstream(dict_name) << "### test_e.txt = test_f.txt\n"
+                             << "ab = bc\nab = bq\n";
+
+    LoaderDictionary dict(dict_name, df->get_text(ALIGN_TEST_E),
+                          df->get_text(ALIGN_TEST_F));
+    for (const Align::WordToken& tok : *_e)
+        EXPECT_EQ(tok.get_str() == "ab", dict.has(tok));
+
+    std::remove(dict_name);
+    std::remove(compiled_name.c_str());
+}
+
+TEST_F(WordTest, DictionaryIndex) {
+    // both directions are in the index, and each is found
+    // by the exact pair of text names
+    const Align::Dictionary* rev =
+        df->get_dictionary(ALIGN_TEST_F, ALIGN_TEST_E);
+    EXPECT_EQ(_f, rev->get_e());
+    EXPECT_EQ(_e, rev->get_f());
+    EXPECT_EQ(_dict, df->get_dictionary(ALIGN_TEST_E, ALIGN_TEST_F));
+    EXPECT_EQ(rev, _dict->reverse());
+    EXPECT_EQ(_dict, rev->reverse());
+    EXPECT_THROW(df->get_dictionary(ALIGN_TEST_E, ALIGN_TEST_E),
+                 std::runtime_error);
+}
+
+TEST_F(WordTest, ConcurrentRequests) {
+    // threads that request the same objects get the same ones, while
+    // the factory reads them without holding its lock
+    Align::Params params;
+    params.set_dict_base(ALIGN_TEST_DICT);
+    Align::DictionaryFactory factory(params);
+    const size_t threads = 8;
+    std::vector<const Align::Dictionary*> forward(threads),
+                                          backward(threads);
+    std::vector<const Align::Text*> texts(threads);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i)
+        workers.push_back(std::thread([&, i]() {
+            if (i % 2 == 0)
+                forward[i] = factory.get_dictionary(ALIGN_TEST_E,
+                                                    ALIGN_TEST_F);
+            backward[i] = factory.get_dictionary(ALIGN_TEST_F,
+                                                 ALIGN_TEST_E);
+            forward[i] = factory.get_dictionary(ALIGN_TEST_E,
+                                                ALIGN_TEST_F);
+            texts[i] = factory.get_text(ALIGN_TEST_E);
+        }));
+    for (std::thread& worker : workers)
+        worker.join();
+
+    for (size_t i = 0; i < threads; ++i) {
+        EXPECT_EQ(forward[0], forward[i]);
+        EXPECT_EQ(backward[0], backward[i]);
+        EXPECT_EQ(forward[0]->get_e(), texts[i]);
+    }
+    EXPECT_EQ(backward[0], forward[0]->reverse());
+    EXPECT_EQ(forward[0], backward[0]->reverse());
+    EXPECT_EQ(forward[0]->get_f(), backward[0]->get_e());
+}
+
+TEST_F(WordTest, TransposedDictionary) {
+    // the test dictionaries mirror each other, so the reverse made
+    // from the forward one should have the same entries in the same
+    // order as the file
+    const Align::Dictionary* rev =
+        df->get_dictionary(ALIGN_TEST_F, ALIGN_TEST_E);
+    LoaderDictionary from_file(std::string(ALIGN_TEST_DICT)
+                               + "test-r.dictionary",
+                               df->get_text(ALIGN_TEST_F),
+                               df->get_text(ALIGN_TEST_E));
+
+    for (const Align::WordToken& tok : *_f) {
+        Align::TranslationRange expected = from_file.lookup(tok),
+                                actual = rev->lookup(tok);
+        EXPECT_EQ(from_file.has(tok), rev->has(tok));
+        ASSERT_EQ(expected.size(), actual.size());
+        EXPECT_TRUE(std::equal(expected.begin(), expected.end(),
+                               actual.begin()));
+    }
+}
+
+TEST_F(WordTest, TransposedDictionaryOrder) {
+    // the lines neither follow the type ids of the words nor are they
+    // grouped by them, and the reverse file mirrors them line by line
+    std::ofstream("transpose_e.txt") << "b\na";
+    std::ofstream("transpose_f.txt") << "y\nx";
+    std::ofstream("transpose.dictionary")
+        << "### e = f\na = x\nb = y\nb = x\na = y\n";
+    std::ofstream("transpose-r.dictionary")
+        << "### f = e\nx = a\ny = b\nx = b\ny = a\n";
+    Align::Dictionary::compile("transpose.dictionary", "transpose.pald");
+
+    {
+        LoaderText e_text("transpose_e.txt", false),
+                   f_text("transpose_f.txt", false);
+        LoaderDictionary from_file("transpose-r.dictionary",
+                                   &f_text, &e_text);
+        for (const char* forward_name : { "transpose.dictionary",
+                                          "transpose.pald" }) {
+            LoaderDictionary forward(forward_name, &e_text, &f_text);
+            TransposedDictionary rev(forward, &f_text, &e_text);
+            for (const Align::WordToken& tok : f_text) {
+                Align::TranslationRange expected = from_file.lookup(tok),
+                                        actual = rev.lookup(tok);
+                ASSERT_EQ(2, expected.size());
+                ASSERT_EQ(expected.size(), actual.size());
+                EXPECT_TRUE(std::equal(expected.begin(), expected.end(),
+                                       actual.begin()));
+            }
+        }
+    }
+
+    for (const char* name : { "transpose_e.txt", "transpose_f.txt",
+                              "transpose.dictionary",
+                              "transpose-r.dictionary", "transpose.pald" })
+        std::remove(name);
+}
+
+TEST_F(WordTest, CompiledDictionary) {
+    // a compiled dictionary should have the same entries in the same
+    // order as the dictionary file
+    const char* compiled_name = "test.dictionary.pald";
+    Align::Dictionary::compile(std::string(ALIGN_TEST_DICT)
+                               + "test.dictionary", compiled_name);
+    LoaderDictionary compiled(compiled_name,
+                              df->get_text(ALIGN_TEST_E),
+                              df->get_text(ALIGN_TEST_F));
+
+    for (const Align::WordToken& tok : *_e) {
+        Align::TranslationRange expected = _dict->lookup(tok),
+                                actual = compiled.lookup(tok);
+        EXPECT_EQ(_dict->has(tok), compiled.has(tok));
+        ASSERT_EQ(expected.size(), actual.size());
+        EXPECT_TRUE(std::equal(expected.begin(), expected.end(),
+                               actual.begin()));
+    }
+
+    std::remove(compiled_name);
 }
 
 int main(int argc, char** argv) {
@@ -0,0 +1,96 @@
+// Copyright 2013 Florian Petran
+#include"thread_pool.h"
+
+#include<functional>
+#include<mutex>
+#include<thread>
+
+namespace Align {
+
+namespace {
+/// the pool of the current thread, if it is a worker
+thread_local const ThreadPool* current_pool = nullptr;
+/// the index of the current worker in its pool
+thread_local size_t current_index = 0;
+}  // namespace
+
+ThreadPool::ThreadPool(size_t threads)
+    : _next(0), _queued(0), _done(false) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    // hardware_concurrency() may not know
+    if (threads == 0)
+        threads = 1;
+    for (size_t i = 0; i < threads; ++i)
+        _queues.emplace_back(new Queue());
+    for (size_t i = 0; i < threads; ++i)
+        _workers.push_back(std::thread(&ThreadPool::work, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done = true;
+    }
+    _ready.notify_all();
+    for (std::thread& worker : _workers)
+        worker.join();
+}
+
+void ThreadPool::push(std::function<void()> task) {
+    size_t index = current_pool == this
+                 ? current_index
+                 : _next++ % _queues.size();
+    // counted first, so that the count is never too low
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_queued;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+        _queues[index]->tasks.push_back(std::move(task));
+    }
+    _ready.notify_one();
+}
+
+bool ThreadPool::run_one() {
+    size_t own = current_pool == this ? current_index : 0;
+    std::function<void()> task;
+    for (size_t i = 0; i < _queues.size() && !task; ++i) {
+        Queue& queue = *_queues[(own + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+        if (i == 0 && current_pool == this) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        --_queued;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::work(size_t index) {
+    current_pool = this;
+    current_index = index;
+    while (true) {
+        if (run_one())
+            continue;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_done && _queued == 0)
+            _ready.wait(lock);
+        if (_done && _queued == 0)
+            return;
+    }
+}
+}  // namespace Align
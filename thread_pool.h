@@ -0,0 +1,99 @@
+// Copyright 2013 Florian Petran
+// a fixed size pool of worker threads
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+#include<atomic>
+#include<chrono>
+#include<condition_variable>
+#include<deque>
+#include<functional>
+#include<future>
+#include<memory>
+#include<mutex>
+#include<thread>
+#include<vector>
+
+namespace Align {
+
+/// A fixed number of threads sharing the work on tasks.
+/** Every thread has a deque of its own. Tasks that a worker submits
+ *  go to the back of its deque, other tasks are dealt out to the
+ *  workers in turn. A worker takes its next task from the back of its
+ *  own deque, and steals from the front of the others' once that is
+ *  empty. So the parts of a task that splits itself up stay with
+ *  the worker, unless another one is idle and takes them over.
+ *
+ *  A thread that needs the result of another task should wait() for
+ *  it, which runs queued tasks in the meantime, instead of blocking
+ *  a worker. The futures returned by submit() give the result of a
+ *  task, or rethrow the exception it threw. The destructor finishes
+ *  all tasks that were submitted before joining the threads.
+ **/
+class ThreadPool {
+    public:
+        /// start the threads - 0 means one per hardware thread
+        explicit ThreadPool(size_t threads = 0);
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        const ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /// queue a callable without arguments
+        template<typename Task>
+        std::future<typename std::result_of<Task()>::type>
+            submit(Task task);
+        /// wait until the result is there, running other tasks
+        /// in the meantime
+        template<typename T>
+        void wait(const std::future<T>& result);
+
+        inline size_t size() const {
+            return _workers.size();
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        void push(std::function<void()> task);
+        /// run a queued task, if there is one
+        bool run_one();
+        void work(size_t index);
+
+        std::vector<std::unique_ptr<Queue>> _queues;
+        std::vector<std::thread> _workers;
+        /// the queue that the next task from outside goes to
+        std::atomic<size_t> _next;
+        /// guards _queued and _done, to let idle workers sleep
+        std::mutex _mutex;
+        std::condition_variable _ready;
+        /// tasks that were pushed and not taken yet - may be
+        /// higher than that for a moment, but never lower
+        size_t _queued;
+        bool _done;
+};
+
+template<typename Task>
+std::future<typename std::result_of<Task()>::type>
+ThreadPool::submit(Task task) {
+    typedef typename std::result_of<Task()>::type result_type;
+    // std::function needs to be copyable, the packaged_task isn't
+    std::shared_ptr<std::packaged_task<result_type()>> packaged
+        = std::make_shared<std::packaged_task<result_type()>>(task);
+    std::future<result_type> result = packaged->get_future();
+    push([packaged]() { (*packaged)(); });
+    return result;
+}
+
+template<typename T>
+void ThreadPool::wait(const std::future<T>& result) {
+    while (result.wait_for(std::chrono::seconds(0))
+            != std::future_status::ready)
+        // the task is running somewhere else, give it some time
+        if (!run_one())
+            result.wait_for(std::chrono::milliseconds(1));
+}
+}  // namespace Align
+
+#endif  // THREAD_POOL_H_
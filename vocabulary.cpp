@@ -0,0 +1,82 @@
+// Copyright 2013 Florian Petran
+#include"vocabulary.h"
+
+#include<vector>
+#include<stdexcept>
+
+namespace Align {
+
+const type_id Vocabulary::npos;
+
+Vocabulary::Vocabulary()
+    : _size(0), _attached(false),
+      _owned_offsets(1, 0), _owned_slots(1024, npos) {
+    use_owned();
+}
+
+void Vocabulary::use_owned() {
+    _buffer = _owned_buffer.data();
+    _offsets = _owned_offsets.data();
+    _slots = _owned_slots.data();
+    _slot_count = _owned_slots.size();
+    _size = _owned_offsets.size() - 1;
+}
+
+void Vocabulary::attach(const char* buffer, const uint32_t* offsets,
+                        type_id size, const type_id* slots,
+                        size_t slot_count) {
+    _owned_buffer.clear();
+    _owned_offsets.clear();
+    _owned_slots.clear();
+
+    _buffer = buffer;
+    _offsets = offsets;
+    _size = size;
+    _slots = slots;
+    _slot_count = slot_count;
+    _attached = true;
+}
+
+size_t Vocabulary::probe(const ByteRange& str) const {
+    size_t mask = _slot_count - 1,
+           slot = ByteRangeHash()(str) & mask;
+    // linear probing - load factor is kept at or below 1/2
+    while (_slots[slot] != npos && this->str(_slots[slot]) != str)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+type_id Vocabulary::find(const ByteRange& str) const {
+    return _slots[probe(str)];
+}
+
+type_id Vocabulary::intern(const ByteRange& str) {
+    size_t slot = probe(str);
+    if (_slots[slot] != npos)
+        return _slots[slot];
+    if (_attached)
+        throw std::logic_error("Can't add to an attached vocabulary");
+
+    type_id id = size();
+    _owned_buffer.insert(_owned_buffer.end(), str.data, str.data + str.size);
+    _owned_offsets.push_back(_owned_buffer.size());
+    _owned_slots[slot] = id;
+    use_owned();
+
+    if (2 * size() > _slot_count)
+        grow();
+    return id;
+}
+
+void Vocabulary::grow() {
+    _owned_slots.assign(2 * _owned_slots.size(), npos);
+    size_t mask = _owned_slots.size() - 1;
+    for (type_id id = 0; id < size(); ++id) {
+        size_t slot = ByteRangeHash()(str(id)) & mask;
+        while (_owned_slots[slot] != npos)
+            slot = (slot + 1) & mask;
+        _owned_slots[slot] = id;
+    }
+    use_owned();
+}
+}  // namespace Align
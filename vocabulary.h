@@ -0,0 +1,93 @@
+// Copyright 2013 Florian Petran
+// interned strings for word types
+#ifndef VOCABULARY_H_
+#define VOCABULARY_H_
+#include<cstdint>
+#include<vector>
+#include"mapped_file.h"
+
+namespace Align {
+
+/// dense integer id of a word type in a Text
+typedef uint32_t type_id;
+
+/// A set of strings, each identified by a dense integer id.
+/** Ids are handed out in order of first insertion, starting at 0.
+ *  The strings are stored back to back in a single buffer, and
+ *  looked up through an open addressing hash table of ids, so
+ *  interning a known string doesn't allocate anything.
+ *
+ *  The strings are raw bytes as far as the Vocabulary is concerned,
+ *  Text stores the UTF-8 of its lower cased types in here.
+ *
+ *  Instead of building the tables, a Vocabulary can also attach to
+ *  tables that were built earlier and written to a file, see
+ *  Text::save(). It is read-only then.
+ **/
+class Vocabulary {
+    public:
+        /// returned by find() for unknown strings
+        static const type_id npos = UINT32_MAX;
+
+        Vocabulary();
+        Vocabulary(const Vocabulary&) = delete;
+        const Vocabulary& operator=(const Vocabulary&) = delete;
+
+        /// get the id for the string, add it if it isn't known yet
+        type_id intern(const ByteRange& str);
+        /// get the id for the string, or npos
+        type_id find(const ByteRange& str) const;
+
+        inline ByteRange str(type_id id) const {
+            ByteRange range = { _buffer + _offsets[id],
+                                _offsets[id + 1] - _offsets[id] };
+            return range;
+        }
+        inline type_id size() const {
+            return _size;
+        }
+
+        /// use tables that are owned by someone else. buffer has
+        /// offsets[size] bytes, offsets has size+1 entries, and
+        /// slot_count must be a power of two.
+        void attach(const char* buffer, const uint32_t* offsets,
+                    type_id size, const type_id* slots, size_t slot_count);
+
+        /// the raw tables, to write them to a file
+        inline const char* buffer() const {
+            return _buffer;
+        }
+        inline const uint32_t* offsets() const {
+            return _offsets;
+        }
+        inline const type_id* slots() const {
+            return _slots;
+        }
+        inline size_t slot_count() const {
+            return _slot_count;
+        }
+
+    private:
+        /// the slot that holds the string, or the empty slot where
+        /// it would have to go
+        size_t probe(const ByteRange& str) const;
+        void grow();
+        /// point the tables to our own storage
+        void use_owned();
+
+        const char* _buffer;
+        /// start of each string in _buffer, plus the end of the last
+        const uint32_t* _offsets;
+        /// hash table, size is a power of two
+        const type_id* _slots;
+        size_t _slot_count;
+        type_id _size;
+        bool _attached;
+
+        std::vector<char> _owned_buffer;
+        std::vector<uint32_t> _owned_offsets;
+        std::vector<type_id> _owned_slots;
+};
+}  // namespace Align
+
+#endif  // VOCABULARY_H_